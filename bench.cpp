@@ -0,0 +1,727 @@
+// Benchmarks for the orbit assembly pipeline.  Built and run by 'make bench'.
+//
+// Each result is written as one JSON object per line (to --output, or else
+// stdout), so runs can be collected and compared between releases.
+// Progress goes to stderr.
+//
+//   assembly          Channel::post through dequeue_pv_data() to a completed
+//                     orbit, fed as fast as possible.
+//   assembly_partial  the same, but one channel never reports, so every pulse
+//                     stays pending until it is evicted.
+//   assembly_sharded  assembly on 1 to N worker threads (see Orbit's
+//                     'workers'), fed by N posting threads each time.
+//   check             check_for_complete() on its own, over a full set of
+//                     pending pulses, with and without a deadline.
+//   pva_post          PVAOrbitReceiver::setCompletedOrbit() on its own.
+//   pva_packed        the same for PVAOrbitPackedReceiver, with float32.
+//   stats             RollingStatistics::add() over a full window, and
+//                     compute() for a table.
+//   mia               OrbitMIA::analyse() over a full window.
+//   fit               OrbitFit::fit() on one orbit.
+//   e2e               paced pulses with arrival jitter, from the last value
+//                     of a pulse arriving to its PVA post returning.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <new>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <alarm.h>
+#include <db_access.h>
+#include "orbit.h"
+#include "pva_orbit_receiver.h"
+#include "pva_orbit_packed.h"
+#include "orbit_statistics.h"
+#include "orbit_mia.h"
+#include "orbit_fit.h"
+
+static FILE* results = stdout;
+
+//Count every heap allocation in the process.  The replacements are kept
+//out of line, or GCC mistakes the free() for a mismatched deallocation.
+static std::atomic<size_t> num_allocations(0u);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    num_allocations++;
+    void* p = malloc(size ? size : 1u);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Hands the channels of one orbit straight to the benchmark driver, which
+// posts to them from a single thread.  Channels are connected at once.
+class BenchSource : public ChannelSource {
+public:
+    std::vector<Channel*> sinks;
+    virtual void subscribe(Channel* sink) {
+        sinks.push_back(sink);
+        sink->set_connected(true);
+    }
+    virtual void unsubscribe(Channel* sink) {
+        sinks.erase(std::remove(sinks.begin(), sinks.end(), sink), sinks.end());
+    }
+    virtual size_t size() { return sinks.size(); }
+};
+
+// Pulse timestamps: nominal pulse times, with the pulse ID in the low bits
+// of nsec as far as the period allows (see SyntheticSource).
+struct PulseClock {
+    epicsUInt64 start_ns;
+    double period_ns;
+    epicsUInt32 pid_mask;
+    explicit PulseClock(double rate) : period_ns(1e9/rate), pid_mask(0x1FFFFu) {
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        start_ns = epicsUInt64(now.secPastEpoch)*1000000000u + now.nsec;
+        while (pid_mask > 0u && 2.0*(pid_mask + 1u) >= period_ns) {
+            pid_mask >>= 1;
+        }
+    }
+    epicsTimeStamp stamp(size_t k) const {
+        const epicsUInt64 ns = start_ns + epicsUInt64(k*period_ns);
+        epicsTimeStamp ts;
+        ts.secPastEpoch = epicsUInt32(ns/1000000000u);
+        ts.nsec = (epicsUInt32(ns%1000000000u) & ~pid_mask) | (epicsUInt32(k) & pid_mask);
+        return ts;
+    }
+    size_t pulse(const epicsTimeStamp& ts) const {
+        const epicsUInt64 ns = epicsUInt64(ts.secPastEpoch)*1000000000u + ts.nsec;
+        // The pulse ID can put a stamp slightly before the nominal time.
+        return size_t(llround(double(epicsInt64(ns - start_ns))/period_ns));
+    }
+};
+
+// Pulse timestamps taken from the wall clock as each pulse is made, so
+// they never age out however slowly pulses are posted, with the pulse ID in
+// the low bits of nsec.  Blocks of 512 ns divide a second exactly, so the
+// ID always fits.  Stamps keep increasing even if the clock doesn't.
+struct WallClock {
+    epicsUInt64 last_ns;
+    WallClock() : last_ns(0u) {}
+    epicsTimeStamp stamp(size_t k) {
+        static const epicsUInt64 block = 512u;
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        const epicsUInt64 ns = epicsUInt64(now.secPastEpoch)*1000000000u + now.nsec;
+        last_ns = std::max(ns - ns%block, last_ns - last_ns%block + block) + k%block;
+        epicsTimeStamp ts;
+        ts.secPastEpoch = epicsUInt32(last_ns/1000000000u);
+        ts.nsec = epicsUInt32(last_ns%1000000000u);
+        return ts;
+    }
+};
+
+// When the last value of each recent pulse was posted, and the delay from
+// then to delivery of each completed orbit.
+class LatencyLog {
+public:
+    static const size_t RING = 1u << 20;
+    explicit LatencyLog(size_t max_samples) : last_post(RING) {
+        samples.reserve(max_samples);
+    }
+    void posted(size_t k) {
+        last_post[k & (RING - 1u)].store(Clock::now().time_since_epoch().count(), std::memory_order_release);
+    }
+    void delivered(size_t k) {
+        const Clock::rep now = Clock::now().time_since_epoch().count();
+        const Clock::rep then = last_post[k & (RING - 1u)].load(std::memory_order_acquire);
+        std::lock_guard<std::mutex> G(mutex);
+        if (samples.size() < samples.capacity()) {
+            samples.push_back(std::chrono::duration<double>(Clock::duration(now - then)).count());
+        }
+    }
+    size_t count() {
+        std::lock_guard<std::mutex> G(mutex);
+        return samples.size();
+    }
+    // 'q'th quantile, in microseconds.
+    double quantile(double q) {
+        std::lock_guard<std::mutex> G(mutex);
+        if (samples.empty()) {
+            return 0.0;
+        }
+        std::vector<double> sorted(samples);
+        const size_t i = std::min(sorted.size() - 1u, size_t(q*sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+        return sorted[i]*1e6;
+    }
+private:
+    std::vector<std::atomic<Clock::rep>> last_post;
+    std::mutex mutex;
+    std::vector<double> samples;
+};
+
+// Counts orbits on the assembly thread.
+struct CountingReceiver : public Receiver {
+    std::atomic<size_t> orbits;
+    CountingReceiver() : orbits(0u) {}
+    virtual void setNames(const std::vector<std::string>&) {}
+    virtual void setZs(const std::vector<double>&) {}
+    virtual void setCompletedOrbit(const OrbitData&) { orbits++; }
+};
+
+// The real PVA receiver, timing each orbit once it has been posted.
+struct TimedPVAReceiver : public PVAOrbitReceiver {
+    TimedPVAReceiver(Orbit& orbit, const PulseClock& clock, LatencyLog& log) :
+        PVAOrbitReceiver(orbit), clock(clock), log(log) {}
+    virtual void setCompletedOrbit(const OrbitData& o) {
+        PVAOrbitReceiver::setCompletedOrbit(o);
+        log.delivered(clock.pulse(o.ts));
+    }
+    const PulseClock& clock;
+    LatencyLog& log;
+};
+
+static void bpm_list(size_t num_bpms, std::vector<std::string>& names, std::vector<double>& zs) {
+    for (size_t i=0; i<num_bpms; i++) {
+        names.push_back("BPMS:BENCH:" + std::to_string(i));
+        zs.push_back(double(i));
+    }
+}
+
+static void wait_for(std::atomic<size_t>& count, size_t expected, double timeout) {
+    const Clock::time_point start(Clock::now());
+    while (count < expected && seconds_since(start) < timeout) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+// Post pulses back to back for 'duration' seconds, on 'workers' assembly
+// threads, from 'producers' threads each posting to every producers'th
+// channel (as CA contexts would).  Channel 'skip', if any, never reports.
+// Values counted late in the results mean the benchmark, not the orbit,
+// is broken: pulses are stamped as they are made.
+static void bench_assembly(const char* name, size_t num_bpms, double duration, long skip, size_t workers = 1u, size_t producers = 1u) {
+    std::vector<std::string> names;
+    std::vector<double> zs;
+    bpm_list(num_bpms, names, zs);
+    BenchSource source;
+    Orbit orbit(source, names, zs, "", workers);
+    CountingReceiver receiver;
+    orbit.add_receiver(&receiver);
+    const size_t num_channels = source.sinks.size();
+    // Producer 0 stamps each pulse as it starts it, and the others take its
+    // stamp.  Only the throttle on complete orbits keeps them within a few
+    // pulses of each other, so partial pulses get one producer.
+    producers = skip < 0 ? std::max(size_t(1u), std::min(producers, num_channels)) : 1u;
+    WallClock clock;
+    std::vector<epicsTimeStamp> stamps(1024u);
+    std::atomic<size_t> stamped(0u);
+
+    const size_t allocs_before = num_allocations;
+    const Clock::time_point start(Clock::now());
+    std::atomic<bool> stop(false);
+    std::vector<size_t> posted(producers, 0u), sent(producers, 0u);
+    std::vector<std::thread> threads;
+    for (size_t p=0; p<producers; p++) {
+        threads.emplace_back([&, p]() {
+            size_t k = 0u;
+            for (; !stop; k++) {
+                if (p == 0u) {
+                    stamps[k % stamps.size()] = clock.stamp(k);
+                    stamped = k + 1u;
+                } else {
+                    while (stamped <= k && !stop) {
+                        std::this_thread::yield();
+                    }
+                    if (stamped <= k) {
+                        break;
+                    }
+                }
+                const epicsTimeStamp ts(stamps[k % stamps.size()]);
+                for (size_t c=p; c<num_channels; c+=producers) {
+                    if (long(c) == skip) {
+                        continue;
+                    }
+                    const double v = double(c) + 1e-3*k;
+                    source.sinks[c]->post(ts, NO_ALARM, NO_ALARM, DBR_TIME_DOUBLE, 1u, &v);
+                    sent[p]++;
+                }
+                // Don't outrun the queues: they drop rather than block.
+                if (skip < 0) {
+                    while (receiver.orbits + 8u < k && !stop) {
+                        std::this_thread::yield();
+                    }
+                } else if (k % 16u == 15u) {
+                    std::this_thread::yield();
+                }
+            }
+            posted[p] = k;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+    stop = true;
+    for (size_t p=0; p<producers; p++) {
+        threads[p].join();
+    }
+    // Only pulses every producer got to can complete.
+    const size_t pulses = *std::min_element(posted.begin(), posted.end());
+    size_t values = 0u;
+    for (size_t p=0; p<producers; p++) {
+        values += sent[p];
+    }
+    if (skip < 0) {
+        wait_for(receiver.orbits, pulses, 5.0);
+    }
+    const double elapsed = seconds_since(start);
+    const size_t allocs = num_allocations - allocs_before;
+    const OrbitHealth health(orbit.health());
+    orbit.close();
+
+    size_t overflows = 0u;
+    for (size_t c=0; c<num_channels; c++) {
+        overflows += source.sinks[c]->overflows;
+    }
+    fprintf(results, "{\"bench\":\"%s\",\"bpms\":%zu,\"workers\":%zu,\"producers\":%zu,\"seconds\":%.3f,\"pulses\":%zu,\"orbits\":%zu,"
+           "\"pulses_per_s\":%.1f,\"orbits_per_s\":%.1f,\"values_per_s\":%.1f,\"ns_per_value\":%.1f,"
+           "\"late\":%zu,\"overflows\":%zu,\"allocs_per_pulse\":%.4f}\n",
+           name, num_bpms, workers, producers, elapsed, pulses, size_t(receiver.orbits),
+           pulses/elapsed, receiver.orbits/elapsed, values/elapsed, elapsed*1e9/std::max(values, size_t(1u)),
+           health.late, overflows, double(allocs)/std::max(pulses, size_t(1u)));
+    fflush(results);
+}
+
+// check_for_complete() on its own: every slot holds a pulse which channel 0
+// never reports, and the orbit is woken over and over with nothing else to
+// do.  Each pass's check is timed by the orbit itself (check_time, as in
+// OUTPUT_PV:HEALTH).  With a 'deadline', longer than the pulses live, the
+// check also looks for pulses due to be posted.
+static void bench_check(size_t num_bpms, double duration, double deadline) {
+    std::vector<std::string> names;
+    std::vector<double> zs;
+    bpm_list(num_bpms, names, zs);
+    BenchSource source;
+    Orbit orbit(source, names, zs, "");
+    orbit.set_deadline(deadline);
+    const size_t num_channels = source.sinks.size();
+    WallClock clock;
+    // More pulses than there are slots, one at a time so the queues keep up.
+    for (size_t k=0; k<64u; k++) {
+        const epicsTimeStamp ts(clock.stamp(k));
+        for (size_t c=1; c<num_channels; c++) {
+            const double v = double(c);
+            source.sinks[c]->post(ts, NO_ALARM, NO_ALARM, DBR_TIME_DOUBLE, 1u, &v);
+        }
+        const Clock::time_point posted(Clock::now());
+        for (size_t c=1; c<num_channels && seconds_since(posted) < 1.0; ) {
+            if (source.sinks[c]->values.size() > 0u) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            } else {
+                c++;
+            }
+        }
+    }
+    // The pulses age out a second after they were stamped.
+    const double window = std::min(duration, 0.5);
+    const OrbitHealth before(orbit.health());
+    const Clock::time_point start(Clock::now());
+    while (seconds_since(start) < window) {
+        orbit.wake();
+        std::this_thread::yield();
+    }
+    const OrbitHealth after(orbit.health());
+    orbit.close();
+
+    const size_t passes = after.check_time.count - before.check_time.count;
+    const double seconds = after.check_time.sum - before.check_time.sum;
+    fprintf(results, "{\"bench\":\"check\",\"bpms\":%zu,\"deadline\":%g,\"pending\":%zu,\"passes\":%zu,\"ns_per_check\":%.1f}\n",
+           num_bpms, deadline, after.pending, passes, seconds*1e9/std::max(passes, size_t(1u)));
+    fflush(results);
+}
+
+// R is PVAOrbitReceiver or PVAOrbitPackedReceiver, made with 'args'.
+template<typename R, typename... Args>
+static void bench_pva_post(const char* bench, size_t num_bpms, size_t iterations, Args... args) {
+    std::vector<std::string> names;
+    std::vector<double> zs;
+    bpm_list(num_bpms, names, zs);
+    BenchSource source;
+    Orbit orbit(source, names, zs, "");
+    R receiver(orbit, args...);
+    PulseClock clock(120.0);
+
+    OrbitData data;
+    data.resize(num_bpms);
+    for (size_t j=0; j<NUM_AXES; j++) {
+        std::fill(data.severity[j].begin(), data.severity[j].end(), epicsUInt16(NO_ALARM));
+        std::fill(data.status[j].begin(), data.status[j].end(), epicsUInt16(NO_ALARM));
+    }
+    // One round first, so the PV is open and the column pools are primed.
+    data.ts = clock.stamp(0u);
+    receiver.setCompletedOrbit(data);
+
+    const size_t allocs_before = num_allocations;
+    const Clock::time_point start(Clock::now());
+    for (size_t k=1; k<=iterations; k++) {
+        data.ts = clock.stamp(k);
+        for (size_t j=0; j<NUM_AXES; j++) {
+            for (size_t i=0; i<num_bpms; i++) {
+                data.value[j][i] = double(i) + 1e-3*k;
+            }
+        }
+        receiver.setCompletedOrbit(data);
+    }
+    const double elapsed = seconds_since(start);
+    const size_t allocs = num_allocations - allocs_before;
+    receiver.close();
+    orbit.close();
+    fprintf(results, "{\"bench\":\"%s\",\"bpms\":%zu,\"iterations\":%zu,\"seconds\":%.3f,"
+           "\"posts_per_s\":%.1f,\"us_per_post\":%.3f,\"allocs_per_post\":%.2f}\n",
+           bench, num_bpms, iterations, elapsed, iterations/elapsed, elapsed*1e6/iterations,
+           double(allocs)/iterations);
+    fflush(results);
+}
+
+static void bench_stats(size_t num_bpms, size_t window, size_t iterations) {
+    RollingStatistics stats(window);
+    OrbitStatistics out;
+    OrbitData data;
+    data.resize(num_bpms);
+    std::mt19937 rng(1u);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    for (size_t j=0; j<NUM_AXES; j++) {
+        std::fill(data.severity[j].begin(), data.severity[j].end(), epicsUInt16(NO_ALARM));
+        for (size_t i=0; i<num_bpms; i++) {
+            data.value[j][i] = noise(rng);
+        }
+    }
+    // Fill the window first, so every add() also takes a pulse out.
+    for (size_t k=0; k<window; k++) {
+        stats.add(data);
+    }
+    stats.compute(out);
+
+    const size_t allocs_before = num_allocations;
+    const Clock::time_point start(Clock::now());
+    for (size_t k=0; k<iterations; k++) {
+        data.value[AXIS_X][k % num_bpms] += 1e-3;
+        stats.add(data);
+    }
+    const double elapsed = seconds_since(start);
+    const Clock::time_point compute_start(Clock::now());
+    const size_t computes = 10u;
+    for (size_t k=0; k<computes; k++) {
+        stats.compute(out);
+    }
+    const double compute_elapsed = seconds_since(compute_start);
+    const size_t allocs = num_allocations - allocs_before;
+    fprintf(results, "{\"bench\":\"stats\",\"bpms\":%zu,\"window\":%zu,\"iterations\":%zu,\"seconds\":%.3f,"
+           "\"orbits_per_s\":%.1f,\"ns_per_value\":%.2f,\"us_per_compute\":%.1f,\"allocs_per_orbit\":%.4f}\n",
+           num_bpms, window, iterations, elapsed, iterations/elapsed, elapsed*1e9/(iterations*NUM_AXES*num_bpms),
+           compute_elapsed*1e6/computes, double(allocs)/iterations);
+    fflush(results);
+}
+
+static void bench_mia(size_t num_bpms, size_t window, size_t modes, size_t threads) {
+    OrbitMIA mia(window, modes, threads);
+    MIAResult out;
+    OrbitData data;
+    data.resize(num_bpms);
+    std::mt19937 rng(1u);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    for (size_t j=0; j<NUM_AXES; j++) {
+        std::fill(data.severity[j].begin(), data.severity[j].end(), epicsUInt16(NO_ALARM));
+    }
+    // A few betatron-like modes plus noise, so there is something to find.
+    for (size_t k=0; k<window; k++) {
+        const double a = noise(rng), b = noise(rng);
+        for (size_t j=0; j<2u; j++) {
+            for (size_t i=0; i<num_bpms; i++) {
+                data.value[j][i] = a*sin(0.3*i + j) + b*cos(0.3*i + j) + 0.1*noise(rng);
+            }
+        }
+        mia.add(data);
+    }
+    // The first analysis starts from scratch, later ones from the last modes.
+    mia.snapshot();
+    Clock::time_point start(Clock::now());
+    mia.analyse(out);
+    const double cold = seconds_since(start);
+    const size_t repeats = 3u;
+    start = Clock::now();
+    for (size_t k=0; k<repeats; k++) {
+        mia.snapshot();
+        mia.analyse(out);
+    }
+    const double warm = seconds_since(start)/repeats;
+    fprintf(results, "{\"bench\":\"mia\",\"bpms\":%zu,\"pulses\":%zu,\"modes\":%zu,\"threads\":%zu,"
+           "\"ms_first\":%.1f,\"ms_per_analysis\":%.1f}\n",
+           num_bpms, window, modes, threads, cold*1e3, warm*1e3);
+    fflush(results);
+}
+
+static void bench_fit(size_t num_bpms, size_t points, size_t bpms_per_fit, size_t iterations) {
+    // Smooth made up optics, with dispersion everywhere so the energy is fitted.
+    std::vector<std::string> names(num_bpms);
+    std::vector<ElementOptics> model(num_bpms);
+    for (size_t i=0; i<num_bpms; i++) {
+        names[i] = "BPMS:BENCH:" + std::to_string(i);
+        ElementOptics& e = model[i];
+        e.name = names[i];
+        e.p0c = 0.0;
+        e.x.beta = 10.0 + 5.0*sin(0.7*i);
+        e.x.alpha = 0.5*cos(0.7*i);
+        e.x.psi = 0.4*i;
+        e.x.eta = 0.1 + 0.05*sin(0.3*i);
+        e.x.etap = 0.0;
+        e.y = e.x;
+        e.y.eta = 0.0;
+    }
+    std::vector<std::string> at;
+    for (size_t f=0; f<points; f++) {
+        at.push_back(names[f*(num_bpms/points)]);
+    }
+    OrbitFit fit;
+    fit.build(names, model, at, bpms_per_fit);
+    OrbitData data;
+    data.resize(num_bpms);
+    std::mt19937 rng(1u);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    for (size_t j=0; j<NUM_AXES; j++) {
+        std::fill(data.severity[j].begin(), data.severity[j].end(), epicsUInt16(NO_ALARM));
+        for (size_t i=0; i<num_bpms; i++) {
+            data.value[j][i] = noise(rng);
+        }
+    }
+    OrbitFitResult out;
+    fit.fit(data, out);
+    const size_t allocs_before = num_allocations;
+    const Clock::time_point start(Clock::now());
+    for (size_t k=0; k<iterations; k++) {
+        data.value[AXIS_X][k % num_bpms] += 1e-3;
+        fit.fit(data, out);
+    }
+    const double elapsed = seconds_since(start);
+    const size_t allocs = num_allocations - allocs_before;
+    fprintf(results, "{\"bench\":\"fit\",\"bpms\":%zu,\"points\":%zu,\"bpms_per_fit\":%zu,\"iterations\":%zu,"
+           "\"ns_per_orbit\":%.1f,\"allocs_per_orbit\":%.4f}\n",
+           num_bpms, points, bpms_per_fit, iterations, elapsed*1e9/iterations, double(allocs)/iterations);
+    fflush(results);
+}
+
+// One update due to be posted.  Ordered so the heap pops the earliest.
+struct Arrival {
+    double at;
+    size_t pulse;
+    size_t channel;
+    bool operator<(const Arrival& o) const {
+        return at > o.at || (at == o.at && pulse > o.pulse);
+    }
+};
+
+static void wait_until(Clock::time_point start, double t) {
+    while (true) {
+        const double wait = t - seconds_since(start);
+        if (wait <= 0.0) {
+            return;
+        }
+        // Yield rather than spin, so the pipeline isn't starved on small hosts.
+        if (wait > 200e-6) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait - 100e-6));
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Pulses at 'rate', each channel reporting up to 'jitter' seconds late.  A
+// channel's updates still arrive in order, as they would over CA.
+static void bench_e2e(size_t num_bpms, double rate, double jitter, double duration) {
+    std::vector<std::string> names;
+    std::vector<double> zs;
+    bpm_list(num_bpms, names, zs);
+    BenchSource source;
+    Orbit orbit(source, names, zs, "");
+    PulseClock clock(rate);
+    size_t max_pulses = size_t(rate*duration) + 1u;
+    LatencyLog log(max_pulses);
+    TimedPVAReceiver receiver(orbit, clock, log);
+    const size_t num_channels = source.sinks.size();
+
+    std::mt19937 rng(1u);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<double> last_arrival(num_channels, 0.0);
+    std::vector<Arrival> heap;
+    heap.reserve(num_channels*(size_t(jitter*rate) + 2u));
+    std::vector<size_t> remaining(LatencyLog::RING, 0u);
+
+    const size_t allocs_before = num_allocations;
+    const Clock::time_point start(Clock::now());
+    size_t k = 0u;
+    double behind = 0.0;
+    while (k < max_pulses || !heap.empty()) {
+        const double next_pulse = k < max_pulses ? k/rate : INFINITY;
+        if (!heap.empty() && heap.front().at <= next_pulse) {
+            std::pop_heap(heap.begin(), heap.end());
+            const Arrival a(heap.back());
+            heap.pop_back();
+            wait_until(start, a.at);
+            behind = std::max(behind, seconds_since(start) - a.at);
+            // Stamp before posting, since the orbit may be out before post() returns.
+            if (--remaining[a.pulse & (LatencyLog::RING - 1u)] == 0u) {
+                log.posted(a.pulse);
+            }
+            const double v = double(a.channel) + 1e-3*a.pulse;
+            source.sinks[a.channel]->post(clock.stamp(a.pulse), NO_ALARM, NO_ALARM, DBR_TIME_DOUBLE, 1u, &v);
+            continue;
+        }
+        // Stop early if the driver can't keep up, rather than run on for ever.
+        if (seconds_since(start) > duration + 1.0) {
+            max_pulses = k;
+            continue;
+        }
+        if (jitter <= 0.0) {
+            wait_until(start, next_pulse);
+            behind = std::max(behind, seconds_since(start) - next_pulse);
+            const epicsTimeStamp ts(clock.stamp(k));
+            for (size_t c=0; c<num_channels; c++) {
+                if (c + 1u == num_channels) {
+                    log.posted(k);
+                }
+                const double v = double(c) + 1e-3*k;
+                source.sinks[c]->post(ts, NO_ALARM, NO_ALARM, DBR_TIME_DOUBLE, 1u, &v);
+            }
+            k++;
+            continue;
+        }
+        remaining[k & (LatencyLog::RING - 1u)] = num_channels;
+        for (size_t c=0; c<num_channels; c++) {
+            Arrival a;
+            a.at = last_arrival[c] = std::max(last_arrival[c], next_pulse + jitter*uniform(rng));
+            a.pulse = k;
+            a.channel = c;
+            heap.push_back(a);
+            std::push_heap(heap.begin(), heap.end());
+        }
+        k++;
+    }
+    // Let the last orbits drain through the receiver.
+    const Clock::time_point drain(Clock::now());
+    while (log.count() < k && seconds_since(drain) < 2.0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const double elapsed = seconds_since(start);
+    const size_t allocs = num_allocations - allocs_before;
+    receiver.close();
+    orbit.close();
+    const size_t delivered = log.count();
+    size_t overflows = 0u;
+    for (size_t c=0; c<num_channels; c++) {
+        overflows += source.sinks[c]->overflows;
+    }
+    fprintf(results, "{\"bench\":\"e2e\",\"bpms\":%zu,\"rate\":%.1f,\"jitter_us\":%.1f,\"seconds\":%.3f,"
+           "\"pulses\":%zu,\"orbits\":%zu,\"orbits_per_s\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_behind_us\":%.1f,\"overflows\":%zu,\"allocs_per_orbit\":%.2f}\n",
+           num_bpms, rate, jitter*1e6, elapsed, k, delivered, delivered/elapsed,
+           log.quantile(0.5), log.quantile(0.99), log.quantile(0.999), behind*1e6, overflows,
+           double(allocs)/std::max(delivered, size_t(1u)));
+    fflush(results);
+}
+
+// Parse a comma separated list of numbers.
+static std::vector<double> parse_list(const char* s) {
+    std::vector<double> out;
+    while (*s) {
+        char* end;
+        out.push_back(strtod(s, &end));
+        if (end == s) {
+            break;
+        }
+        s = *end == ',' ? end + 1 : end;
+    }
+    return out;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<double> bpms(parse_list("100,500,1000,2000,5000"));
+    std::vector<double> rates(parse_list("120,1000,10000"));
+    std::vector<double> jitters(parse_list("0,0.0001,0.001"));
+    std::vector<double> workers(parse_list("1,2,4,8"));
+    double duration = 2.0;
+    bool micro = true, e2e = true;
+    for (int i=1; i<argc; i++) {
+        if (strncmp(argv[i], "--bpms=", 7) == 0) {
+            bpms = parse_list(argv[i] + 7);
+        } else if (strncmp(argv[i], "--rates=", 8) == 0) {
+            rates = parse_list(argv[i] + 8);
+        } else if (strncmp(argv[i], "--jitters=", 10) == 0) {
+            jitters = parse_list(argv[i] + 10);
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            workers = parse_list(argv[i] + 10);
+        } else if (strncmp(argv[i], "--seconds=", 10) == 0) {
+            duration = strtod(argv[i] + 10, NULL);
+        } else if (strncmp(argv[i], "--output=", 9) == 0) {
+            results = fopen(argv[i] + 9, "w");
+            if (!results) {
+                fprintf(stderr, "Could not open %s\n", argv[i] + 9);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--micro-only") == 0) {
+            e2e = false;
+        } else if (strcmp(argv[i], "--e2e-only") == 0) {
+            micro = false;
+        } else {
+            fprintf(stderr, "Usage: %s [--bpms=N,...] [--rates=HZ,...] [--jitters=SEC,...] [--workers=N,...] [--seconds=S] [--micro-only|--e2e-only] [--output=FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    for (size_t b=0; b<bpms.size(); b++) {
+        const size_t n = size_t(bpms[b]);
+        if (micro) {
+            fprintf(stderr, "assembly, %zu BPMs\n", n);
+            bench_assembly("assembly", n, duration, -1);
+            bench_assembly("assembly_partial", n, duration, 0);
+            fprintf(stderr, "assembly_sharded, %zu BPMs\n", n);
+            const size_t producers = size_t(*std::max_element(workers.begin(), workers.end()));
+            for (size_t w=0; w<workers.size(); w++) {
+                bench_assembly("assembly_sharded", n, duration, -1, size_t(workers[w]), producers);
+            }
+            fprintf(stderr, "check, %zu BPMs\n", n);
+            bench_check(n, duration, 0.0);
+            bench_check(n, duration, 10.0);
+            fprintf(stderr, "pva_post, %zu BPMs\n", n);
+            bench_pva_post<PVAOrbitReceiver>("pva_post", n, 1000u);
+            fprintf(stderr, "pva_packed, %zu BPMs\n", n);
+            bench_pva_post<PVAOrbitPackedReceiver>("pva_packed", n, 1000u, PACKED_FLOAT32);
+            fprintf(stderr, "stats, %zu BPMs\n", n);
+            bench_stats(n, 1000u, 10000u);
+            if (n <= 1000u) {
+                fprintf(stderr, "mia, %zu BPMs\n", n);
+                bench_mia(n, 1000u, 8u, 2u);
+            }
+            fprintf(stderr, "fit, %zu BPMs\n", n);
+            bench_fit(n, 10u, 10u, 100000u);
+        }
+        for (size_t r=0; e2e && r<rates.size(); r++) {
+            for (size_t j=0; j<jitters.size(); j++) {
+                fprintf(stderr, "e2e, %zu BPMs at %g Hz, jitter %g s\n", n, rates[r], jitters[j]);
+                bench_e2e(n, rates[r], jitters[j], duration);
+            }
+        }
+    }
+    fclose(results);
+    return 0;
+}
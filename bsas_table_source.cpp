@@ -0,0 +1,205 @@
+#include "bsas_table_source.h"
+#include "orbit.h"
+#include <stdio.h>
+#include <map>
+#include <set>
+#include <cmath>
+#include <algorithm>
+
+BSASTableSource::BSASTableSource(const std::string& pvname) :
+    pvname(pvname),
+    context(pvxs::client::Config::from_env().build()),
+    remap_needed(true),
+    seconds_column(NO_COLUMN),
+    nanos_column(NO_COLUMN)
+{
+    sub = context.monitor(pvname)
+        .record("pipeline", true)
+        .record("queueSize", uint32_t(4u))
+        .maskConnected(true)
+        .maskDisconnected(false)
+        .event([this](pvxs::client::Subscription& s) { onEvent(s); })
+        .exec();
+}
+
+BSASTableSource::~BSASTableSource() {
+    close();
+}
+
+void BSASTableSource::close() {
+    if(!sub) {
+        return;
+    }
+    // Waits out a callback in progress.
+    sub->cancel();
+    sub.reset();
+}
+
+void BSASTableSource::subscribe(Channel* sink) {
+    Guard G(mutex);
+    sinks.push_back(sink);
+    remap_needed = true;
+}
+
+void BSASTableSource::unsubscribe(Channel* sink) {
+    Guard G(mutex);
+    sinks.erase(std::remove(sinks.begin(), sinks.end(), sink), sinks.end());
+    for(size_t f=0, NF=feeds.size(); f<NF; f++) {
+        std::vector<Column>& cols = feeds[f].columns;
+        for(size_t k=0, N=cols.size(); k<N; k++) {
+            if(cols[k].sink == sink) {
+                cols.erase(cols.begin() + k);
+                break;
+            }
+        }
+    }
+    remap_needed = true;
+}
+
+size_t BSASTableSource::size() {
+    Guard G(mutex);
+    std::set<std::string> names;
+    for(size_t i=0, N=sinks.size(); i<N; i++) {
+        names.insert(sinks[i]->name);
+    }
+    return names.size();
+}
+
+// Called on the context's worker thread whenever the queue becomes
+// non-empty; empty it, acknowledging as we go.
+void BSASTableSource::onEvent(pvxs::client::Subscription& s) {
+    while(true) {
+        try {
+            pvxs::Value update(s.pop());
+            if(!update) {
+                return;
+            }
+            post(update);
+        } catch(pvxs::client::Disconnect&) {
+            Guard G(mutex);
+            for(size_t i=0, N=sinks.size(); i<N; i++) {
+                sinks[i]->set_connected(false);
+            }
+            // Reconnect everything found in the first update after this.
+            remap_needed = true;
+        } catch(pvxs::client::RemoteError& err) {
+            printf("Monitor error for %s: %s\n", pvname.c_str(), err.what());
+        } catch(std::exception& err) {
+            printf("Unexpected exception in BSASTableSource::onEvent() for %s: %s\n", pvname.c_str(), err.what());
+        }
+    }
+}
+
+// Work out which column feeds which channel, grouping the channels by
+// orbit, and connect exactly the channels which have one.
+void BSASTableSource::remap(const pvxs::shared_array<const std::string>& new_labels) {
+    labels = new_labels;
+    remap_needed = false;
+    std::map<std::string, size_t> by_label;
+    for(size_t k=0, N=labels.size(); k<N; k++) {
+        by_label[labels[k]] = k;
+    }
+    std::map<std::string, size_t>::const_iterator it;
+    seconds_column = (it = by_label.find("secondsPastEpoch")) == by_label.end() ? NO_COLUMN : it->second;
+    nanos_column = (it = by_label.find("nanoseconds")) == by_label.end() ? NO_COLUMN : it->second;
+    if(seconds_column == NO_COLUMN || nanos_column == NO_COLUMN) {
+        printf("%s has no secondsPastEpoch and nanoseconds columns, ignoring it\n", pvname.c_str());
+    }
+    feeds.clear();
+    for(size_t i=0, N=sinks.size(); i<N; i++) {
+        Channel* sink = sinks[i];
+        it = by_label.find(sink->name);
+        if(it == by_label.end() || seconds_column == NO_COLUMN || nanos_column == NO_COLUMN) {
+            sink->set_connected(false);
+            continue;
+        }
+        Column col;
+        col.sink = sink;
+        col.value = it->second;
+        col.sevr = (it = by_label.find(sink->name + ".SEVR")) == by_label.end() ? NO_COLUMN : it->second;
+        col.stat = (it = by_label.find(sink->name + ".STAT")) == by_label.end() ? NO_COLUMN : it->second;
+        size_t f = 0;
+        while(f < feeds.size() && feeds[f].orbit != &sink->orbit) {
+            f++;
+        }
+        if(f == feeds.size()) {
+            feeds.push_back(Feed());
+            feeds[f].orbit = &sink->orbit;
+        }
+        feeds[f].columns.push_back(col);
+        sink->set_connected(true);
+    }
+}
+
+// Copy one column into 'dest', padding it out to 'rows' with 'fill'.
+template<typename T>
+static void copy_column(const pvxs::Value& column, T* dest, size_t rows, T fill) {
+    const pvxs::shared_array<const T> src(column.as<pvxs::shared_array<const T>>());
+    const size_t n = std::min(src.size(), rows);
+    std::copy(src.begin(), src.begin() + n, dest);
+    std::fill(dest + n, dest + rows, fill);
+}
+
+void BSASTableSource::post(const pvxs::Value& update) {
+    const std::chrono::steady_clock::time_point received(std::chrono::steady_clock::now());
+    Guard G(mutex);
+    const pvxs::shared_array<const std::string> new_labels(update["labels"].as<pvxs::shared_array<const std::string>>());
+    if(remap_needed || new_labels.size() != labels.size() || !std::equal(labels.begin(), labels.end(), new_labels.begin())) {
+        remap(new_labels);
+    }
+    if(seconds_column == NO_COLUMN || nanos_column == NO_COLUMN) {
+        return;
+    }
+    columns.clear();
+    const pvxs::Value value(update["value"]);
+    for(const pvxs::Value& column : value.ichildren()) {
+        columns.push_back(column);
+    }
+    if(columns.size() != labels.size()) {
+        printf("%s has %zu labels for %zu columns, ignoring update\n", pvname.c_str(), labels.size(), columns.size());
+        return;
+    }
+    const pvxs::shared_array<const epicsUInt32> seconds(columns[seconds_column].as<pvxs::shared_array<const epicsUInt32>>());
+    const pvxs::shared_array<const epicsUInt32> nanos(columns[nanos_column].as<pvxs::shared_array<const epicsUInt32>>());
+    const size_t R = std::min(seconds.size(), nanos.size());
+    if(R == 0u) {
+        return;
+    }
+    for(size_t f=0, NF=feeds.size(); f<NF; f++) {
+        const Feed& feed = feeds[f];
+        TableFeed& table = feed.orbit->table;
+        RowBlock* block = table.blocks.back();
+        if(!block) {
+            table.overflows++;
+            continue;
+        }
+        block->received = received;
+        block->ts.resize(R);
+        for(size_t r=0; r<R; r++) {
+            block->ts[r].secPastEpoch = seconds[r] - POSIX_TIME_AT_EPICS_EPOCH;
+            block->ts[r].nsec = nanos[r];
+        }
+        const size_t C = feed.columns.size();
+        block->channels.resize(C);
+        block->values.resize(C*R);
+        block->sevr.resize(C*R);
+        block->stat.resize(C*R);
+        for(size_t k=0; k<C; k++) {
+            const Column& col = feed.columns[k];
+            block->channels[k] = col.sink->index;
+            copy_column<double>(columns[col.value], &block->values[k*R], R, NAN);
+            if(col.sevr != NO_COLUMN) {
+                copy_column<epicsUInt16>(columns[col.sevr], &block->sevr[k*R], R, INVALID_ALARM);
+            } else {
+                std::fill(block->sevr.begin() + k*R, block->sevr.begin() + (k + 1u)*R, epicsUInt16(NO_ALARM));
+            }
+            if(col.stat != NO_COLUMN) {
+                copy_column<epicsUInt16>(columns[col.stat], &block->stat[k*R], R, UDF_ALARM);
+            } else {
+                std::fill(block->stat.begin() + k*R, block->stat.begin() + (k + 1u)*R, epicsUInt16(NO_ALARM));
+            }
+        }
+        table.blocks.push();
+        feed.orbit->wake();
+    }
+}
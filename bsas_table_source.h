@@ -0,0 +1,59 @@
+#ifndef BSAS_TABLE_SOURCE_H
+#define BSAS_TABLE_SOURCE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <pvxs/client.h>
+#include <pvxs/data.h>
+#include <pvxs/sharedArray.h>
+#include "pv.h"
+
+// Feeds orbits from one BSAS-style NTTable PV, each update of which holds
+// one or more pulses for many channels, instead of a monitor per channel.
+// The table's labels name its columns: "secondsPastEpoch" and "nanoseconds"
+// give each row's timestamp, a column labelled with a channel's name holds
+// its values, and optional "<name>.SEVR" and "<name>.STAT" columns its
+// alarms.  Rows are handed to each orbit's TableFeed whole, so they skip
+// the per-channel queues.  Channels without a column count as disconnected.
+class BSASTableSource : public ChannelSource {
+public:
+    explicit BSASTableSource(const std::string& pvname);
+    virtual ~BSASTableSource();
+    virtual void subscribe(Channel* sink);
+    virtual void unsubscribe(Channel* sink);
+    virtual size_t size();
+    void close();
+private:
+    static const size_t NO_COLUMN = size_t(-1);
+    // where one channel's data is in the table
+    struct Column {
+        Channel* sink;
+        size_t value, sevr, stat;
+    };
+    // the channels of one orbit found in the table
+    struct Feed {
+        Orbit* orbit;
+        std::vector<Column> columns;
+    };
+    void onEvent(pvxs::client::Subscription& s);
+    void post(const pvxs::Value& update);
+    void remap(const pvxs::shared_array<const std::string>& new_labels);
+    const std::string pvname;
+    pvxs::client::Context context;
+    // guards everything below, and is held while posting
+    epicsMutex mutex;
+    std::vector<Channel*> sinks;
+    // labels the feeds were worked out for, and whether sinks have come or
+    // gone since
+    pvxs::shared_array<const std::string> labels;
+    bool remap_needed;
+    size_t seconds_column, nanos_column;
+    std::vector<Feed> feeds;
+    // the table's columns, reused from one update to the next
+    std::vector<pvxs::Value> columns;
+    std::shared_ptr<pvxs::client::Subscription> sub;
+    EPICS_NOT_COPYABLE(BSASTableSource)
+};
+
+#endif //BSAS_TABLE_SOURCE_H
@@ -0,0 +1,88 @@
+#ifndef COLUMN_POOL_H
+#define COLUMN_POOL_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <pvxs/sharedArray.h>
+
+// Recycles the buffers behind published array columns.  An array handed
+// out by get() returns its buffer to the pool once pvxs, and every client
+// queue holding it, lets go.  The pool's state is shared with those arrays,
+// so it may safely go away first.
+template<typename T>
+class ColumnPool {
+    struct State {
+        std::mutex lock;
+        std::vector<T*> spare;
+        size_t length;
+        size_t allocations;
+        State() : length(0u), allocations(0u) {}
+        ~State() {
+            for (size_t i=0, N=spare.size(); i<N; i++) {
+                delete[] spare[i];
+            }
+        }
+    };
+    struct Recycle {
+        std::shared_ptr<State> state;
+        size_t length;
+        void operator()(T* buf) const {
+            {
+                std::lock_guard<std::mutex> G(state->lock);
+                if (length == state->length && state->spare.size() < 64u) {
+                    state->spare.push_back(buf);
+                    return;
+                }
+            }
+            delete[] buf;
+        }
+    };
+    std::shared_ptr<State> state;
+public:
+    ColumnPool() : state(new State) {}
+
+    // Change the column length, discarding buffers of the old length.
+    void resize(size_t length) {
+        std::vector<T*> old;
+        {
+            std::lock_guard<std::mutex> G(state->lock);
+            state->length = length;
+            old.swap(state->spare);
+        }
+        for (size_t i=0, N=old.size(); i<N; i++) {
+            delete[] old[i];
+        }
+    }
+
+    // A writable column, to be filled and then freeze()d for publishing.
+    pvxs::shared_array<T> get() {
+        T* buf = 0;
+        size_t length;
+        {
+            std::lock_guard<std::mutex> G(state->lock);
+            length = state->length;
+            if (!state->spare.empty()) {
+                buf = state->spare.back();
+                state->spare.pop_back();
+            } else {
+                state->allocations++;
+            }
+        }
+        if (!buf) {
+            buf = new T[length];
+        }
+        Recycle recycle;
+        recycle.state = state;
+        recycle.length = length;
+        return pvxs::shared_array<T>(buf, recycle, length);
+    }
+
+    // number of buffers ever allocated by this pool
+    size_t allocations() const {
+        std::lock_guard<std::mutex> G(state->lock);
+        return state->allocations;
+    }
+};
+
+#endif // COLUMN_POOL_H
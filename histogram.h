@@ -0,0 +1,144 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <vector>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <epicsTypes.h>
+
+// Lock-free histogram of durations, with power-of-two buckets in
+// microseconds: bucket 0 counts samples under 1us, bucket i those under
+// 2^i us, and the last bucket everything longer.  Any thread may add().
+class Histogram {
+public:
+    static const size_t NUM_BUCKETS = 24u;
+
+    struct Snapshot {
+        std::vector<epicsUInt64> counts;
+        epicsUInt64 count;
+        // in seconds
+        double sum;
+        double max;
+    };
+
+    Histogram() : buckets(NUM_BUCKETS), sum_ns(0u), max_ns(0u) {
+        for (size_t i=0; i<NUM_BUCKETS; i++) {
+            buckets[i].store(0u, std::memory_order_relaxed);
+        }
+    }
+
+    void add(std::chrono::steady_clock::duration d) {
+        const epicsInt64 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        const epicsUInt64 n = ns > 0 ? epicsUInt64(ns) : 0u;
+        epicsUInt64 us = n/1000u;
+        size_t b = 0u;
+        while (us && b < NUM_BUCKETS - 1u) {
+            us >>= 1;
+            b++;
+        }
+        buckets[b].fetch_add(1u, std::memory_order_relaxed);
+        sum_ns.fetch_add(n, std::memory_order_relaxed);
+        epicsUInt64 prev = max_ns.load(std::memory_order_relaxed);
+        while (n > prev && !max_ns.compare_exchange_weak(prev, n, std::memory_order_relaxed)) {}
+    }
+
+    void add(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+        add(end - start);
+    }
+
+    Snapshot snapshot() const {
+        Snapshot s;
+        s.counts.resize(NUM_BUCKETS);
+        s.count = 0u;
+        for (size_t i=0; i<NUM_BUCKETS; i++) {
+            s.counts[i] = buckets[i].load(std::memory_order_relaxed);
+            s.count += s.counts[i];
+        }
+        s.sum = sum_ns.load(std::memory_order_relaxed)*1e-9;
+        s.max = max_ns.load(std::memory_order_relaxed)*1e-9;
+        return s;
+    }
+
+    // Upper edge of bucket 'i' in microseconds; the last bucket has none.
+    static double upper_us(size_t i) {
+        return double(epicsUInt64(1u) << i);
+    }
+
+private:
+    std::vector<std::atomic<epicsUInt64>> buckets;
+    std::atomic<epicsUInt64> sum_ns;
+    std::atomic<epicsUInt64> max_ns;
+
+    Histogram(const Histogram&);
+    Histogram& operator=(const Histogram&);
+};
+
+// Approximate quantiles of recent durations, for one writer: counts in
+// log buckets of microseconds, four per octave, with every count halved
+// once the total reaches DECAY_AT so that old samples fade out.  Small
+// enough to keep one per channel.
+class QuantileSketch {
+public:
+    static const size_t NUM_BUCKETS = 96u;
+    static const epicsUInt32 DECAY_AT = 2048u;
+
+    QuantileSketch() : total(0u) {
+        counts.fill(0u);
+    }
+
+    void add(std::chrono::steady_clock::duration d) {
+        const epicsInt64 us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        counts[bucket(us > 0 ? epicsUInt64(us) : 0u)]++;
+        if (++total >= DECAY_AT) {
+            total = 0u;
+            for (size_t i=0; i<NUM_BUCKETS; i++) {
+                counts[i] >>= 1;
+                total += counts[i];
+            }
+        }
+    }
+
+    bool empty() const { return total == 0u; }
+
+    // Upper edge, in microseconds, of the bucket holding the q'th quantile.
+    double quantile(double q) const {
+        const double target = q*total;
+        epicsUInt32 seen = 0u;
+        for (size_t b=0; b<NUM_BUCKETS; b++) {
+            seen += counts[b];
+            if (seen > 0u && seen >= target) {
+                return upper_us(b);
+            }
+        }
+        return 0.0;
+    }
+
+private:
+    // 0 for 0us, then 1 + 4*octave + quarter.
+    static size_t bucket(epicsUInt64 us) {
+        if (us == 0u) {
+            return 0u;
+        }
+        size_t msb = 0u;
+        while (us >> (msb + 1u)) {
+            msb++;
+        }
+        const size_t quarter = msb >= 2u ? (us >> (msb - 2u)) & 3u : (us << (2u - msb)) & 3u;
+        const size_t b = 1u + 4u*msb + quarter;
+        return b < NUM_BUCKETS ? b : NUM_BUCKETS - 1u;
+    }
+
+    static double upper_us(size_t b) {
+        if (b == 0u) {
+            return 1.0;
+        }
+        const size_t msb = (b - 1u)/4u, quarter = (b - 1u)%4u;
+        return double(epicsUInt64(5u + quarter) << msb)/4.0;
+    }
+
+    std::array<epicsUInt16, NUM_BUCKETS> counts;
+    epicsUInt32 total;
+};
+
+#endif //HISTOGRAM_H
@@ -5,6 +5,10 @@
 #include <thread>
 #include <fstream>
 #include <string>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <algorithm>
 #include <epicsThread.h>
 #include <pvxs/server.h>
 #include <pvxs/util.h>
@@ -12,60 +16,427 @@
 #include <pvxs/log.h>
 #include "orbit.h"
 #include "pva_orbit_receiver.h"
+#include "pva_orbit_source.h"
+#include "pva_orbit_packed.h"
+#include "pva_orbit_history_receiver.h"
+#include "pva_orbit_health.h"
+#include "pva_orbit_lateness.h"
+#include "pva_orbit_statistics.h"
+#include "pva_orbit_mia.h"
+#include "pva_orbit_fit.h"
+#include "pva_orbit_window.h"
+#include "synthetic_source.h"
+#include "pva_channel_pool.h"
+#include "bsas_table_source.h"
+#include "orbit_recording.h"
+#include "replay_source.h"
+#include "model_watcher.h"
+
+//One orbit served by this process.
+struct OrbitDefinition {
+    std::string model_pv;
+    std::string edef;
+    std::string output_pv;
+};
+
+//An extra output PV derived from each orbit's stream, see parse_stream().
+enum StreamKind { STREAM_EVERY, STREAM_AVERAGE, STREAM_ENVELOPE };
+struct StreamDefinition {
+    std::string suffix;
+    StreamKind kind;
+    double arg;
+};
+
+//Parse "SUFFIX,every,N", "SUFFIX,average,SEC" or "SUFFIX,envelope,SEC".
+static bool parse_stream(const char* s, StreamDefinition& stream) {
+    std::istringstream fields(s);
+    std::string kind, arg;
+    if (!std::getline(fields, stream.suffix, ',') || !std::getline(fields, kind, ',') || !std::getline(fields, arg) || stream.suffix.empty()) {
+        return false;
+    }
+    if (kind == "every") {
+        stream.kind = STREAM_EVERY;
+    } else if (kind == "average") {
+        stream.kind = STREAM_AVERAGE;
+    } else if (kind == "envelope") {
+        stream.kind = STREAM_ENVELOPE;
+    } else {
+        return false;
+    }
+    stream.arg = strtod(arg.c_str(), NULL);
+    return stream.kind == STREAM_EVERY ? stream.arg >= 1.0 : stream.arg > 0.0;
+}
+
+//Read orbit definitions from a file, one "MODEL_PV EDEF OUTPUT_PV" per line.
+//Blank lines and lines starting with '#' are ignored.
+static bool read_config(const char* filename, std::vector<OrbitDefinition>& defs) {
+    std::ifstream file(filename);
+    if (!file) {
+        fprintf(stderr, "Could not open config file %s\n", filename);
+        return false;
+    }
+    std::string line;
+    size_t lineno = 0;
+    while (std::getline(file, line)) {
+        lineno++;
+        std::istringstream fields(line);
+        OrbitDefinition def;
+        if (!(fields >> def.model_pv) || def.model_pv[0] == '#') {
+            continue;
+        }
+        if (!(fields >> def.edef >> def.output_pv)) {
+            fprintf(stderr, "%s:%zu: expected MODEL_PV EDEF OUTPUT_PV\n", filename, lineno);
+            return false;
+        }
+        defs.push_back(def);
+    }
+    return true;
+}
+
+//Split a comma separated list of names.
+static std::vector<std::string> split_names(const char* s) {
+    std::vector<std::string> out;
+    std::istringstream list(s);
+    std::string name;
+    while (std::getline(list, name, ',')) {
+        if (!name.empty()) {
+            out.push_back(name);
+        }
+    }
+    return out;
+}
+
+//Convert POSIX seconds, as given on the command line, to a pulse key.
+static epicsUInt64 posix_to_key(double seconds) {
+    const double epics = seconds - POSIX_TIME_AT_EPICS_EPOCH;
+    const epicsUInt32 sec = epicsUInt32(epics);
+    return epicsUInt64(sec) << 32 | epicsUInt32((epics - sec)*1e9);
+}
+
+//Get the BPM names and Z positions from a get of a model PV.
+static void fetch_model(pvxs::client::Operation& get, double timeout,
+                        std::vector<std::string>& bpm_names, std::vector<double>& bpm_z_vals) {
+    read_bpms(get.wait(timeout), bpm_names, bpm_z_vals);
+}
 
 int main (int argc, char *argv[]) {
+    //Pull out the options, leaving the positional arguments in argv.
+    bool latestOnly = false;
+    size_t historyDepth = 0;
+    size_t statsWindow = 0;
+    double statsPeriod = 1.0;
+    size_t miaWindow = 0;
+    size_t miaModes = 8;
+    size_t miaThreads = 2;
+    double miaPeriod = 5.0;
+    std::vector<std::string> fitPoints;
+    size_t fitBPMs = 10;
+    std::vector<StreamDefinition> streams;
+    double modelTimeout = 4.0;
+    bool reloadModels = true;
+    double startupFraction = 0.0;
+    double startupTimeout = 10.0;
+    bool packedOrbits = false;
+    PackedPrecision packedPrecision = PACKED_FLOAT64;
+    size_t numContexts = 1;
+    size_t assemblyThreads = 1;
+    size_t numPVAContexts = 1;
+    bool pvaSource = false;
+    const char* bsasTable = NULL;
+    const char* recordDir = NULL;
+    ReplayConfig replayConfig;
+    double deadline = 0.0;
+    bool adaptiveDeadline = false;
+    bool finalOrbits = false;
+    const char* configFile = NULL;
+    size_t fakeBPMs = 101;
+    SyntheticConfig fakeConfig;
+    QueuePolicy queuePolicy = QUEUE_DROP_OLDEST;
+    int nargs = 1;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--latest-only") == 0) {
+            latestOnly = true;
+        } else if (strcmp(argv[i], "--queue-policy=drop-oldest") == 0) {
+            queuePolicy = QUEUE_DROP_OLDEST;
+        } else if (strcmp(argv[i], "--queue-policy=drop-newest") == 0) {
+            queuePolicy = QUEUE_DROP_NEWEST;
+        } else if (strcmp(argv[i], "--queue-policy=block") == 0) {
+            queuePolicy = QUEUE_BLOCK;
+        } else if (strncmp(argv[i], "--history=", 10) == 0) {
+            historyDepth = strtoul(argv[i] + 10, NULL, 10);
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            statsWindow = strtoul(argv[i] + 8, NULL, 10);
+        } else if (strncmp(argv[i], "--stats-period=", 15) == 0) {
+            statsPeriod = strtod(argv[i] + 15, NULL);
+        } else if (strncmp(argv[i], "--mia=", 6) == 0) {
+            miaWindow = strtoul(argv[i] + 6, NULL, 10);
+        } else if (strncmp(argv[i], "--mia-modes=", 12) == 0) {
+            miaModes = std::max(1ul, strtoul(argv[i] + 12, NULL, 10));
+        } else if (strncmp(argv[i], "--mia-threads=", 14) == 0) {
+            miaThreads = std::max(1ul, strtoul(argv[i] + 14, NULL, 10));
+        } else if (strncmp(argv[i], "--mia-period=", 13) == 0) {
+            miaPeriod = strtod(argv[i] + 13, NULL);
+        } else if (strncmp(argv[i], "--fit=", 6) == 0) {
+            fitPoints = split_names(argv[i] + 6);
+        } else if (strncmp(argv[i], "--fit-bpms=", 11) == 0) {
+            fitBPMs = std::max(2ul, strtoul(argv[i] + 11, NULL, 10));
+        } else if (strncmp(argv[i], "--stream=", 9) == 0) {
+            StreamDefinition stream;
+            if (!parse_stream(argv[i] + 9, stream)) {
+                fprintf(stderr, "Bad %s, expected --stream=SUFFIX,every,N or --stream=SUFFIX,average|envelope,SEC\n", argv[i]);
+                return 1;
+            }
+            streams.push_back(stream);
+        } else if (strncmp(argv[i], "--model-timeout=", 16) == 0) {
+            modelTimeout = strtod(argv[i] + 16, NULL);
+        } else if (strcmp(argv[i], "--no-reload") == 0) {
+            reloadModels = false;
+        } else if (strncmp(argv[i], "--startup-fraction=", 19) == 0) {
+            startupFraction = strtod(argv[i] + 19, NULL);
+        } else if (strncmp(argv[i], "--startup-timeout=", 18) == 0) {
+            startupTimeout = strtod(argv[i] + 18, NULL);
+        } else if (strcmp(argv[i], "--packed=float64") == 0) {
+            packedOrbits = true;
+            packedPrecision = PACKED_FLOAT64;
+        } else if (strcmp(argv[i], "--packed=float32") == 0) {
+            packedOrbits = true;
+            packedPrecision = PACKED_FLOAT32;
+        } else if (strncmp(argv[i], "--ca-contexts=", 14) == 0) {
+            numContexts = std::max(1ul, strtoul(argv[i] + 14, NULL, 10));
+        } else if (strncmp(argv[i], "--assembly-threads=", 19) == 0) {
+            assemblyThreads = std::max(1ul, strtoul(argv[i] + 19, NULL, 10));
+        } else if (strncmp(argv[i], "--deadline=", 11) == 0) {
+            deadline = strtod(argv[i] + 11, NULL);
+        } else if (strcmp(argv[i], "--adaptive-deadline") == 0) {
+            adaptiveDeadline = true;
+        } else if (strcmp(argv[i], "--final") == 0) {
+            finalOrbits = true;
+        } else if (strcmp(argv[i], "--source=ca") == 0) {
+            pvaSource = false;
+        } else if (strcmp(argv[i], "--source=pva") == 0) {
+            pvaSource = true;
+        } else if (strncmp(argv[i], "--record=", 9) == 0) {
+            recordDir = argv[i] + 9;
+        } else if (strncmp(argv[i], "--replay-speed=", 15) == 0) {
+            replayConfig.speed = strtod(argv[i] + 15, NULL);
+        } else if (strncmp(argv[i], "--replay-start=", 15) == 0) {
+            replayConfig.start = posix_to_key(strtod(argv[i] + 15, NULL));
+        } else if (strncmp(argv[i], "--replay-end=", 13) == 0) {
+            replayConfig.end = posix_to_key(strtod(argv[i] + 13, NULL));
+        } else if (strncmp(argv[i], "--bsas-table=", 13) == 0) {
+            bsasTable = argv[i] + 13;
+        } else if (strncmp(argv[i], "--pva-contexts=", 15) == 0) {
+            numPVAContexts = std::max(1ul, strtoul(argv[i] + 15, NULL, 10));
+        } else if (strncmp(argv[i], "--config=", 9) == 0) {
+            configFile = argv[i] + 9;
+        } else if (strncmp(argv[i], "--fake-bpms=", 12) == 0) {
+            fakeBPMs = strtoul(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "--fake-rate=", 12) == 0) {
+            fakeConfig.rate = strtod(argv[i] + 12, NULL);
+        } else if (strncmp(argv[i], "--fake-jitter=", 14) == 0) {
+            fakeConfig.jitter = strtod(argv[i] + 14, NULL);
+        } else if (strncmp(argv[i], "--fake-reorder=", 15) == 0) {
+            fakeConfig.reorder = strtod(argv[i] + 15, NULL);
+        } else if (strncmp(argv[i], "--fake-drop=", 12) == 0) {
+            fakeConfig.drop = strtod(argv[i] + 12, NULL);
+        } else if (strncmp(argv[i], "--fake-duplicate=", 17) == 0) {
+            fakeConfig.duplicate = strtod(argv[i] + 17, NULL);
+        } else if (strncmp(argv[i], "--fake-disconnects=", 19) == 0) {
+            fakeConfig.disconnects = strtod(argv[i] + 19, NULL);
+        } else if (strncmp(argv[i], "--fake-downtime=", 16) == 0) {
+            fakeConfig.downtime = strtod(argv[i] + 16, NULL);
+        } else if (strncmp(argv[i], "--fake-seed=", 12) == 0) {
+            fakeConfig.seed = strtoul(argv[i] + 12, NULL, 10);
+        } else {
+            argv[nargs++] = argv[i];
+        }
+    }
+    argc = nargs;
+
     bool fakeOrbitMode = false;
+    const char* replayFile = NULL;
+    std::vector<OrbitDefinition> defs;
     if (argc == 3 && strcmp(argv[1], "--fake") == 0) {
         fakeOrbitMode = true;
-    } else if (argc < 4) {
-        fprintf(stdout, "Usage: %s [MODEL_PV] [EDEF] [OUTPUT_PV]\n", argv[0]);
+        OrbitDefinition def;
+        def.output_pv = std::string(argv[2]);
+        defs.push_back(def);
+    } else if (argc == 4 && strcmp(argv[1], "--replay") == 0) {
+        replayFile = argv[2];
+        OrbitDefinition def;
+        def.output_pv = std::string(argv[3]);
+        defs.push_back(def);
+    } else if (configFile && argc == 1) {
+        if (!read_config(configFile, defs)) {
+            return 1;
+        }
+    } else if (!configFile && argc == 4) {
+        OrbitDefinition def;
+        def.model_pv = std::string(argv[1]);
+        def.edef = std::string(argv[2]);
+        def.output_pv = std::string(argv[3]);
+        defs.push_back(def);
+    }
+    if (defs.empty()) {
+        fprintf(stdout, "Usage: %s [--latest-only] [--history=N] [--stats=N [--stats-period=SEC]] [--mia=N [--mia-modes=K] [--mia-threads=N] [--mia-period=SEC]] [--fit=BPM,... [--fit-bpms=N]] [--stream=SUFFIX,every|average|envelope,ARG ...] [--packed=float64|float32] [--queue-policy=drop-oldest|drop-newest|block] [--source=ca|pva | --bsas-table=PV] [--ca-contexts=N] [--pva-contexts=N] [--assembly-threads=N] [--deadline=SEC [--adaptive-deadline] [--final]] [--record=DIR] [--model-timeout=SEC] [--no-reload] [--startup-fraction=F [--startup-timeout=SEC]] [MODEL_PV EDEF OUTPUT_PV | --config=FILE]\n", argv[0]);
+        fprintf(stdout, "       %s [options] [--fake-bpms=N] [--fake-rate=HZ] [--fake-jitter=SEC] [--fake-reorder=FRAC] [--fake-drop=FRAC] [--fake-duplicate=FRAC] [--fake-disconnects=PER_SEC] [--fake-downtime=SEC] [--fake-seed=N] --fake OUTPUT_PV\n", argv[0]);
+        fprintf(stdout, "       %s [options] [--replay-speed=X] [--replay-start=SEC] [--replay-end=SEC] --replay FILE OUTPUT_PV\n", argv[0]);
+        return 1;
+    }
+    if ((adaptiveDeadline || finalOrbits) && !(deadline > 0.0)) {
+        fprintf(stderr, "--adaptive-deadline and --final need a --deadline\n");
+        return 1;
+    }
+    if (statsWindow > 0 && !(statsPeriod > 0.0)) {
+        fprintf(stderr, "--stats-period must be positive\n");
+        return 1;
+    }
+    if (miaWindow > 0 && !(miaPeriod > 0.0)) {
+        fprintf(stderr, "--mia-period must be positive\n");
+        return 1;
+    }
+    if (!fitPoints.empty() && (fakeOrbitMode || replayFile)) {
+        fprintf(stderr, "--fit needs a MODEL_PV\n");
+        return 1;
+    }
+    if (!(startupFraction >= 0.0 && startupFraction <= 1.0)) {
+        fprintf(stderr, "--startup-fraction must be between 0 and 1\n");
+        return 1;
+    }
+    if (fakeOrbitMode && !(fakeConfig.rate > 0.0)) {
+        fprintf(stderr, "--fake-rate must be positive\n");
         return 1;
     }
 
     pvxs::logger_config_env();
-    std::vector<std::string> bpm_names;
-    std::string output_pv;
-    std::string edef;
-    std::vector<double> bpm_z_vals;
-    if (!fakeOrbitMode) {
-        auto model_pv = std::string(argv[1]);
-        edef = std::string(argv[2]);
-        output_pv = std::string(argv[3]);
-        
-        //Now, get all the BPM Z values from the model.
-        pvxs::client::Context pva_ctxt = pvxs::client::Config::from_env().build();
-        auto model_table = pva_ctxt.get(model_pv).exec()->wait(4.0).clone();
-        pvxs::shared_array<const void> name_col = model_table["value"]["device_name"].as<pvxs::shared_array<const void>>();
-        pvxs::shared_array<const std::string> name_vals = name_col.castTo<const std::string>();
-        pvxs::shared_array<const void> z_col = model_table["value"]["s"].as<pvxs::shared_array<const void>>();
-        pvxs::shared_array<const double> z_vals = z_col.castTo<const double>();
-        for (size_t i=0, N = z_vals.size(); i<N; i++) {
-            if (name_vals[i].rfind("BPMS", 0) == 0) {
-                bpm_names.push_back(name_vals[i]);
-                bpm_z_vals.push_back(z_vals[i]);
-            }
+    //Channels are shared by every orbit, so a BPM appearing in several
+    //definitions with the same EDEF is only subscribed to once.
+    std::unique_ptr<ChannelSource> channels;
+    ReplaySource* replay = NULL;
+    if (replayFile) {
+        try {
+            replay = new ReplaySource(replayFile, replayConfig);
+        } catch (std::exception& err) {
+            fprintf(stderr, "%s\n", err.what());
+            return 1;
         }
+        fprintf(stdout, "Replaying %zu orbits of %zu BPMs from %s...\n", replay->recording().size(), replay->recording().names().size(), replayFile);
+        channels.reset(replay);
+    } else if (fakeOrbitMode) {
+        fprintf(stdout, "Simulating %zu BPMs at %g Hz...\n", fakeBPMs, fakeConfig.rate);
+        channels.reset(new SyntheticSource(fakeConfig));
+    } else if (bsasTable) {
+        fprintf(stdout, "Reading BPMs from table %s...\n", bsasTable);
+        channels.reset(new BSASTableSource(bsasTable));
+    } else if (pvaSource) {
+        fprintf(stdout, "Connecting to BPMs over PVA...\n");
+        channels.reset(new PVAChannelPool(numPVAContexts));
     } else {
-        output_pv = std::string(argv[2]);
-        edef = std::string("");
-        std::ostringstream nameStream;
-        for (size_t i=0, N = 101; i<N; i++) {
-            nameStream.str("");
-            nameStream << "BPMS:LTUH:" << i;
-            printf("%s\n", nameStream.str().c_str());
-            bpm_names.push_back(nameStream.str());
-            bpm_z_vals.push_back(float(i));
-        }
-    }
-    assert(bpm_z_vals.size() == bpm_names.size());
-    fprintf(stdout, "Connecting to BPMs...\n");
-    std::shared_ptr<CAContext> context;
-    context.reset(new CAContext(epicsThreadPriorityMedium));
-    auto orbit = new Orbit(*context, bpm_names, bpm_z_vals, edef);
-    printf("Orbit initialized.\n");
-    auto receiver = new PVAOrbitReceiver(*orbit);
-    printf("Receiver initialized.\n");
-    auto server = pvxs::server::Config::from_env().build().addPV(output_pv, *(receiver->pv));
+        fprintf(stdout, "Connecting to BPMs...\n");
+        channels.reset(new CAChannelPool(numContexts, epicsThreadPriorityMedium));
+    }
+    auto server = pvxs::server::Config::from_env().build();
+    pvxs::client::Context pva_ctxt;
+    if (!fakeOrbitMode && !replay) {
+        pva_ctxt = pvxs::client::Config::from_env().build();
+    }
+    //Several definitions usually share a model, only fetch it once, and
+    //fetch them all at once rather than waiting for each in turn.
+    const std::chrono::steady_clock::time_point startup(std::chrono::steady_clock::now());
+    std::map<std::string, std::pair<std::vector<std::string>, std::vector<double>>> models;
+    if (!fakeOrbitMode && !replay) {
+        std::map<std::string, std::shared_ptr<pvxs::client::Operation>> gets;
+        for (size_t d=0, ND=defs.size(); d<ND; d++) {
+            if (gets.find(defs[d].model_pv) == gets.end()) {
+                gets[defs[d].model_pv] = pva_ctxt.get(defs[d].model_pv).exec();
+            }
+        }
+        for (auto it = gets.begin(); it != gets.end(); ++it) {
+            fetch_model(*it->second, modelTimeout, models[it->first].first, models[it->first].second);
+        }
+        printf("Fetched %zu models in %.3f s.\n", gets.size(), std::chrono::duration<double>(std::chrono::steady_clock::now() - startup).count());
+    }
+    //Orbits by the model they follow, for reloading their BPMs.
+    std::map<std::string, std::vector<Orbit*>> model_orbits;
+    for (size_t d=0, ND=defs.size(); d<ND; d++) {
+        const OrbitDefinition& def = defs[d];
+        std::vector<std::string> bpm_names;
+        std::vector<double> bpm_z_vals;
+        if (replay) {
+            bpm_names = replay->recording().names();
+            bpm_z_vals = replay->recording().zs();
+        } else if (!fakeOrbitMode) {
+            bpm_names = models[def.model_pv].first;
+            bpm_z_vals = models[def.model_pv].second;
+        } else {
+            std::ostringstream nameStream;
+            for (size_t i=0, N = fakeBPMs; i<N; i++) {
+                nameStream.str("");
+                nameStream << "BPMS:LTUH:" << i;
+                bpm_names.push_back(nameStream.str());
+                bpm_z_vals.push_back(float(i));
+            }
+        }
+        assert(bpm_z_vals.size() == bpm_names.size());
+        auto orbit = new Orbit(*channels, bpm_names, bpm_z_vals, def.edef, assemblyThreads);
+        orbit->set_delivery_mode(latestOnly ? DELIVER_LATEST : DELIVER_ALL);
+        orbit->set_deadline(deadline, adaptiveDeadline);
+        orbit->set_startup(startupFraction, startupTimeout);
+        printf("Orbit %s initialized.\n", def.output_pv.c_str());
+        model_orbits[def.model_pv].push_back(orbit);
+        server.addSource(def.output_pv, std::make_shared<PVAOrbitSource>(*orbit, def.output_pv, queuePolicy));
+        if (finalOrbits) {
+            auto final = new PVAOrbitReceiver(*orbit, queuePolicy, true);
+            server.addPV(def.output_pv + ":FINAL", *(final->pv));
+        }
+        if (packedOrbits) {
+            auto packed = new PVAOrbitPackedReceiver(*orbit, packedPrecision, queuePolicy);
+            server.addPV(def.output_pv + ":PACKED", *(packed->pv));
+        }
+        if (historyDepth > 0) {
+            auto history = new PVAOrbitHistoryReceiver(*orbit, historyDepth, queuePolicy);
+            server.addPV(def.output_pv + ":HISTORY", *(history->pv));
+        }
+        if (statsWindow > 0) {
+            auto stats = new PVAOrbitStatistics(*orbit, statsWindow, statsPeriod, queuePolicy);
+            server.addPV(def.output_pv + ":STATS", *(stats->pv));
+        }
+        if (miaWindow > 0) {
+            auto mia = new PVAOrbitMIA(*orbit, miaWindow, miaModes, miaThreads, miaPeriod, queuePolicy);
+            server.addPV(def.output_pv + ":MIA", *(mia->pv));
+        }
+        if (!fitPoints.empty()) {
+            auto fit = new PVAOrbitFit(*orbit, pva_ctxt, def.model_pv, fitPoints, fitBPMs, queuePolicy);
+            server.addPV(def.output_pv + ":FIT", *(fit->pv));
+        }
+        for (size_t k=0; k<streams.size(); k++) {
+            const StreamDefinition& stream = streams[k];
+            std::shared_ptr<pvxs::server::SharedPV> pv;
+            if (stream.kind == STREAM_EVERY) {
+                pv = (new PVAOrbitReceiver(*orbit, queuePolicy, false, size_t(stream.arg)))->pv;
+            } else {
+                pv = (new PVAOrbitWindow(*orbit, stream.kind == STREAM_AVERAGE ? WINDOW_AVERAGE : WINDOW_ENVELOPE, stream.arg, queuePolicy))->pv;
+            }
+            server.addPV(def.output_pv + ":" + stream.suffix, *pv);
+        }
+        auto health = new PVAOrbitHealth(*orbit);
+        server.addPV(def.output_pv + ":HEALTH", *(health->pv));
+        auto lateness = new PVAOrbitLateness(*orbit);
+        server.addPV(def.output_pv + ":LATENESS", *(lateness->pv));
+        if (recordDir) {
+            new OrbitRecorder(*orbit, std::string(recordDir) + "/" + def.output_pv + ".orbits", queuePolicy);
+        }
+        if (replay) {
+            orbit->wait_for_connection(std::chrono::seconds(2));
+            replay->start();
+        }
+    }
+    printf("Subscribed to %zu channels for %zu orbits in %.3f s.\n", channels->size(), defs.size(), std::chrono::duration<double>(std::chrono::steady_clock::now() - startup).count());
+    if (!fakeOrbitMode && !replay && reloadModels) {
+        for (auto it = model_orbits.begin(); it != model_orbits.end(); ++it) {
+            new ModelWatcher(pva_ctxt, it->first, it->second);
+        }
+    }
     printf("Done connecting. Spinning up PVA server.\n");
     server.run();
     return 0;
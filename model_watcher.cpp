@@ -0,0 +1,111 @@
+#include "model_watcher.h"
+#include <stdio.h>
+#include <algorithm>
+#include <pvxs/data.h>
+#include <pvxs/sharedArray.h>
+
+void read_bpms(const pvxs::Value& model, std::vector<std::string>& bpm_names, std::vector<double>& bpm_z_vals) {
+    pvxs::shared_array<const void> name_col = model["value"]["device_name"].as<pvxs::shared_array<const void>>();
+    pvxs::shared_array<const std::string> name_vals = name_col.castTo<const std::string>();
+    pvxs::shared_array<const void> z_col = model["value"]["s"].as<pvxs::shared_array<const void>>();
+    pvxs::shared_array<const double> z_vals = z_col.castTo<const double>();
+    for (size_t i=0, N = std::min(z_vals.size(), name_vals.size()); i<N; i++) {
+        if (name_vals[i].rfind("BPMS", 0) == 0) {
+            bpm_names.push_back(name_vals[i]);
+            bpm_z_vals.push_back(z_vals[i]);
+        }
+    }
+}
+
+ModelWatcher::ModelWatcher(pvxs::client::Context& context, const std::string& model_pv, const std::vector<Orbit*>& orbits) :
+model_pv(model_pv),
+orbits(orbits),
+pending(false),
+running(true)
+{
+    worker = std::thread(&ModelWatcher::run, this);
+    sub = context.monitor(model_pv)
+        .event([this](pvxs::client::Subscription& s) { onEvent(s); })
+        .exec();
+}
+
+ModelWatcher::~ModelWatcher() {
+    close();
+}
+
+void ModelWatcher::close() {
+    if (sub) {
+        sub->cancel();
+        sub.reset();
+    }
+    {
+        Guard G(mutex);
+        running = false;
+    }
+    wakeup.signal();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+// Called on the client context's worker thread for each new model.
+void ModelWatcher::onEvent(pvxs::client::Subscription& s) {
+    while (true) {
+        try {
+            pvxs::Value update(s.pop());
+            if (!update) {
+                return;
+            }
+            std::vector<std::string> n;
+            std::vector<double> z;
+            read_bpms(update, n, z);
+            {
+                Guard G(mutex);
+                names.swap(n);
+                zs.swap(z);
+                pending = true;
+            }
+            wakeup.signal();
+        } catch (pvxs::client::Disconnect&) {
+        } catch (pvxs::client::RemoteError& err) {
+            printf("Monitor error for %s: %s\n", model_pv.c_str(), err.what());
+        } catch (std::exception& err) {
+            printf("Could not read BPMs from %s: %s\n", model_pv.c_str(), err.what());
+        }
+    }
+}
+
+void ModelWatcher::run() {
+    while (true) {
+        wakeup.wait();
+        std::vector<std::string> n;
+        std::vector<double> z;
+        {
+            Guard G(mutex);
+            if (!running) {
+                break;
+            }
+            if (!pending) {
+                continue;
+            }
+            n.swap(names);
+            z.swap(zs);
+            pending = false;
+        }
+        // An empty list is more likely a broken model than a wish to
+        // serve no BPMs at all.
+        if (n.empty()) {
+            printf("Ignoring %s, which has no BPMs.\n", model_pv.c_str());
+            continue;
+        }
+        for (size_t i=0, N=orbits.size(); i<N; i++) {
+            try {
+                if (orbits[i]->set_bpms(n, z)) {
+                    printf("BPM list reloaded from %s.\n", model_pv.c_str());
+                }
+            } catch (std::exception& err) {
+                printf("Could not reload BPMs from %s: %s\n", model_pv.c_str(), err.what());
+            }
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef MODEL_WATCHER_H
+#define MODEL_WATCHER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <pvxs/client.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include "orbit.h"
+
+// Get the BPMs (devices named BPMS*) and their z positions from a model table.
+void read_bpms(const pvxs::Value& model, std::vector<std::string>& bpm_names, std::vector<double>& bpm_z_vals);
+
+// Keeps the BPM lists of 'orbits' in step with 'model_pv': whenever the
+// model is updated, each orbit is switched to the BPMs in it (see
+// Orbit::set_bpms()), so BPMs can be added or removed without a restart.
+// Reloads run on a thread of their own, since subscribing to new channels
+// can take a while; an update arriving meanwhile replaces any not yet
+// applied.
+class ModelWatcher
+{
+public:
+    ModelWatcher(pvxs::client::Context& context, const std::string& model_pv, const std::vector<Orbit*>& orbits);
+    ~ModelWatcher();
+    const std::string model_pv;
+    void close();
+private:
+    void onEvent(pvxs::client::Subscription& s);
+    void run();
+    const std::vector<Orbit*> orbits;
+    epicsMutex mutex;
+    epicsEvent wakeup;
+    // the newest model not yet applied
+    bool pending;
+    std::vector<std::string> names;
+    std::vector<double> zs;
+    bool running;
+    std::thread worker;
+    std::shared_ptr<pvxs::client::Subscription> sub;
+};
+
+#endif // MODEL_WATCHER_H
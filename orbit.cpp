@@ -4,35 +4,572 @@
 #include <memory>
 #include <thread>
 #include <chrono>
-#include <thread>
 #include <cmath>
+#include <algorithm>
+#include <bitset>
+#include <map>
+#include <set>
+#include <stdexcept>
 #include "orbit.h"
 
+static const char* axis_names[NUM_AXES] = {"X", "Y", "TMIT"};
+
 // limit on number of potentially complete events to track
 //static double maxEventRate = 20;
 // timeout to flush partial events
 static double maxEventAge = 1.0;
-// holdoff after delivering events (in milliseconds).  16 ms is about 60 Hz.
-int flushPeriod = 4;
+// number of pulses which may be assembled at once.  Must be a power of two.
+static size_t maxPendingEvents = 32;
+// adaptive deadlines: this quantile of the slowest channel's lateness, times
+// the margin, but never less than minDeadline (seconds)
+static double deadlineQuantile = 0.99;
+static double deadlineMargin = 1.25;
+static double minDeadline = 0.001;
+// pulses profiled between adjustments of an adaptive deadline
+static size_t adaptEvery = 256;
+
+// LCLS timing puts the pulse ID in the low 17 bits of the nanoseconds, so
+// consecutive pulses map to distinct slots until the ring wraps around.
+static inline size_t slot_index(const epicsTimeStamp& ts) {
+    return (ts.nsec & 0x1FFFFu) & (maxPendingEvents - 1u);
+}
+
+// maxEventAge as a difference of pulse keys.
+static inline epicsUInt64 max_age_key() {
+    epicsUInt64 max_age = maxEventAge;
+    max_age <<= 32;
+    max_age |= epicsUInt32(1000000000u * fmod(maxEventAge, 1.0));
+    return max_age;
+}
+
+// Sharded assembly deals the BPMs out in blocks of this many, so that each
+// shard's channels are whole words of a slot's accounted bitmask (64 BPMs
+// are 192 channels, three words).  Block b goes to shard b % S, where it
+// is the shard's block b / S.
+static const size_t shardBlock = 64u;
+static const size_t blockChannels = 3u*shardBlock;
+
+static inline size_t shard_of(size_t channel, size_t num_shards) {
+    return (channel/blockChannels) % num_shards;
+}
+
+// Where a channel is in its shard's slots, which pack its blocks together.
+static inline size_t local_channel(size_t channel, size_t num_shards) {
+    return (channel/blockChannels/num_shards)*blockChannels + channel%blockChannels;
+}
+
+// How many blocks shard 'shard' has, of an orbit with room for 'num_bpms'.
+static inline size_t shard_blocks(size_t shard, size_t num_shards, size_t num_bpms) {
+    const size_t blocks = (num_bpms + shardBlock - 1u)/shardBlock;
+    return blocks > shard ? (blocks - shard + num_shards - 1u)/num_shards : 0u;
+}
+
+void OrbitData::resize(size_t num_bpms) {
+    for (size_t j=0; j<NUM_AXES; j++) {
+        value[j].resize(num_bpms, 0.0);
+        severity[j].resize(num_bpms, MISSING_SEVERITY);
+        status[j].resize(num_bpms, LINK_ALARM);
+    }
+}
+
+void OrbitData::clear() {
+    for (size_t j=0; j<NUM_AXES; j++) {
+        std::fill(severity[j].begin(), severity[j].end(), MISSING_SEVERITY);
+        std::fill(status[j].begin(), status[j].end(), epicsUInt16(LINK_ALARM));
+    }
+    complete = false;
+}
+
+OrbitPool::OrbitPool(size_t num_bpms) :
+allocations(0u),
+num_bpms(num_bpms),
+spare(256u)
+{}
+
+OrbitPool::~OrbitPool() {
+    OrbitData* o;
+    while (spare.pop(o)) {
+        delete o;
+    }
+}
+
+OrbitRef OrbitPool::get() {
+    OrbitData* o;
+    if (!spare.pop(o)) {
+        o = new OrbitData;
+        o->pool = this;
+        o->resize(num_bpms);
+        allocations++;
+    } else if (o->size() != num_bpms) {
+        o->resize(num_bpms);
+    }
+    return OrbitRef(o);
+}
+
+void OrbitPool::resize(size_t n) {
+    num_bpms = n;
+}
+
+void OrbitPool::recycle(OrbitData* o) {
+    if (!spare.push(o)) {
+        delete o;
+    }
+}
+
+ReceiverQueue::ReceiverQueue(Receiver* receiver, const ReceiverOptions& options, Histogram& post_latency, const std::shared_ptr<const OrbitLayout>& layout) :
+receiver(receiver),
+options(options),
+post_latency(post_latency),
+layout(layout),
+entries(std::max(options.depth, size_t(1u))),
+head(0u),
+count(0u),
+pushed(0u),
+running(true)
+{
+    counters.receiver = receiver;
+    counters.queued = counters.max_queued = 0u;
+    counters.delivered = counters.dropped = 0u;
+    counters.lag = counters.max_lag = 0.0;
+    worker = std::thread(&ReceiverQueue::work, this);
+}
+
+ReceiverQueue::~ReceiverQueue() {
+    stop();
+}
+
+void ReceiverQueue::push(const OrbitRef& orbit) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!running || pushed++ % std::max(options.every, size_t(1u)) != 0u) {
+        return;
+    }
+    if (count == entries.size()) {
+        if (options.policy == QUEUE_DROP_NEWEST) {
+            counters.dropped++;
+            return;
+        } else if (options.policy == QUEUE_DROP_OLDEST) {
+            entries[head].orbit.reset();
+            head = (head + 1u) % entries.size();
+            count--;
+            counters.dropped++;
+        } else {
+            not_full.wait(lock, [this]() { return !running || count < entries.size(); });
+            if (!running) {
+                return;
+            }
+        }
+    }
+    Entry& e = entries[(head + count) % entries.size()];
+    e.orbit = orbit;
+    e.queued = std::chrono::steady_clock::now();
+    count++;
+    counters.max_queued = std::max(counters.max_queued, count);
+    not_empty.notify_one();
+}
 
-Orbit::Orbit(CAContext& context, const std::vector<std::string>& bpm_names, const std::vector<double>& z_vals, const std::string& edef_suffix) : 
-//context(context),
+void ReceiverQueue::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        not_empty.wait(lock, [this]() { return !running || count > 0u; });
+        if (!running) {
+            break;
+        }
+        Entry e(entries[head]);
+        entries[head].orbit.reset();
+        head = (head + 1u) % entries.size();
+        count--;
+        not_full.notify_one();
+        lock.unlock();
+        const double lag = std::chrono::duration<double>(std::chrono::steady_clock::now() - e.queued).count();
+        if (e.orbit->layout && e.orbit->layout != layout) {
+            layout = e.orbit->layout;
+            receiver->setNames(layout->names);
+            receiver->setZs(layout->zs);
+        }
+        receiver->setCompletedOrbit(*e.orbit);
+        post_latency.add(e.orbit->completed_at, std::chrono::steady_clock::now());
+        e.orbit.reset();
+        lock.lock();
+        counters.delivered++;
+        counters.lag = lag;
+        counters.max_lag = std::max(counters.max_lag, lag);
+    }
+}
+
+void ReceiverQueue::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        for (size_t i=0, N=entries.size(); i<N; i++) {
+            entries[i].orbit.reset();
+        }
+        count = 0u;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+    if (worker.joinable() && worker.get_id() != std::this_thread::get_id()) {
+        worker.join();
+    }
+}
+
+ReceiverStats ReceiverQueue::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ReceiverStats ret(counters);
+    ret.queued = count;
+    return ret;
+}
+
+// A share of an orbit's BPMs, assembled on a thread of its own much as the
+// processing thread would: values are filled into a ring of slots, and a
+// slot goes to the processing thread as an OrbitPart once it has all its
+// channels, or has to make way for a newer pulse, or ages out.  In latency
+// mode every slot which took values is also sent after each pass, so the
+// processing thread can publish at the deadline with what has arrived.
+struct Orbit::Shard {
+    Shard(Orbit& orbit, size_t index, size_t num_shards, size_t num_bpms, size_t ready_limit);
+    ~Shard();
+    Orbit& orbit;
+    const size_t index;
+    const size_t num_shards;
+    // this shard's channels with data in their queues
+    MPMCQueue<Channel*> ready;
+    // for the processing thread to merge
+    SPSCQueue<OrbitPart> parts;
+    // parts discarded because the processing thread fell behind, and
+    // channels left off a full ready list
+    std::atomic<size_t> overflows;
+    std::atomic<bool> waiting;
+    std::atomic<bool> connections_changed;
+    epicsEvent wakeup;
+    void wake();
+    // Make room for an orbit of 'num_bpms'.
+    void grow(size_t num_bpms);
+    // Take values from 'channel', one of this shard's.
+    void attach(Channel* channel);
+    void start();
+    // Once the orbit has stopped running.
+    void stop();
+private:
+    void run();
+    void dequeue();
+    void update_connections();
+    void expire();
+    OrbitSlot* slot_for(const epicsTimeStamp& ts);
+    void send(OrbitSlot& slot, bool keep);
+    // held for each pass, and by the orbit while it grows the slots
+    std::mutex mutex;
+    OrbitPool pool;
+    // by position in the slots, NULL where there is no channel (yet)
+    std::vector<Channel*> sinks;
+    std::vector<epicsUInt64> disconnected_mask;
+    size_t num_connected;
+    std::vector<OrbitSlot> slots;
+    // per slot, whether it has taken values since it was last sent
+    std::vector<bool> touched;
+    epicsUInt64 now_key;
+    // whether anything was sent this pass
+    bool sent;
+    std::thread thread;
+};
+
+Orbit::Shard::Shard(Orbit& orbit, size_t index, size_t num_shards, size_t num_bpms, size_t ready_limit) :
+orbit(orbit),
+index(index),
+num_shards(num_shards),
+ready(ready_limit),
+parts(64u),
+overflows(0u),
+waiting(false),
+connections_changed(false),
+pool(0u),
+num_connected(0u),
+now_key(0u),
+sent(false)
+{
+    slots.resize(maxPendingEvents);
+    for (size_t s=0; s<maxPendingEvents; s++) {
+        slots[s].key = 0u;
+        slots[s].data = pool.get();
+        slots[s].outstanding = 0u;
+        slots[s].emitted = false;
+        slots[s].backfilled = false;
+    }
+    touched.assign(maxPendingEvents, false);
+    grow(num_bpms);
+}
+
+Orbit::Shard::~Shard() {
+    stop();
+}
+
+void Orbit::Shard::wake() {
+    if (waiting.exchange(false)) {
+        wakeup.signal();
+    }
+}
+
+void Orbit::Shard::grow(size_t num_bpms) {
+    const std::lock_guard<std::mutex> lock(mutex);
+    const size_t first = sinks.size(), num_channels = shard_blocks(index, num_shards, num_bpms)*blockChannels;
+    if (num_channels <= first) {
+        return;
+    }
+    sinks.resize(num_channels, nullptr);
+    disconnected_mask.resize(num_channels/64u, 0u);
+    for (size_t c=first; c<num_channels; c++) {
+        disconnected_mask[c/64u] |= epicsUInt64(1u) << (c%64u);
+    }
+    for (size_t s=0, N=slots.size(); s<N; s++) {
+        OrbitSlot& slot = slots[s];
+        slot.data->resize(num_channels/3u);
+        slot.accounted.resize(disconnected_mask.size(), 0u);
+        for (size_t c=first; c<num_channels; c++) {
+            slot.accounted[c/64u] |= epicsUInt64(1u) << (c%64u);
+        }
+        slot.arrived.resize(num_channels);
+    }
+    pool.resize(num_channels/3u);
+}
+
+void Orbit::Shard::attach(Channel* channel) {
+    const std::lock_guard<std::mutex> lock(mutex);
+    sinks[local_channel(channel->index, num_shards)] = channel;
+}
+
+void Orbit::Shard::start() {
+    thread = std::thread(&Orbit::Shard::run, this);
+}
+
+void Orbit::Shard::stop() {
+    wakeup.signal();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Orbit::Shard::run() {
+    while (orbit.run) {
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            epicsTimeStamp now;
+            epicsTimeGetCurrent(&now);
+            now_key = epicsUInt64(now.secPastEpoch) << 32 | now.nsec;
+            sent = false;
+            if (connections_changed.exchange(false)) {
+                update_connections();
+            }
+            dequeue();
+            expire();
+            if (orbit.forward_partial) {
+                for (size_t s=0, N=slots.size(); s<N; s++) {
+                    if (slots[s].key != 0u && touched[s]) {
+                        send(slots[s], true);
+                    }
+                }
+            }
+        }
+        if (sent) {
+            orbit.wake();
+        }
+        waiting = true;
+        if (ready.empty() && !connections_changed && orbit.run) {
+            wakeup.wait();
+        }
+        waiting = false;
+    }
+}
+
+void Orbit::Shard::dequeue() {
+    const std::chrono::steady_clock::time_point dequeued(std::chrono::steady_clock::now());
+    Channel* channel;
+    while (ready.pop(channel)) {
+        // Clear before draining, so an update pushed after the drain re-lists the channel.
+        channel->queued = false;
+        DBRValue* val = channel->values.front();
+        if (val) {
+            orbit.counters.ingest_latency.add(val->received, dequeued);
+        }
+        const size_t c = local_channel(channel->index, num_shards);
+        for (; val; channel->values.pop(), val = channel->values.front()) {
+            OrbitSlot* slot = slot_for(val->ts);
+            if (!slot) {
+                orbit.counters.late++;
+                continue;
+            }
+            if (!orbit.fill(*slot, c, val->as_double(), val->sevr, val->stat, val->received)) {
+                orbit.counters.duplicates++;
+                continue;
+            }
+            touched[slot_index(val->ts)] = true;
+            if (orbit.account(*slot, c)) {
+                send(*slot, false);
+            }
+        }
+    }
+}
+
+// The slot for the pulse at 'ts', handing on an older pulse which has it.
+// NULL if the slot is busy with a newer pulse.
+OrbitSlot* Orbit::Shard::slot_for(const epicsTimeStamp& ts) {
+    const epicsUInt64 key = epicsUInt64(ts.secPastEpoch) << 32 | ts.nsec;
+    OrbitSlot& slot = slots[slot_index(ts)];
+    if (slot.key == key) {
+        return &slot;
+    }
+    if (slot.key > key) {
+        return nullptr;
+    }
+    if (slot.key != 0u) {
+        send(slot, false);
+    }
+    slot.key = key;
+    slot.data->ts = ts;
+    slot.data->clear();
+    slot.accounted = disconnected_mask;
+    slot.outstanding = num_connected;
+    slot.first_arrival = std::chrono::steady_clock::time_point::max();
+    return &slot;
+}
+
+// Hand on pulses the processing thread is about to give up on.
+void Orbit::Shard::expire() {
+    const epicsUInt64 max_age = max_age_key();
+    for (size_t s=0, N=slots.size(); s<N; s++) {
+        if (slots[s].key != 0u && epicsInt64(now_key) - epicsInt64(slots[s].key) >= epicsInt64(max_age)) {
+            send(slots[s], false);
+        }
+    }
+}
+
+// Copy the slot's share of its pulse out to the processing thread.  Unless
+// the slot will 'keep' assembling it, the slot is freed.
+void Orbit::Shard::send(OrbitSlot& slot, bool keep) {
+    OrbitPart* part = parts.back();
+    if (!part) {
+        overflows++;
+    } else {
+        const OrbitData& data = *slot.data;
+        part->ts = data.ts;
+        for (size_t j=0; j<NUM_AXES; j++) {
+            part->value[j] = data.value[j];
+            part->severity[j] = data.severity[j];
+            part->status[j] = data.status[j];
+        }
+        part->accounted = slot.accounted;
+        part->arrived = slot.arrived;
+        part->first_arrival = slot.first_arrival;
+        parts.push();
+        sent = true;
+    }
+    touched[&slot - &slots[0]] = false;
+    if (!keep) {
+        slot.key = 0u;
+    }
+}
+
+// Stop waiting for channels which have gone away, as the processing thread
+// does.  Channels which have come back are waited for from the next pulse.
+void Orbit::Shard::update_connections() {
+    num_connected = 0u;
+    for (size_t c=0, N=sinks.size(); c<N; c++) {
+        epicsUInt64& word = disconnected_mask[c/64u];
+        const epicsUInt64 bit = epicsUInt64(1u) << (c%64u);
+        if (sinks[c] && sinks[c]->connected) {
+            num_connected++;
+            word &= ~bit;
+            continue;
+        }
+        if (word & bit) {
+            continue;
+        }
+        word |= bit;
+        for (size_t s=0, NS=slots.size(); s<NS; s++) {
+            if (slots[s].key != 0u && orbit.account(slots[s], c)) {
+                send(slots[s], false);
+            }
+        }
+    }
+}
+
+Orbit::Orbit(ChannelSource& source, const std::vector<std::string>& bpm_names, const std::vector<double>& z_vals, const std::string& edef_suffix, size_t workers) : 
+source(source),
 run(true),
-names(bpm_names),
-zs(z_vals),
+delivery(DELIVER_ALL),
+pool(bpm_names.size()),
+layout_pool(bpm_names.size()),
+layout(new OrbitLayout(bpm_names, z_vals)),
+identity(true),
+retired(bpm_names.size(), false),
+live_channels(3*bpm_names.size()),
+edef(edef_suffix),
 waiting(false),
+// room for every channel, and as many again for BPMs added by reloads
+ready_channels(2*3*bpm_names.size()),
+receivers(new feeds_t),
+forward_partial(false),
+num_pending(0u),
+connections_changed(false),
+num_connected(0u),
 oldest_key(0u),
-hasCompleteOrbit(false)
+deadline(0.0),
+adaptive_deadline(false),
+current_deadline(std::chrono::steady_clock::duration::zero()),
+next_deadline(std::chrono::steady_clock::time_point::max()),
+profiled(0u),
+created_at(std::chrono::steady_clock::now()),
+startup_fraction(0.0),
+startup_timeout(0.0),
+publishing(false),
+layout_pending(false),
+table(16u)
 {
-    printf("Making orbit from vector...\n");
-    std::string axes[3] = {"X", "Y", "TMIT"};
-    pvs.resize(bpm_names.size());
+    positions.resize(bpm_names.size());
+    for (size_t i=0, N=bpm_names.size(); i<N; i++) {
+        positions[i] = i;
+    }
+    const size_t num_channels = 3*bpm_names.size();
+    channel_connected.assign(num_channels, false);
+    disconnected_mask.assign((num_channels + 63u)/64u, 0u);
+    // The bits past the last channel are set too, so a shard's share of a
+    // pulse (which has them set) can be merged a word at a time.
+    for(size_t c=0, N=64u*disconnected_mask.size(); c<N; c++) {
+        disconnected_mask[c/64u] |= epicsUInt64(1u) << (c%64u);
+    }
+    slots.resize(maxPendingEvents);
+    for(size_t s=0; s<maxPendingEvents; s++) {
+        slots[s].key = 0u;
+        slots[s].data = pool.get();
+        slots[s].accounted.resize(disconnected_mask.size());
+        slots[s].outstanding = 0u;
+        slots[s].arrived.resize(num_channels);
+        slots[s].emitted = false;
+        slots[s].backfilled = false;
+    }
+    lateness_sketches.resize(num_channels);
+    times_last.assign(num_channels, 0u);
+    // No more shards than blocks of BPMs, and one is no shards at all.
+    const size_t num_shards = std::min(workers, (bpm_names.size() + shardBlock - 1u)/shardBlock);
+    for (size_t s=0; num_shards > 1u && s<num_shards; s++) {
+        shards.emplace_back(new Shard(*this, s, num_shards, bpm_names.size(), 2*num_channels));
+    }
+    channels.resize(num_channels);
+    std::vector<Channel*> sinks(num_channels);
     for(size_t i=0, N=bpm_names.size(); i<N; i++) {
         for (size_t j=0; j<3; j++) {
-            pvs[i][j].reset(new PV(bpm_names[i] + ":" + axes[j] + edef_suffix, context, 10u, *this));
+            channels[3*i + j].reset(new Channel(bpm_names[i] + ":" + axis_names[j] + edef_suffix, *this, 3*i + j, 16u));
+            sinks[3*i + j] = channels[3*i + j].get();
+            if (!shards.empty()) {
+                shards[shard_of(3*i + j, num_shards)]->attach(sinks[3*i + j]);
+            }
         }
     }
-    
+    for (size_t s=0, N=shards.size(); s<N; s++) {
+        shards[s]->start();
+    }
+    //All in one go, so the source can set them up in parallel.
+    source.subscribe_all(sinks);
+    startup_times.subscribed = since_created();
+
     processingThread = std::thread(&Orbit::process, this);   
 }
 
@@ -41,195 +578,948 @@ Orbit::~Orbit() {
 }
 
 void Orbit::close() {
-    for(size_t i=0, N=pvs.size(); i<N; i++) {
-        for (size_t j=0; j<3; j++) {
-            pvs[i][j]->close();
+    for(size_t c=0, N=channels.size(); c<N; c++) {
+        if (!retired[c/3u]) {
+            source.unsubscribe(channels[c].get());
         }
     }
-    
+
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        run = false;
+    }
+    layout_cv.notify_all();
     wakeup.signal();
-    processingThread.join();
+    if (processingThread.joinable()) {
+        processingThread.join();
+    }
+    for (size_t s=0, N=shards.size(); s<N; s++) {
+        shards[s]->stop();
+    }
+    std::shared_ptr<const feeds_t> feeds(std::atomic_load(&receivers));
+    for (size_t i=0, N=feeds->size(); i<N; i++) {
+        if ((*feeds)[i].queue) {
+            (*feeds)[i].queue->stop();
+        }
+    }
 }
 
 void Orbit::wake() {
-    if (waiting) {
+    if (waiting.exchange(false)) {
         wakeup.signal();
     }
 }
 
+// Called by a channel when its queue goes from idle to holding data.
+void Orbit::channel_ready(Channel* channel) {
+    if (!shards.empty()) {
+        Shard& shard = *shards[shard_of(channel->index, shards.size())];
+        if (!shard.ready.push(channel)) {
+            shard.overflows++;
+        }
+        shard.wake();
+        return;
+    }
+    if (!ready_channels.push(channel)) {
+        // Can't happen, the list has room for every channel.
+        counters.ready_overflows++;
+    }
+    wake();
+}
+
+void Orbit::connection_changed() {
+    connections_changed = true;
+    wakeup.signal();
+    for (size_t s=0, N=shards.size(); s<N; s++) {
+        shards[s]->connections_changed = true;
+        shards[s]->wakeup.signal();
+    }
+}
+
 bool Orbit::connected() {
+    const std::lock_guard<std::mutex> lock(mutex);
     bool conn = true;
-    for(size_t i=0, N=pvs.size(); i<N; i++) {
-        for(size_t j=0; j<3; j++) {
-            conn = conn && pvs[i][j]->connected;
-        }
+    for(size_t c=0, N=channels.size(); c<N; c++) {
+        conn = conn && (retired[c/3u] || channels[c]->connected);
     }
     return conn;
 }
 
+double Orbit::since_created() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - created_at).count();
+}
+
+void Orbit::set_startup(double fraction, double timeout) {
+    const std::lock_guard<std::mutex> lock(mutex);
+    startup_fraction = fraction;
+    startup_timeout = timeout;
+    if (startup_times.first_orbit < 0.0) {
+        publishing = false;
+        startup_times.publishing = -1.0;
+    }
+}
+
+// Until enough channels have connected, or the startup timeout has passed,
+// completed orbits are thrown away rather than posted mostly empty.
+void Orbit::check_startup() {
+    const double elapsed = since_created();
+    if (double(num_connected) >= startup_fraction*double(live_channels) || elapsed >= startup_timeout) {
+        publishing = true;
+        startup_times.publishing = elapsed;
+        return;
+    }
+    startup_times.held += completed.size();
+    completed.clear();
+    finals.clear();
+}
+
+void Orbit::set_delivery_mode(DeliveryMode mode) {
+    delivery = mode;
+}
+
+void Orbit::set_deadline(double seconds, bool adaptive) {
+    const std::lock_guard<std::mutex> lock(mutex);
+    deadline = seconds > 0.0 ? seconds : 0.0;
+    adaptive_deadline = adaptive && deadline > 0.0;
+    current_deadline = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(deadline));
+    profiled = 0u;
+    forward_partial = deadline > 0.0;
+}
+
 void Orbit::add_receiver(Receiver* recv) {
-    std::vector<std::string> recv_names;
-    std::vector<double> recv_zs;
+    const ReceiverOptions options(recv->options());
+    // Held throughout, so a reload can't reach the new receiver before
+    // the BPMs it is replacing have.
+    const std::lock_guard<std::mutex> delivering(delivery_mutex);
+    std::shared_ptr<const OrbitLayout> current;
     {
         const std::lock_guard<std::mutex> lock(mutex);
-        receivers.insert(recv);
-        receivers_changed = true;
-        recv_names.reserve(names.size());
-        recv_zs.reserve(zs.size());
-        for (size_t i=0, N=names.size(); i<N; i++) {
-            recv_names.push_back(names[i]);
-            recv_zs.push_back(zs[i]);
+        current = layout;
+        std::shared_ptr<feeds_t> feeds(new feeds_t(*receivers));
+        Feed feed;
+        feed.receiver = recv;
+        feed.final = options.final;
+        if (options.async) {
+            feed.queue.reset(new ReceiverQueue(recv, options, counters.post_latency, current));
         }
+        feeds->push_back(feed);
+        std::atomic_store(&receivers, std::shared_ptr<const feeds_t>(feeds));
     }
-    recv->setNames(recv_names);
-    recv->setZs(recv_zs);
+    recv->setNames(current->names);
+    recv->setZs(current->zs);
 }
 
+// Once this returns, 'recv' will not be called again.
 void Orbit::remove_receiver(Receiver* recv) {
-    const std::lock_guard<std::mutex> lock(mutex);
-    receivers.erase(recv);
-    receivers_changed = true;
+    std::shared_ptr<ReceiverQueue> queue;
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<feeds_t> feeds(new feeds_t);
+        for (size_t i=0, N=receivers->size(); i<N; i++) {
+            const Feed& feed = (*receivers)[i];
+            if (feed.receiver == recv) {
+                queue = feed.queue;
+            } else {
+                feeds->push_back(feed);
+            }
+        }
+        std::atomic_store(&receivers, std::shared_ptr<const feeds_t>(feeds));
+    }
+    if (queue) {
+        queue->stop();
+    }
+    // Wait out a delivery which may have started before the swap.
+    const std::lock_guard<std::mutex> lock(delivery_mutex);
+}
+
+std::vector<ReceiverStats> Orbit::receiver_stats() {
+    std::shared_ptr<const feeds_t> feeds(std::atomic_load(&receivers));
+    std::vector<ReceiverStats> ret;
+    for (size_t i=0, N=feeds->size(); i<N; i++) {
+        if ((*feeds)[i].queue) {
+            ret.push_back((*feeds)[i].queue->stats());
+        }
+    }
+    return ret;
+}
+
+OrbitHealth Orbit::health() {
+    OrbitHealth ret;
+    ret.completed = counters.completed;
+    ret.dropped = counters.dropped;
+    ret.expired = counters.expired;
+    ret.late = counters.late;
+    ret.duplicates = counters.duplicates;
+    ret.partial = counters.partial;
+    ret.backfilled = counters.backfilled;
+    ret.finals = counters.finals;
+    ret.stale = ret.overflows = ret.channel_max_queued = 0u;
+    ret.overflows += table.overflows + counters.ready_overflows;
+    for (size_t s=0, N=shards.size(); s<N; s++) {
+        ret.overflows += shards[s]->overflows;
+    }
+    {
+        // under the lock, since a reload may be adding channels
+        const std::lock_guard<std::mutex> lock(mutex);
+        for (size_t c=0, N=channels.size(); c<N; c++) {
+            ret.stale += channels[c]->stale;
+            ret.overflows += channels[c]->overflows;
+            ret.channel_max_queued = std::max(ret.channel_max_queued, size_t(channels[c]->max_queued));
+        }
+        ret.channels = live_channels;
+        ret.connected = num_connected;
+        ret.pending = num_pending;
+        ret.deadline = std::chrono::duration<double>(current_deadline).count();
+        ret.startup = startup_times;
+    }
+    ret.orbit_allocations = pool.allocations;
+    ret.receivers = receiver_stats();
+    ret.ingest_latency = counters.ingest_latency.snapshot();
+    ret.post_latency = counters.post_latency.snapshot();
+    ret.update_time = counters.update_time.snapshot();
+    ret.dequeue_time = counters.dequeue_time.snapshot();
+    ret.check_time = counters.check_time.snapshot();
+    ret.deliver_time = counters.deliver_time.snapshot();
+    return ret;
+}
+
+void Orbit::deliver(const feeds_t& feeds, const OrbitRef& orbit, bool final) {
+    for (size_t i=0, N=feeds.size(); i<N; i++) {
+        if (feeds[i].final != final) {
+            continue;
+        }
+        if (feeds[i].queue) {
+            feeds[i].queue->push(orbit);
+        } else {
+            feeds[i].receiver->setCompletedOrbit(*orbit);
+            counters.post_latency.add(orbit->completed_at, std::chrono::steady_clock::now());
+        }
+    }
 }
 
 void Orbit::process() {
     epicsTimeGetCurrent(&now);
+    std::shared_ptr<const OrbitLayout> relayout;
     while(run) {
         {
             const std::lock_guard<std::mutex> lock(mutex);
-            waiting = false;
+            if (layout_pending) {
+                relayout = apply_layout();
+            }
             now_key = now.secPastEpoch;
             now_key <<= 32;
             now_key |= now.nsec;
+            const std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
+            update_connections();
+            const std::chrono::steady_clock::time_point t1(std::chrono::steady_clock::now());
             dequeue_pv_data();
+            dequeue_table_rows();
+            dequeue_parts();
+            const std::chrono::steady_clock::time_point t2(std::chrono::steady_clock::now());
             check_for_complete();
-
-            if (receivers_changed) {
-                receivers_shadow = receivers;
-                receivers_changed = false;
+            if (!publishing) {
+                check_startup();
             }
+            const std::chrono::steady_clock::time_point t3(std::chrono::steady_clock::now());
+            counters.update_time.add(t0, t1);
+            counters.dequeue_time.add(t1, t2);
+            counters.check_time.add(t2, t3);
         }
-        if(!completed.empty()) {
+        if (relayout) {
+            // Everything from this pass on has the new layout, so
+            // receivers called from here need to hear of it now.
+            const std::lock_guard<std::mutex> lock(delivery_mutex);
+            std::shared_ptr<const feeds_t> feeds(std::atomic_load(&receivers));
+            for (size_t i=0, N=feeds->size(); i<N; i++) {
+                if (!(*feeds)[i].queue) {
+                    (*feeds)[i].receiver->setNames(relayout->names);
+                    (*feeds)[i].receiver->setZs(relayout->zs);
+                }
+            }
+            relayout.reset();
+        }
+        if(!completed.empty() || !finals.empty()) {
+            const std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
             {
-                for (std::set<Receiver*>::iterator it(receivers_shadow.begin()), end(receivers_shadow.end()); it != end; ++it) {
-                    (*it)->setCompletedOrbit(completed.back());
+                const std::lock_guard<std::mutex> lock(delivery_mutex);
+                std::shared_ptr<const feeds_t> feeds(std::atomic_load(&receivers));
+                if (delivery == DELIVER_ALL) {
+                    //Completed orbits are already in timestamp order.
+                    for (size_t c=0, N=completed.size(); c<N; c++) {
+                        deliver(*feeds, completed[c], false);
+                    }
+                } else if (!completed.empty()) {
+                    deliver(*feeds, completed.back(), false);
                 }
+                for (size_t c=0, N=finals.size(); c<N; c++) {
+                    deliver(*feeds, finals[c], true);
+                }
+            }
+            counters.deliver_time.add(t0, std::chrono::steady_clock::now());
+            if (startup_times.first_orbit < 0.0) {
+                const std::lock_guard<std::mutex> lock(mutex);
+                startup_times.first_orbit = since_created();
+                printf("Orbit startup: channels subscribed after %.3f s, first connected after %.3f s, "
+                       "publishing after %.3f s with %zu of %zu channels, first orbit after %.3f s.\n",
+                       startup_times.subscribed, startup_times.first_connect, startup_times.publishing,
+                       num_connected, live_channels, startup_times.first_orbit);
+            }
+            if (delivery == DELIVER_LATEST && !completed.empty()) {
+                // holdoff after delivering (in milliseconds).  16 ms is about 60 Hz.
+                static const int flushPeriod = 4;
                 std::this_thread::sleep_for(std::chrono::milliseconds(flushPeriod));
             }
             const std::lock_guard<std::mutex> lock(mutex);
             completed.clear();
-            hasCompleteOrbit = false;
+            finals.clear();
         }
-        const std::lock_guard<std::mutex> lock(mutex);
-        if (waiting) {
-            wakeup.wait();
+        // Announce that we are going to sleep before the final check, so a
+        // channel becoming ready after the check is sure to signal us.
+        // With a pulse waiting on its deadline, sleep no longer than that.
+        waiting = true;
+        bool idle = ready_channels.empty() && table.blocks.empty() && !connections_changed && !layout_pending;
+        for (size_t s=0, N=shards.size(); idle && s<N; s++) {
+            idle = shards[s]->parts.empty();
+        }
+        if (idle && run) {
+            if (next_deadline == std::chrono::steady_clock::time_point::max()) {
+                wakeup.wait();
+            } else {
+                const double wait = std::chrono::duration<double>(next_deadline - std::chrono::steady_clock::now()).count();
+                if (wait > 0.0) {
+                    wakeup.wait(wait);
+                }
+            }
         }
+        waiting = false;
         epicsTimeGetCurrent(&now);
     }
 }
 
 void Orbit::dequeue_pv_data() {
-    bool all_queues_empty = true;
-    for (size_t i=0, N=pvs.size(); i<N; i++) {
-        for (size_t j=0; j<3; j++) {
-            auto pv = pvs[i][j];
-            DBRValue val(pv->pop());
-            if (!val.valid()) {
+    const std::chrono::steady_clock::time_point dequeued(std::chrono::steady_clock::now());
+    Channel* channel;
+    while (ready_channels.pop(channel)) {
+        // Clear before draining, so an update pushed after the drain re-lists the channel.
+        channel->queued = false;
+        DBRValue* val = channel->values.front();
+        if (val) {
+            counters.ingest_latency.add(val->received, dequeued);
+        }
+        for (; val; channel->values.pop(), val = channel->values.front()) {
+            OrbitSlot* slot = slot_for(val->ts);
+            if (!slot) {
+                counters.late++;
                 continue;
             }
-            all_queues_empty = false;
-            epicsUInt64 key = ((epicsUInt64)(val->ts.secPastEpoch)) << 32 | val->ts.nsec;
-            if (key <= oldest_key) {
+            if (!fill(*slot, channel->index, val->as_double(), val->sevr, val->stat, val->received)) {
+                counters.duplicates++;
+            } else if (account(*slot, channel->index)) {
+                finish(*slot);
+            }
+        }
+    }
+}
+
+// Assemble blocks from a table source.  A row is a whole pulse, so it
+// takes one slot lookup however many channels it carries.
+void Orbit::dequeue_table_rows() {
+    RowBlock* block = table.blocks.front();
+    if (block) {
+        counters.ingest_latency.add(block->received, std::chrono::steady_clock::now());
+    }
+    for (; block; table.blocks.pop(), block = table.blocks.front()) {
+        const size_t R = block->rows();
+        for (size_t r=0; r<R; r++) {
+            OrbitSlot* slot = slot_for(block->ts[r]);
+            if (!slot) {
+                counters.late += block->channels.size();
                 continue;
             }
-            bool orbitExists = false;
-            if (events.find(key) != events.end()) {
-                orbitExists = true;
+            for (size_t k=0, C=block->channels.size(); k<C; k++) {
+                const size_t c = block->channels[k], v = k*R + r;
+                if (!fill(*slot, c, block->values[v], block->sevr[v], block->stat[v], block->received)) {
+                    counters.duplicates++;
+                } else if (account(*slot, c)) {
+                    // The slot has been handed on; anything left is for disconnected channels.
+                    finish(*slot);
+                    break;
+                }
             }
-            events_t::mapped_type& incompleteOrbit = events[key];
-            if (!orbitExists) {
-                //This orbit is brand new, so we need to initialize it.
-                incompleteOrbit.values.resize(pvs.size());
-                incompleteOrbit.complete = false;
-                incompleteOrbit.ts = val->ts;
+        }
+    }
+}
+
+// Merge what the shards have handed on.
+void Orbit::dequeue_parts() {
+    for (size_t s=0, N=shards.size(); s<N; s++) {
+        SPSCQueue<OrbitPart>& parts = shards[s]->parts;
+        for (OrbitPart* part = parts.front(); part; parts.pop(), part = parts.front()) {
+            merge(s, *part);
+        }
+    }
+}
+
+// Join one shard's share of a pulse into the pulse's slot: copy in the
+// values it has which the slot hasn't, and take over its accounting a word
+// at a time.
+void Orbit::merge(size_t shard, const OrbitPart& part) {
+    const size_t num_shards = shards.size(), num_bpms = retired.size();
+    OrbitSlot* slot = slot_for(part.ts);
+    size_t fresh = 0u;
+    for (size_t k=0, K=part.accounted.size()/3u; k<K; k++) {
+        const size_t block = k*num_shards + shard, first = block*shardBlock;
+        if (first >= num_bpms) {
+            break;
+        }
+        for (size_t j=0; j<NUM_AXES; j++) {
+            for (size_t i=0, N=std::min(shardBlock, num_bpms - first); i<N; i++) {
+                const size_t l = k*shardBlock + i, g = first + i;
+                if (part.severity[j][l] == MISSING_SEVERITY || (slot && slot->data->severity[j][g] != MISSING_SEVERITY)) {
+                    continue;
+                }
+                fresh++;
+                if (slot) {
+                    slot->data->value[j][g] = part.value[j][l];
+                    slot->data->severity[j][g] = part.severity[j][l];
+                    slot->data->status[j][g] = part.status[j][l];
+                    slot->arrived[3u*g + j] = part.arrived[3u*l + j];
+                }
             }
-            if (incompleteOrbit.complete) {
-                printf("Something wen't wrong - found a new value for an already-complete orbit.\n");
+        }
+        for (size_t w=0; slot && w<3u && 3u*block + w < slot->accounted.size(); w++) {
+            epicsUInt64& word = slot->accounted[3u*block + w];
+            const epicsUInt64 newly = part.accounted[3u*k + w] & ~word;
+            word |= newly;
+            slot->outstanding -= std::bitset<64>(newly).count();
+        }
+    }
+    if (!slot) {
+        counters.late += fresh;
+        return;
+    }
+    if (part.first_arrival < slot->first_arrival) {
+        slot->first_arrival = part.first_arrival;
+    }
+    if (slot->emitted && fresh > 0u) {
+        slot->backfilled = true;
+        counters.backfilled += fresh;
+    }
+    if (slot->outstanding == 0u) {
+        finish(*slot);
+    }
+}
+
+// The slot for the pulse at 'ts', or NULL if a value for it is too late.
+OrbitSlot* Orbit::slot_for(const epicsTimeStamp& ts) {
+    const epicsUInt64 key = ((epicsUInt64)(ts.secPastEpoch)) << 32 | ts.nsec;
+    if (key > oldest_key) {
+        return find_slot(key, ts);
+    }
+    // Only a pulse published at its deadline still takes values.
+    OrbitSlot* slot = &slots[slot_index(ts)];
+    if (slot->key != key || !slot->emitted) {
+        return nullptr;
+    }
+    return slot;
+}
+
+// Store one channel's value in a slot.  Returns false if the slot already
+// has one.
+bool Orbit::fill(OrbitSlot& slot, size_t channel, double value, epicsUInt16 sevr, epicsUInt16 stat, std::chrono::steady_clock::time_point received) {
+    const size_t i = channel / 3u, j = channel % 3u;
+    if (slot.data->severity[j][i] != MISSING_SEVERITY) {
+        return false;
+    }
+    slot.data->value[j][i] = value;
+    slot.data->severity[j][i] = sevr;
+    slot.data->status[j][i] = stat;
+    slot.arrived[channel] = received;
+    if (received < slot.first_arrival) {
+        slot.first_arrival = received;
+    }
+    if (slot.emitted) {
+        slot.backfilled = true;
+        counters.backfilled++;
+    }
+    return true;
+}
+
+// Locate the slot assembling 'key', claiming it if the slot is free or holds
+// an older pulse.  Returns NULL if the slot is busy with a newer pulse, in
+// which case this value arrived too late to be used.  An older pulse which
+// was already published is finished off rather than dropped, and with a
+// deadline one which wasn't is published first, incomplete.
+OrbitSlot* Orbit::find_slot(epicsUInt64 key, const epicsTimeStamp& ts) {
+    OrbitSlot& slot = slots[slot_index(ts)];
+    if (slot.key == key) {
+        return &slot;
+    }
+    if (slot.key > key) {
+        return nullptr;
+    }
+    if (slot.key != 0u && !slot.emitted && deadline > 0.0) {
+        publish_older(slot.key + 1u);
+    }
+    if (slot.key != 0u && slot.emitted) {
+        finalize(slot);
+    } else if (slot.key != 0u) {
+        evict(slot);
+        counters.dropped++;
+    }
+    slot.key = key;
+    slot.data->ts = ts;
+    slot.data->clear();
+    slot.accounted = disconnected_mask;
+    slot.outstanding = num_connected;
+    slot.first_arrival = std::chrono::steady_clock::time_point::max();
+    slot.emitted = false;
+    slot.backfilled = false;
+    num_pending++;
+    return &slot;
+}
+
+// Mark 'channel' as delivered (or given up on) for this slot.  Returns true
+// once nothing is outstanding.
+bool Orbit::account(OrbitSlot& slot, size_t channel) {
+    epicsUInt64& word = slot.accounted[channel/64u];
+    const epicsUInt64 bit = epicsUInt64(1u) << (channel%64u);
+    if (!(word & bit)) {
+        word |= bit;
+        slot.outstanding--;
+    }
+    return slot.outstanding == 0u;
+}
+
+void Orbit::complete(OrbitSlot& slot) {
+    // Anything older than this pulse can no longer be delivered in order,
+    // unless it goes out now, incomplete.
+    if (deadline > 0.0) {
+        publish_older(slot.key);
+    } else {
+        for (size_t s=0, N=slots.size(); s<N; s++) {
+            if (slots[s].key != 0u && slots[s].key < slot.key) {
+                evict(slots[s]);
+                counters.dropped++;
             }
-            if (!incompleteOrbit.values[i][j].valid()) {
-                incompleteOrbit.values[i][j].swap(val);
-            } else {
-                printf("Uh oh, recieved a duplicate value with same timestamp.\n");
+        }
+    }
+    oldest_key = slot.key;
+    profile_lateness(slot);
+    OrbitRef orbit(publish(slot, false));
+    orbit->complete = true;
+    orbit->completed_at = std::chrono::steady_clock::now();
+    counters.completed++;
+    completed.push_back(orbit);
+    slot.key = 0u;
+    num_pending--;
+}
+
+// Publish what has arrived for this pulse so far.  The slot carries on
+// assembling, towards a final orbit, so receivers get a copy.
+void Orbit::publish_partial(OrbitSlot& slot) {
+    OrbitRef orbit(publish(slot, true));
+    orbit->complete = false;
+    orbit->completed_at = std::chrono::steady_clock::now();
+    counters.partial++;
+    completed.push_back(orbit);
+    slot.emitted = true;
+    oldest_key = slot.key;
+}
+
+// Publish every pulse older than 'key' which hasn't been yet, oldest first.
+void Orbit::publish_older(epicsUInt64 key) {
+    while (true) {
+        OrbitSlot* oldest = nullptr;
+        for (size_t s=0, N=slots.size(); s<N; s++) {
+            if (slots[s].key != 0u && slots[s].key < key && !slots[s].emitted && (!oldest || slots[s].key < oldest->key)) {
+                oldest = &slots[s];
             }
         }
+        if (!oldest) {
+            break;
+        }
+        publish_partial(*oldest);
+    }
+}
+
+// Retire a published pulse once it is complete or can wait no longer.  If
+// anything was filled in since, final receivers get the corrected orbit.
+void Orbit::finalize(OrbitSlot& slot) {
+    profile_lateness(slot);
+    if (slot.backfilled) {
+        OrbitRef orbit(publish(slot, false));
+        orbit->complete = slot.outstanding == 0u;
+        orbit->completed_at = std::chrono::steady_clock::now();
+        counters.finals++;
+        finals.push_back(orbit);
+    }
+    slot.emitted = false;
+    evict(slot);
+}
+
+// The orbit assembled in 'slot', in the order of the layout.  Unless the
+// slot will 'keep' assembling it, the slot's own data is handed over when
+// it is already in order, and the slot started on a recycled one.
+OrbitRef Orbit::publish(OrbitSlot& slot, bool keep) {
+    OrbitRef orbit;
+    const OrbitData& in = *slot.data;
+    if (identity && !keep) {
+        orbit = slot.data;
+        slot.data = pool.get();
+    } else if (identity) {
+        orbit = pool.get();
+        orbit->ts = in.ts;
+        for (size_t j=0; j<NUM_AXES; j++) {
+            orbit->value[j] = in.value[j];
+            orbit->severity[j] = in.severity[j];
+            orbit->status[j] = in.status[j];
+        }
+    } else {
+        orbit = layout_pool.get();
+        orbit->ts = in.ts;
+        OrbitData& out = *orbit;
+        for (size_t j=0; j<NUM_AXES; j++) {
+            for (size_t i=0, N=positions.size(); i<N; i++) {
+                const size_t p = positions[i];
+                out.value[j][i] = in.value[j][p];
+                out.severity[j][i] = in.severity[j][p];
+                out.status[j][i] = in.status[j][p];
+            }
+        }
+    }
+    orbit->layout = layout;
+    return orbit;
+}
+
+// A slot has nothing outstanding: deliver it, or finish off the published one.
+void Orbit::finish(OrbitSlot& slot) {
+    if (slot.emitted) {
+        finalize(slot);
+    } else {
+        complete(slot);
+    }
+}
+
+// Record how long after the first value of this pulse each value arrived.
+void Orbit::profile_lateness(const OrbitSlot& slot) {
+    const size_t N = slot.arrived.size();
+    size_t first = N, last = N;
+    for (size_t c=0; c<N; c++) {
+        if (slot.data->severity[c%3u][c/3u] == MISSING_SEVERITY) {
+            continue;
+        }
+        if (first == N || slot.arrived[c] < slot.arrived[first]) {
+            first = c;
+        }
+        if (last == N || slot.arrived[c] > slot.arrived[last]) {
+            last = c;
+        }
+    }
+    if (first == N) {
+        return;
+    }
+    for (size_t c=0; c<N; c++) {
+        if (slot.data->severity[c%3u][c/3u] != MISSING_SEVERITY) {
+            lateness_sketches[c].add(slot.arrived[c] - slot.arrived[first]);
+        }
+    }
+    times_last[last]++;
+    if (adaptive_deadline && ++profiled >= adaptEvery) {
+        profiled = 0u;
+        adapt_deadline();
+    }
+}
+
+// Wait as long as the slowest channel usually needs, within the configured
+// deadline.  Late values are profiled too, so this can grow as well as shrink.
+void Orbit::adapt_deadline() {
+    double worst_us = 0.0;
+    for (size_t c=0, N=lateness_sketches.size(); c<N; c++) {
+        if (channel_connected[c] && !lateness_sketches[c].empty()) {
+            worst_us = std::max(worst_us, lateness_sketches[c].quantile(deadlineQuantile));
+        }
+    }
+    const double seconds = std::min(deadline, std::max(minDeadline, deadlineMargin*worst_us*1e-6));
+    current_deadline = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+OrbitLateness Orbit::lateness() {
+    OrbitLateness ret;
+    const std::lock_guard<std::mutex> lock(mutex);
+    const size_t num_bpms = positions.size();
+    ret.names = layout->names;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        ret.median_us[j].resize(num_bpms);
+        ret.p99_us[j].resize(num_bpms);
+        ret.last[j].resize(num_bpms);
+        for (size_t i=0; i<num_bpms; i++) {
+            const size_t c = 3u*positions[i] + j;
+            ret.median_us[j][i] = lateness_sketches[c].quantile(0.5);
+            ret.p99_us[j][i] = lateness_sketches[c].quantile(0.99);
+            ret.last[j][i] = times_last[c];
+        }
+    }
+    return ret;
+}
+
+void Orbit::evict(OrbitSlot& slot) {
+    slot.key = 0u;
+    num_pending--;
+}
+
+// Pick up channels which have connected or disconnected since the last pass.
+// A channel which went away is no longer waited for by any pending pulse.
+void Orbit::update_connections() {
+    if (!connections_changed.exchange(false)) {
+        return;
+    }
+    for (size_t c=0, N=channels.size(); c<N; c++) {
+        const bool up = channels[c]->connected;
+        if (up == channel_connected[c]) {
+            continue;
+        }
+        channel_connected[c] = up;
+        const epicsUInt64 bit = epicsUInt64(1u) << (c%64u);
+        if (up) {
+            num_connected++;
+            disconnected_mask[c/64u] &= ~bit;
+            if (startup_times.first_connect < 0.0) {
+                startup_times.first_connect = since_created();
+            }
+            continue;
+        }
+        num_connected--;
+        disconnected_mask[c/64u] |= bit;
+        for (size_t s=0, NS=slots.size(); s<NS; s++) {
+            if (slots[s].key != 0u) {
+                account(slots[s], c);
+            }
+        }
+    }
+    connection_cv.notify_all();
+    //Deliver whatever that finished off, oldest first.
+    while (true) {
+        OrbitSlot* oldest = nullptr;
+        for (size_t s=0, N=slots.size(); s<N; s++) {
+            if (slots[s].key != 0u && slots[s].outstanding == 0u && (!oldest || slots[s].key < oldest->key)) {
+                oldest = &slots[s];
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        finish(*oldest);
     }
-    waiting = all_queues_empty;
 }
 
 void Orbit::check_for_complete() {
-    epicsUInt64 max_age = maxEventAge;
-    max_age <<= 32;
-    max_age |= epicsUInt32(1000000000u * fmod(maxEventAge, 1.0));
-    events_t::iterator first_incomplete(events.end());
-    size_t i = events.size();
-    size_t numComplete = 0;
+    next_deadline = std::chrono::steady_clock::time_point::max();
+    if (num_pending == 0u) {
+        return;
+    }
+    const epicsUInt64 max_age = max_age_key();
+    //Erase all incomplete orbits that are too old.
+    for (size_t s=0, N=slots.size(); s<N; s++) {
+        if (slots[s].key == 0u) {
+            continue;
+        }
+        epicsInt64 key_age = epicsInt64(now_key) - epicsInt64(slots[s].key);
+        if (key_age >= epicsInt64(max_age) && slots[s].emitted) {
+            finalize(slots[s]);
+        } else if (key_age >= epicsInt64(max_age)) {
+            evict(slots[s]);
+            counters.expired++;
+        }
+    }
+    if (deadline <= 0.0) {
+        return;
+    }
+    //Publish pulses which have reached their deadline, and anything older.
+    const std::chrono::steady_clock::time_point steady_now(std::chrono::steady_clock::now());
+    epicsUInt64 due = 0u;
+    for (size_t s=0, N=slots.size(); s<N; s++) {
+        if (slots[s].key == 0u || slots[s].emitted) {
+            continue;
+        }
+        const std::chrono::steady_clock::time_point at(slots[s].first_arrival + current_deadline);
+        if (at <= steady_now) {
+            due = std::max(due, slots[s].key);
+        } else if (at < next_deadline) {
+            next_deadline = at;
+        }
+    }
+    if (due != 0u) {
+        publish_older(due + 1u);
+    }
+}
+
+bool Orbit::wait_for_connection(std::chrono::milliseconds timeout, double fraction) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return connection_cv.wait_for(lock, timeout, [this, fraction]() {
+        return double(num_connected) >= fraction*double(live_channels);
+    });
+}
+
+bool Orbit::set_bpms(const std::vector<std::string>& bpm_names, const std::vector<double>& z_vals) {
+    if (bpm_names.size() != z_vals.size()) {
+        throw std::runtime_error("BPM names and z positions differ in number");
+    }
+    const std::lock_guard<std::mutex> reloading(reload_mutex);
+    std::vector<size_t> new_positions(bpm_names.size());
+    std::vector<Channel*> added;
+    std::vector<size_t> fresh_positions, removed;
     {
-        //First, erase all incomplete orbits that are too old.
-        for(auto it = events.begin(); it != events.end();) {
-            epicsInt64 key_age = epicsInt64(now_key) - epicsInt64(it->first);
-            if(key_age >= epicsInt64(max_age)) {
-                events.erase(it++);
-            } else {
-                ++it;
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (bpm_names == layout->names && z_vals == layout->zs) {
+            return false;
+        }
+        // BPMs staying keep their positions, new ones go on the end.
+        std::map<std::string, size_t> current, fresh;
+        for (size_t i=0, N=positions.size(); i<N; i++) {
+            current[layout->names[i]] = positions[i];
+        }
+        size_t num_bpms = retired.size();
+        for (size_t i=0, N=bpm_names.size(); i<N; i++) {
+            std::map<std::string, size_t>::const_iterator it(current.find(bpm_names[i]));
+            if (it == current.end()) {
+                it = fresh.insert(std::make_pair(bpm_names[i], num_bpms)).first;
+                if (it->second == num_bpms) {
+                    num_bpms++;
+                }
             }
+            new_positions[i] = it->second;
         }
-
-        events_t::reverse_iterator it(events.rbegin()), end(events.rend());
-        //We're iterating from newest to oldest here.
-        for(; it != end; ++it, i--) {
-            events_t::mapped_type& orbit = it->second;
-            bool complete = true;
-            for (size_t i=0, N=pvs.size(); complete && i<N; i++) {
-                for (size_t j=0; j<3; j++) {
-                    complete = complete && (!pvs[i][j]->connected || orbit.values[i][j].valid());
+        // Each channel can be on the ready list once, and the list can't grow.
+        if (3u*num_bpms > ready_channels.capacity()) {
+            throw std::runtime_error("Too many BPMs added since startup, restart to take the new list");
+        }
+        grow(num_bpms);
+        for (std::map<std::string, size_t>::const_iterator it=fresh.begin(); it!=fresh.end(); ++it) {
+            fresh_positions.push_back(it->second);
+            for (size_t j=0; j<NUM_AXES; j++) {
+                const size_t c = 3u*it->second + j;
+                channels[c].reset(new Channel(it->first + ":" + axis_names[j] + edef, *this, c, 16u));
+                added.push_back(channels[c].get());
+                if (!shards.empty()) {
+                    shards[shard_of(c, shards.size())]->attach(channels[c].get());
                 }
             }
-            if (complete) {
-                orbit.complete = true;
-                numComplete++;
+        }
+        live_channels += added.size();
+        const std::set<std::string> kept(bpm_names.begin(), bpm_names.end());
+        for (std::map<std::string, size_t>::const_iterator it=current.begin(); it!=current.end(); ++it) {
+            if (!kept.count(it->first)) {
+                removed.push_back(it->second);
             }
         }
     }
+    // New channels start out disconnected, so nothing waits for them until
+    // they connect, and the old ones keep feeding the pulses in flight
+    // until the switch.
+    if (!added.empty()) {
+        try {
+            source.subscribe_all(added);
+        } catch (...) {
+            // Leave the new BPMs as gaps, as if they had been removed again.
+            for (size_t k=0, N=added.size(); k<N; k++) {
+                source.unsubscribe(added[k]);
+            }
+            retire(fresh_positions);
+            connection_changed();
+            throw;
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending_layout.reset(new OrbitLayout(bpm_names, z_vals));
+        pending_positions.swap(new_positions);
+        layout_pending = true;
+        wakeup.signal();
+        layout_cv.wait(lock, [this]() { return !layout_pending || !run; });
+    }
+    for (size_t k=0, N=removed.size(); k<N; k++) {
+        for (size_t j=0; j<NUM_AXES; j++) {
+            source.unsubscribe(channels[3u*removed[k] + j].get());
+        }
+    }
+    retire(removed);
+    // Deliver whatever that finished off.
+    connection_changed();
+    return true;
+}
 
-    completed.clear();
-    if (numComplete == 0) {
+// Take the BPMs at 'bpms' off the list for good, once their channels are
+// unsubscribed.  Nothing waits for them any more, as if they had
+// disconnected.
+void Orbit::retire(const std::vector<size_t>& bpms) {
+    const std::lock_guard<std::mutex> lock(mutex);
+    for (size_t k=0, N=bpms.size(); k<N; k++) {
+        retired[bpms[k]] = true;
+        live_channels -= NUM_AXES;
+        for (size_t j=0; j<NUM_AXES; j++) {
+            const size_t c = 3u*bpms[k] + j;
+            channels[c]->connected = false;
+            if (!channel_connected[c]) {
+                continue;
+            }
+            channel_connected[c] = false;
+            num_connected--;
+            disconnected_mask[c/64u] |= epicsUInt64(1u) << (c%64u);
+            for (size_t s=0, NS=slots.size(); s<NS; s++) {
+                if (slots[s].key != 0u) {
+                    account(slots[s], c);
+                }
+            }
+        }
+    }
+}
+
+// Make room for BPMs up to 'num_bpms', which pulses in flight don't wait for.
+void Orbit::grow(size_t num_bpms) {
+    const size_t first = channels.size(), num_channels = 3u*num_bpms;
+    if (num_channels <= first) {
         return;
     }
-    events_t::iterator it(events.begin()), end(events.end());
-    ///Now we iterate from oldest to newest.
-    completed.reserve(numComplete);
-    while(it != end) {
-        events_t::iterator cur = it++;
-        if (cur->second.complete) {
-            oldest_key = cur->first;
-            completed.push_back(cur->second);
-            events.erase(cur);
+    channels.resize(num_channels);
+    channel_connected.resize(num_channels, false);
+    disconnected_mask.resize((num_channels + 63u)/64u, 0u);
+    const size_t padded = 64u*disconnected_mask.size();
+    for (size_t c=first; c<padded; c++) {
+        disconnected_mask[c/64u] |= epicsUInt64(1u) << (c%64u);
+    }
+    for (size_t s=0, N=slots.size(); s<N; s++) {
+        OrbitSlot& slot = slots[s];
+        slot.data->resize(num_bpms);
+        slot.accounted.resize(disconnected_mask.size(), 0u);
+        for (size_t c=first; c<padded; c++) {
+            slot.accounted[c/64u] |= epicsUInt64(1u) << (c%64u);
         }
+        slot.arrived.resize(num_channels);
     }
-
-    while(events.size() > 10) {
-        events.erase(events.begin());
+    lateness_sketches.resize(num_channels);
+    times_last.resize(num_channels, 0u);
+    retired.resize(num_bpms, false);
+    pool.resize(num_bpms);
+    // The slots are now wider than the layout, so until the new one is
+    // applied they have to be gathered into it.
+    identity = identity && positions.size() == num_bpms;
+    for (size_t s=0, N=shards.size(); s<N; s++) {
+        shards[s]->grow(num_bpms);
     }
 }
 
-bool Orbit::wait_for_connection(std::chrono::seconds timeout) {
-  auto start_time = std::chrono::steady_clock::now();
-  while (connected() == false) {
-    auto current_time = std::chrono::steady_clock::now();
-    auto elapsed_seconds = std::chrono::duration_cast<std::chrono::milliseconds>(current_time - start_time);
-    if (elapsed_seconds.count() > std::chrono::milliseconds(timeout).count()) {
-      return false;
+// Switch to the pending layout, between passes.
+std::shared_ptr<const OrbitLayout> Orbit::apply_layout() {
+    layout = pending_layout;
+    pending_layout.reset();
+    positions.swap(pending_positions);
+    identity = positions.size() == retired.size();
+    for (size_t i=0, N=positions.size(); identity && i<N; i++) {
+        identity = positions[i] == i;
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-  }
-  return true;
-}
\ No newline at end of file
+    layout_pool.resize(positions.size());
+    layout_pending = false;
+    layout_cv.notify_all();
+    return layout;
+}
@@ -3,64 +3,483 @@
 
 #include <vector>
 #include <array>
+#include <memory>
 #include <string>
 #include <thread>
 #include <mutex>
 #include <fstream>
 #include <set>
-#include <map>
 #include <chrono>
+#include <atomic>
+#include <condition_variable>
 #include <epicsTypes.h>
 #include <epicsEvent.h>
 #include "pv.h"
+#include "histogram.h"
 
+enum Axis { AXIS_X = 0, AXIS_Y = 1, AXIS_TMIT = 2, NUM_AXES = 3 };
+
+// Severity recorded for a BPM axis which did not report for a pulse.
+static const epicsUInt16 MISSING_SEVERITY = 4;
+
+class OrbitPool;
+
+// The BPMs an orbit is published with: column i of each OrbitData is BPM
+// names[i], at zs[i].  Replaced as a whole when the BPM list is reloaded
+// (see Orbit::set_bpms()), so every orbit handed out can say which list
+// it was assembled for.
+struct OrbitLayout {
+    std::vector<std::string> names;
+    std::vector<double> zs;
+    OrbitLayout(const std::vector<std::string>& names, const std::vector<double>& zs) : names(names), zs(zs) {}
+};
+
+// One pulse, stored by column: for each axis, contiguous arrays indexed by
+// BPM.  Filled directly by the ingest stage, and handed to receivers as is.
+// Instances come from an OrbitPool and are shared through OrbitRef.
 struct OrbitData {
     epicsTimeStamp ts;
-    std::vector<std::array<DBRValue, 3>> values;
+    std::array<std::vector<double>, NUM_AXES> value;
+    std::array<std::vector<epicsUInt16>, NUM_AXES> severity;
+    std::array<std::vector<epicsUInt16>, NUM_AXES> status;
     bool complete;
+    // the BPMs of the columns, on orbits handed to receivers
+    std::shared_ptr<const OrbitLayout> layout;
+    // when assembly finished with it
+    std::chrono::steady_clock::time_point completed_at;
+    std::atomic<unsigned> refs;
+    OrbitPool* pool;
+    OrbitData() : complete(false), refs(0u), pool(0) {
+        ts.secPastEpoch = 0;
+        ts.nsec = 0;
+    }
+    size_t size() const { return value[AXIS_X].size(); }
+    void resize(size_t num_bpms);
+    // Mark every entry as missing, keeping the storage.
+    void clear();
+};
+
+// Reference counted handle to a pooled OrbitData.  Dropping the last
+// reference returns the orbit to its pool instead of freeing it.
+class OrbitRef {
+    OrbitData* ptr;
+public:
+    OrbitRef() : ptr(0) {}
+    explicit OrbitRef(OrbitData* p) : ptr(p) { if (ptr) ptr->refs++; }
+    OrbitRef(const OrbitRef& o) : ptr(o.ptr) { if (ptr) ptr->refs++; }
+    ~OrbitRef() { reset(); }
+    OrbitRef& operator=(const OrbitRef& o) {
+        OrbitRef tmp(o);
+        std::swap(ptr, tmp.ptr);
+        return *this;
+    }
+    void reset();
+    bool valid() const { return ptr != 0; }
+    OrbitData& operator*() const { return *ptr; }
+    OrbitData* operator->() const { return ptr; }
+};
+
+// Recycles OrbitData sized for a number of BPMs.  Must outlive every
+// OrbitRef taken from it.
+class OrbitPool {
+public:
+    explicit OrbitPool(size_t num_bpms);
+    ~OrbitPool();
+    OrbitRef get();
+    // Size OrbitData handed out from now on for 'num_bpms'.  Spares of the
+    // old size are resized as they are taken.
+    void resize(size_t num_bpms);
+    void recycle(OrbitData* o);
+    // number of OrbitData ever allocated by this pool
+    std::atomic<size_t> allocations;
+private:
+    std::atomic<size_t> num_bpms;
+    MPMCQueue<OrbitData*> spare;
+    OrbitPool(const OrbitPool&);
+    OrbitPool& operator=(const OrbitPool&);
+};
+
+inline void OrbitRef::reset() {
+    if (ptr && ptr->refs.fetch_sub(1u) == 1u) {
+        ptr->pool->recycle(ptr);
+    }
+    ptr = 0;
+}
+
+// One entry of the assembly ring: a pulse whose values are still arriving.
+// 'accounted' has one bit per channel (3*bpm + axis) which is set once that
+// channel has delivered, or is known not to be coming (it was disconnected).
+// 'outstanding' counts the clear bits, so the slot is complete at zero.
+struct OrbitSlot {
+    epicsUInt64 key;
+    OrbitRef data;
+    std::vector<epicsUInt64> accounted;
+    size_t outstanding;
+    // when each channel's value reached us, if it has
+    std::vector<std::chrono::steady_clock::time_point> arrived;
+    // when the first value arrived, which starts the deadline clock
+    std::chrono::steady_clock::time_point first_arrival;
+    // published before it was complete, and still taking late values
+    bool emitted;
+    // has taken values since it was published
+    bool backfilled;
+};
+
+// One shard's share of a pulse, on its way from the shard's thread to the
+// processing thread (see Orbit's 'workers').  The shard's BPMs, block by
+// block, as they stood in its slot, so a later part for the same pulse
+// carries everything an earlier one did.
+struct OrbitPart {
+    epicsTimeStamp ts;
+    std::array<std::vector<double>, NUM_AXES> value;
+    std::array<std::vector<epicsUInt16>, NUM_AXES> severity;
+    std::array<std::vector<epicsUInt16>, NUM_AXES> status;
+    std::vector<epicsUInt64> accounted;
+    std::vector<std::chrono::steady_clock::time_point> arrived;
+    std::chrono::steady_clock::time_point first_arrival;
+};
+
+// How completed orbits are handed to receivers.
+enum DeliveryMode {
+    // every completed orbit, oldest first
+    DELIVER_ALL,
+    // only the newest orbit completed in each pass, then hold off for 4 ms
+    DELIVER_LATEST,
+};
+
+// What an asynchronous receiver's queue does when the receiver falls behind.
+enum QueuePolicy {
+    // discard the oldest queued orbit to make room
+    QUEUE_DROP_OLDEST,
+    // discard the orbit being delivered
+    QUEUE_DROP_NEWEST,
+    // hold up assembly until there is room
+    QUEUE_BLOCK,
+};
+
+// How a receiver wants to be fed.  By default it is called directly on the
+// assembly thread.  An asynchronous receiver gets its own bounded queue and
+// worker thread, so a slow one can't hold up assembly for everyone else.
+// A 'final' receiver gets, instead of the normal stream, the corrected
+// orbit of each pulse which was published at its deadline and then had
+// late values filled in (see Orbit::set_deadline()).  An asynchronous
+// receiver can also ask for only every 'every'th orbit, which saves queueing
+// and waking it for the ones it would throw away.
+struct ReceiverOptions {
+    bool async;
+    size_t depth;
+    QueuePolicy policy;
+    bool final;
+    size_t every;
+    ReceiverOptions() : async(false), depth(16u), policy(QUEUE_DROP_OLDEST), final(false), every(1u) {}
+    ReceiverOptions(size_t depth, QueuePolicy policy, bool final = false, size_t every = 1u) : async(true), depth(depth), policy(policy), final(final), every(every) {}
 };
 
 struct Receiver {
     virtual ~Receiver() {}
+    virtual ReceiverOptions options() const { return ReceiverOptions(); }
     virtual void setNames(const std::vector<std::string>& n) = 0;
     virtual void setZs(const std::vector<double>& zs) = 0;
     virtual void setCompletedOrbit(const OrbitData& completed_orbit) = 0;
 };
 
+// Counters for one asynchronous receiver.
+struct ReceiverStats {
+    Receiver* receiver;
+    // orbits waiting now, and the most there have ever been
+    size_t queued;
+    size_t max_queued;
+    size_t delivered;
+    size_t dropped;
+    // time from queueing to delivery (seconds), latest and worst
+    double lag;
+    double max_lag;
+};
+
+// Health counters for one orbit.  Updated by the assembly thread, and
+// post_latency also by receiver threads; readable at any time.
+struct OrbitCounters {
+    std::atomic<size_t> completed;
+    // incomplete pulses given up on because a newer one completed, or
+    // needed the slot
+    std::atomic<size_t> dropped;
+    // incomplete pulses given up on after maxEventAge
+    std::atomic<size_t> expired;
+    // values for a pulse already delivered or given up on
+    std::atomic<size_t> late;
+    // values for a pulse the channel had already reported
+    std::atomic<size_t> duplicates;
+    // incomplete pulses published at their deadline
+    std::atomic<size_t> partial;
+    // values filled in to a pulse after it was published
+    std::atomic<size_t> backfilled;
+    // corrected orbits handed to final receivers
+    std::atomic<size_t> finals;
+    // channels left off a full ready list, whose updates wait for the next
+    std::atomic<size_t> ready_overflows;
+    // channel update to assembly, for the oldest update of each queue drained
+    Histogram ingest_latency;
+    // orbit completed to a receiver returning from setCompletedOrbit()
+    Histogram post_latency;
+    // time spent in each phase of a processing pass
+    Histogram update_time;
+    Histogram dequeue_time;
+    Histogram check_time;
+    Histogram deliver_time;
+    OrbitCounters() : completed(0u), dropped(0u), expired(0u), late(0u), duplicates(0u), partial(0u), backfilled(0u), finals(0u), ready_overflows(0u) {}
+};
+
+// When an orbit got through each stage of starting up, in seconds after it
+// was made, or -1 if it hasn't yet.
+struct OrbitStartup {
+    // every channel subscribed to (for CA, created and searched for)
+    double subscribed;
+    // the first channel connected
+    double first_connect;
+    // enough channels connected to start publishing, see set_startup()
+    double publishing;
+    // the first orbit handed to receivers
+    double first_orbit;
+    // orbits completed before publishing started, which were not posted
+    size_t held;
+    OrbitStartup() : subscribed(-1.0), first_connect(-1.0), publishing(-1.0), first_orbit(-1.0), held(0u) {}
+};
+
+// A snapshot of an orbit's health, from Orbit::health().
+struct OrbitHealth {
+    size_t completed;
+    size_t dropped;
+    size_t expired;
+    size_t late;
+    size_t duplicates;
+    size_t partial;
+    size_t backfilled;
+    size_t finals;
+    // deadline in force, in seconds; 0 when waiting for complete orbits
+    double deadline;
+    // summed over channels
+    size_t stale;
+    size_t overflows;
+    size_t channels;
+    size_t connected;
+    // deepest any channel queue has been
+    size_t channel_max_queued;
+    // pulses being assembled
+    size_t pending;
+    // OrbitData ever allocated
+    size_t orbit_allocations;
+    std::vector<ReceiverStats> receivers;
+    OrbitStartup startup;
+    Histogram::Snapshot ingest_latency;
+    Histogram::Snapshot post_latency;
+    Histogram::Snapshot update_time;
+    Histogram::Snapshot dequeue_time;
+    Histogram::Snapshot check_time;
+    Histogram::Snapshot deliver_time;
+};
+
+// How late each BPM axis reports, from Orbit::lateness(): over recent
+// completed pulses, the time from the first value of a pulse arriving to
+// this axis's value arriving.
+struct OrbitLateness {
+    std::array<std::vector<double>, NUM_AXES> median_us;
+    std::array<std::vector<double>, NUM_AXES> p99_us;
+    // pulses for which this axis was the last to arrive
+    std::array<std::vector<epicsUInt64>, NUM_AXES> last;
+    // the BPMs of the columns
+    std::vector<std::string> names;
+};
+
+// Feeds one asynchronous receiver from its own thread.  The receiver is
+// told of a new layout before the first orbit which has it.
+class ReceiverQueue {
+public:
+    ReceiverQueue(Receiver* receiver, const ReceiverOptions& options, Histogram& post_latency, const std::shared_ptr<const OrbitLayout>& layout);
+    ~ReceiverQueue();
+    void push(const OrbitRef& orbit);
+    // Stop the worker.  Anything still queued is discarded.
+    void stop();
+    ReceiverStats stats();
+private:
+    struct Entry {
+        OrbitRef orbit;
+        std::chrono::steady_clock::time_point queued;
+    };
+    void work();
+    Receiver* const receiver;
+    const ReceiverOptions options;
+    Histogram& post_latency;
+    // what the receiver was last told, only used by the worker
+    std::shared_ptr<const OrbitLayout> layout;
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+    // ring of options.depth entries, the oldest at 'head'
+    std::vector<Entry> entries;
+    size_t head, count;
+    // orbits pushed, for options.every
+    size_t pushed;
+    bool running;
+    ReceiverStats counters;
+    std::thread worker;
+};
+
 class Orbit {
 private:
-    std::vector<std::array<std::shared_ptr<PV>, 3>> pvs;
-    bool run;
+    ChannelSource& source;
+    // one per BPM axis, indexed by 3*bpm + axis, where a BPM keeps its
+    // position for the life of the orbit (see set_bpms())
+    std::vector<std::unique_ptr<Channel>> channels;
+    std::atomic<bool> run;
+    std::atomic<DeliveryMode> delivery;
+    // declared early: everything holding an OrbitRef must go first
+    OrbitPool pool;
+    // orbits gathered into the layout, when it isn't the slots' own
+    OrbitPool layout_pool;
+    // receiver queues report into these, so they go after the queues
+    OrbitCounters counters;
     std::mutex mutex;
     epicsEvent wakeup;
-    std::vector<std::string> names;
-    std::vector<double> zs;
+    // BPMs published: column i of the layout is BPM positions[i] of the
+    // slots, which 'identity' says is i for every column, so a finished
+    // slot can be handed over as is.  Guarded by 'mutex'.
+    std::shared_ptr<const OrbitLayout> layout;
+    std::vector<size_t> positions;
+    bool identity;
+    // per BPM position, taken off the list by a reload
+    std::vector<bool> retired;
+    // channels of BPMs on the list
+    size_t live_channels;
+    const std::string edef;
     std::thread processingThread;
     
-    bool waiting;
-    std::set<Receiver*> receivers;
-    bool receivers_changed;
+    // set while the processing thread is (about to be) blocked on 'wakeup'
+    std::atomic<bool> waiting;
+    // channels with data in their queues, each listed at most once
+    MPMCQueue<Channel*> ready_channels;
+    // Receivers with, for asynchronous ones, their queue.  Replaced as a
+    // whole when one is added or removed, so the processing thread can take
+    // a snapshot without copying.
+    struct Feed {
+        Receiver* receiver;
+        std::shared_ptr<ReceiverQueue> queue;
+        bool final;
+    };
+    typedef std::vector<Feed> feeds_t;
+    std::shared_ptr<const feeds_t> receivers;
+    // held while delivering, so a removed receiver is known not to be in use
+    std::mutex delivery_mutex;
+    void deliver(const feeds_t& feeds, const OrbitRef& orbit, bool final);
     
-    typedef std::map<epicsUInt64, OrbitData> events_t;
-    events_t events;
-    std::set<Receiver*> receivers_shadow;
+    std::vector<OrbitSlot> slots;
+    // Sharded assembly, see the constructor.  Empty when the processing
+    // thread assembles every channel itself.
+    struct Shard;
+    std::vector<std::unique_ptr<Shard>> shards;
+    // shards hand on their slots after every pass, not just when done
+    std::atomic<bool> forward_partial;
+    void dequeue_parts();
+    void merge(size_t shard, const OrbitPart& part);
+    size_t num_pending;
+    std::atomic<bool> connections_changed;
+    std::vector<bool> channel_connected;
+    std::vector<epicsUInt64> disconnected_mask;
+    size_t num_connected;
     epicsTimeStamp now;
     epicsUInt64 now_key, oldest_key;
-    bool hasCompleteOrbit;
-    OrbitData latestCompleteOrbit;
-    std::vector<OrbitData> completed;
+    std::vector<OrbitRef> completed;
+    // corrected orbits for final receivers, in the order they were finished
+    std::vector<OrbitRef> finals;
+    // Latency mode, see set_deadline().  'current_deadline' is what's in
+    // force, and 'next_deadline' when the earliest pending pulse falls due.
+    double deadline;
+    bool adaptive_deadline;
+    std::chrono::steady_clock::duration current_deadline;
+    std::chrono::steady_clock::time_point next_deadline;
+    size_t profiled;
+    // Startup, see set_startup().  Guarded by 'mutex', but only the
+    // processing thread writes them once it is running.
+    std::chrono::steady_clock::time_point created_at;
+    OrbitStartup startup_times;
+    double startup_fraction;
+    double startup_timeout;
+    bool publishing;
+    // signalled when num_connected changes
+    std::condition_variable connection_cv;
+    double since_created() const;
+    void check_startup();
+    // Reloads, see set_bpms().  One at a time; the new layout is handed to
+    // the processing thread, which switches to it between passes.
+    std::mutex reload_mutex;
+    std::shared_ptr<const OrbitLayout> pending_layout;
+    std::vector<size_t> pending_positions;
+    std::atomic<bool> layout_pending;
+    // signalled when the pending layout has been switched to
+    std::condition_variable layout_cv;
+    std::shared_ptr<const OrbitLayout> apply_layout();
+    void grow(size_t num_bpms);
+    void retire(const std::vector<size_t>& bpms);
+    OrbitRef publish(OrbitSlot& slot, bool keep);
+    void adapt_deadline();
+    void publish_partial(OrbitSlot& slot);
+    void publish_older(epicsUInt64 key);
+    void finalize(OrbitSlot& slot);
+    void finish(OrbitSlot& slot);
+    // per channel, lateness of recent pulses and how often it was last
+    std::vector<QuantileSketch> lateness_sketches;
+    std::vector<epicsUInt64> times_last;
+    void profile_lateness(const OrbitSlot& slot);
     void process();
     void dequeue_pv_data();
+    void dequeue_table_rows();
+    OrbitSlot* slot_for(const epicsTimeStamp& ts);
+    bool fill(OrbitSlot& slot, size_t channel, double value, epicsUInt16 sevr, epicsUInt16 stat, std::chrono::steady_clock::time_point received);
     void check_for_complete();
+    void update_connections();
+    OrbitSlot* find_slot(epicsUInt64 key, const epicsTimeStamp& ts);
+    bool account(OrbitSlot& slot, size_t channel);
+    void complete(OrbitSlot& slot);
+    void evict(OrbitSlot& slot);
 public:
-    Orbit(CAContext& context, const std::vector<std::string>& bpm_names, const std::vector<double>& z_vals, const std::string& edef_suffix);
+    // With more than one of 'workers', the BPMs are dealt out in blocks to
+    // that many shards, each assembling its share of every pulse on a
+    // thread of its own, and the processing thread only merges the shares
+    // and delivers.  Otherwise the processing thread does it all.
+    Orbit(ChannelSource& source, const std::vector<std::string>& bpm_names, const std::vector<double>& z_vals, const std::string& edef_suffix, size_t workers = 1u);
     ~Orbit();
+    // for a table source to hand over blocks of pulses, see TableFeed
+    TableFeed table;
     bool connected();
     void wake();
+    void channel_ready(Channel* channel);
+    void connection_changed();
     void close();
-    bool wait_for_connection(std::chrono::seconds timeout);
+    // Wait until at least 'fraction' of the channels are connected, or
+    // 'timeout' passes, returning whether they are.
+    bool wait_for_connection(std::chrono::milliseconds timeout, double fraction = 1.0);
+    void set_delivery_mode(DeliveryMode mode);
+    // Hold off publishing until 'fraction' of the channels have connected,
+    // or 'timeout' seconds after the orbit was made, whichever is first, so
+    // the first orbits posted aren't mostly empty.  Channels still not
+    // connected then are missing from each orbit, as usual, with a severity
+    // of MISSING_SEVERITY.  0 (the default) publishes from the first orbit.
+    void set_startup(double fraction, double timeout);
+    // Latency mode: rather than wait for every channel, publish whatever has
+    // arrived 'seconds' after the first value of a pulse, with the missing
+    // entries marked.  The pulse keeps taking values until it is complete or
+    // maxEventAge passes, and if any came in, final receivers then get the
+    // corrected orbit.  With 'adaptive', the deadline follows the p99
+    // lateness of the slowest channel, up to 'seconds'.  0 turns it off.
+    void set_deadline(double seconds, bool adaptive = false);
+    // Switch to a new list of BPMs, without losing any pulse in flight.
+    // Only the channels of BPMs which came or went are subscribed to or
+    // dropped, and receivers are told the new names and z just before the
+    // first orbit with them.  Returns false if the list is unchanged.
+    bool set_bpms(const std::vector<std::string>& bpm_names, const std::vector<double>& z_vals);
     void add_receiver(Receiver *);
     void remove_receiver(Receiver *);
+    std::vector<ReceiverStats> receiver_stats();
+    OrbitHealth health();
+    OrbitLateness lateness();
 };
 
 #endif //ORBIT_H
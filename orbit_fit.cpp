@@ -0,0 +1,294 @@
+#include "orbit_fit.h"
+#include <cmath>
+#include <limits>
+#include <map>
+#include <algorithm>
+
+// Parameters: position and angle in X and Y, and energy offset.
+static const size_t NUM_PARAMS = 5u;
+// A pivot of the scaled normal matrix below this means the parameter is
+// not constrained by the readings.
+static const double MIN_PIVOT = 1e-9;
+static const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+// Four running sums rather than one, so the adds don't wait on each other
+// and the compiler can pair them up into vector operations.
+static double dot(const double* __restrict__ x, const double* __restrict__ y, size_t n) {
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    size_t i = 0;
+    for (; i + 4u <= n; i += 4u) {
+        s0 += x[i]*y[i];
+        s1 += x[i + 1u]*y[i + 1u];
+        s2 += x[i + 2u]*y[i + 2u];
+        s3 += x[i + 3u]*y[i + 3u];
+    }
+    for (; i<n; i++) {
+        s0 += x[i]*y[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+// Invert the top left k x k of the symmetric NUM_PARAMS x NUM_PARAMS
+// matrix m in place, by Gauss-Jordan elimination on a copy scaled to a unit
+// diagonal, so the pivot test doesn't depend on the parameters' units.
+// Returns false if it is singular.
+static bool invert(double* m, size_t k) {
+    double scale[NUM_PARAMS];
+    for (size_t i=0; i<k; i++) {
+        const double d = m[i*NUM_PARAMS + i];
+        if (!(d > 0.0)) {
+            return false;
+        }
+        scale[i] = 1.0/std::sqrt(d);
+    }
+    double a[NUM_PARAMS][2*NUM_PARAMS];
+    for (size_t i=0; i<k; i++) {
+        for (size_t j=0; j<k; j++) {
+            a[i][j] = m[i*NUM_PARAMS + j]*scale[i]*scale[j];
+            a[i][k + j] = i == j ? 1.0 : 0.0;
+        }
+    }
+    for (size_t c=0; c<k; c++) {
+        size_t pivot = c;
+        for (size_t r=c+1; r<k; r++) {
+            pivot = std::fabs(a[r][c]) > std::fabs(a[pivot][c]) ? r : pivot;
+        }
+        if (!(std::fabs(a[pivot][c]) > MIN_PIVOT)) {
+            return false;
+        }
+        for (size_t j=0; j<2*k; j++) {
+            std::swap(a[c][j], a[pivot][j]);
+        }
+        const double inv = 1.0/a[c][c];
+        for (size_t j=0; j<2*k; j++) {
+            a[c][j] *= inv;
+        }
+        for (size_t r=0; r<k; r++) {
+            const double f = a[r][c];
+            if (r == c || f == 0.0) {
+                continue;
+            }
+            for (size_t j=0; j<2*k; j++) {
+                a[r][j] -= f*a[c][j];
+            }
+        }
+    }
+    for (size_t i=0; i<k; i++) {
+        for (size_t j=0; j<k; j++) {
+            m[i*NUM_PARAMS + j] = a[i][k + j]*scale[i]*scale[j];
+        }
+    }
+    return true;
+}
+
+// Invert the normal matrix for all the parameters, or failing that without
+// the energy.  Returns how many parameters that leaves.
+static size_t invert_normal(double* m) {
+    double copy[NUM_PARAMS*NUM_PARAMS];
+    std::copy(m, m + NUM_PARAMS*NUM_PARAMS, copy);
+    if (invert(m, NUM_PARAMS)) {
+        return NUM_PARAMS;
+    }
+    std::copy(copy, copy + NUM_PARAMS*NUM_PARAMS, m);
+    return invert(m, NUM_PARAMS - 1u) ? NUM_PARAMS - 1u : 0u;
+}
+
+static bool valid(double x, epicsUInt16 severity) {
+    return severity < INVALID_ALARM && x - x == 0.0;
+}
+
+// Transfer from 'from' to 'to' in one plane: position from position, from
+// angle, and from energy, in mm per mm, mm per mrad and mm per unit.  The
+// momentum ratio accounts for adiabatic damping.
+static void transfer(const PlaneOptics& from, const PlaneOptics& to, double momentum_ratio, double* r) {
+    const double dpsi = to.psi - from.psi;
+    const double c = std::cos(dpsi), s = std::sin(dpsi);
+    const double damping = std::sqrt(momentum_ratio);
+    r[0] = damping*std::sqrt(to.beta/from.beta)*(c + from.alpha*s);
+    r[1] = damping*std::sqrt(to.beta*from.beta)*s;
+    r[2] = 1e3*(to.eta - r[0]*from.eta - r[1]*from.etap);
+}
+
+void OrbitFit::build(const std::vector<std::string>& bpm_names, const std::vector<ElementOptics>& model,
+                     const std::vector<std::string>& points, size_t bpms_per_fit) {
+    std::map<std::string, const ElementOptics*> optics;
+    for (size_t i=0; i<model.size(); i++) {
+        if (model[i].x.beta > 0.0 && model[i].y.beta > 0.0) {
+            optics[model[i].name] = &model[i];
+        }
+    }
+    std::map<std::string, size_t> index;
+    for (size_t i=0; i<bpm_names.size(); i++) {
+        index[bpm_names[i]] = i;
+    }
+    num_bpms = bpm_names.size();
+    point_names = points;
+    segments.assign(points.size(), Segment());
+    for (size_t f=0; f<points.size(); f++) {
+        Segment& s = segments[f];
+        s.first = 0u;
+        s.count = 0u;
+        s.params = 0u;
+        s.num_modelled = 0u;
+        const auto bpm = index.find(points[f]);
+        const auto origin = optics.find(points[f]);
+        if (bpm == index.end() || origin == optics.end()) {
+            continue;
+        }
+        const ElementOptics& o = *origin->second;
+        const size_t n = std::min(std::max(bpms_per_fit, size_t(2u)), num_bpms - bpm->second);
+        s.first = bpm->second;
+        s.count = n;
+        // BPMs missing from the model get all zero rows, so they don't count.
+        s.modelled.assign(n, 0u);
+        s.model_x.assign(NUM_PARAMS*n, 0.0);
+        s.model_y.assign(NUM_PARAMS*n, 0.0);
+        double normal[NUM_PARAMS*NUM_PARAMS] = {0.0};
+        for (size_t k=0; k<n; k++) {
+            const auto e = optics.find(bpm_names[s.first + k]);
+            if (e == optics.end()) {
+                continue;
+            }
+            s.modelled[k] = 1u;
+            s.num_modelled++;
+            const double ratio = o.p0c > 0.0 && e->second->p0c > 0.0 ? o.p0c/e->second->p0c : 1.0;
+            double r[3];
+            transfer(o.x, e->second->x, ratio, r);
+            s.model_x[0*n + k] = r[0];
+            s.model_x[1*n + k] = r[1];
+            s.model_x[4*n + k] = r[2];
+            transfer(o.y, e->second->y, ratio, r);
+            s.model_y[2*n + k] = r[0];
+            s.model_y[3*n + k] = r[1];
+            s.model_y[4*n + k] = r[2];
+        }
+        for (size_t p=0; p<NUM_PARAMS; p++) {
+            for (size_t q=0; q<NUM_PARAMS; q++) {
+                normal[p*NUM_PARAMS + q] = dot(&s.model_x[p*n], &s.model_x[q*n], n) + dot(&s.model_y[p*n], &s.model_y[q*n], n);
+            }
+        }
+        s.params = invert_normal(normal);
+        // (A^T A)^-1 A^T, split into the X and Y halves.
+        s.fit_x.assign(NUM_PARAMS*n, 0.0);
+        s.fit_y.assign(NUM_PARAMS*n, 0.0);
+        for (size_t p=0; p<s.params; p++) {
+            for (size_t q=0; q<s.params; q++) {
+                const double c = normal[p*NUM_PARAMS + q];
+                for (size_t k=0; k<n; k++) {
+                    s.fit_x[p*n + k] += c*s.model_x[q*n + k];
+                    s.fit_y[p*n + k] += c*s.model_y[q*n + k];
+                }
+            }
+        }
+    }
+}
+
+size_t OrbitFit::fit_partial(const Segment& s, const OrbitData& orbit, double* p, double& rms, size_t& readings) const {
+    const size_t n = s.count;
+    const double* x = &orbit.value[AXIS_X][s.first];
+    const double* y = &orbit.value[AXIS_Y][s.first];
+    const epicsUInt16* sx = &orbit.severity[AXIS_X][s.first];
+    const epicsUInt16* sy = &orbit.severity[AXIS_Y][s.first];
+    double normal[NUM_PARAMS*NUM_PARAMS] = {0.0};
+    double rhs[NUM_PARAMS] = {0.0};
+    readings = 0u;
+    for (size_t k=0; k<n; k++) {
+        const bool use[2] = {s.modelled[k] && valid(x[k], sx[k]), s.modelled[k] && valid(y[k], sy[k])};
+        const double* model[2] = {&s.model_x[k], &s.model_y[k]};
+        const double reading[2] = {x[k], y[k]};
+        for (size_t j=0; j<2u; j++) {
+            if (!use[j]) {
+                continue;
+            }
+            readings++;
+            for (size_t a=0; a<NUM_PARAMS; a++) {
+                const double ma = model[j][a*n];
+                rhs[a] += ma*reading[j];
+                for (size_t b=0; b<NUM_PARAMS; b++) {
+                    normal[a*NUM_PARAMS + b] += ma*model[j][b*n];
+                }
+            }
+        }
+    }
+    const size_t params = invert_normal(normal);
+    for (size_t a=0; a<NUM_PARAMS; a++) {
+        p[a] = 0.0;
+        for (size_t b=0; b<params; b++) {
+            p[a] += a < params ? normal[a*NUM_PARAMS + b]*rhs[b] : 0.0;
+        }
+    }
+    double sum = 0.0;
+    for (size_t k=0; k<n; k++) {
+        double fx = x[k], fy = y[k];
+        for (size_t a=0; a<NUM_PARAMS; a++) {
+            fx -= s.model_x[a*n + k]*p[a];
+            fy -= s.model_y[a*n + k]*p[a];
+        }
+        sum += s.modelled[k] && valid(x[k], sx[k]) ? fx*fx : 0.0;
+        sum += s.modelled[k] && valid(y[k], sy[k]) ? fy*fy : 0.0;
+    }
+    rms = readings > 0u ? std::sqrt(sum/readings) : NaN;
+    return params;
+}
+
+void OrbitFit::fit(const OrbitData& orbit, OrbitFitResult& out) const {
+    const size_t F = segments.size();
+    out.ts = orbit.ts;
+    out.x.resize(F);
+    out.xp.resize(F);
+    out.y.resize(F);
+    out.yp.resize(F);
+    out.delta.resize(F);
+    out.rms.resize(F);
+    out.readings.resize(F);
+    for (size_t f=0; f<F; f++) {
+        const Segment& s = segments[f];
+        double p[NUM_PARAMS] = {0.0};
+        double rms = NaN;
+        size_t readings = 0u, params = 0u;
+        if (s.params > 0u && orbit.size() == num_bpms) {
+            const size_t n = s.count;
+            const double* x = &orbit.value[AXIS_X][s.first];
+            const double* y = &orbit.value[AXIS_Y][s.first];
+            const epicsUInt16* sx = &orbit.severity[AXIS_X][s.first];
+            const epicsUInt16* sy = &orbit.severity[AXIS_Y][s.first];
+            // The readings of BPMs without optics only need to be finite,
+            // as their coefficients are zero.
+            const unsigned char* m = s.modelled.data();
+            bool all = true;
+            for (size_t k=0; k<n; k++) {
+                all &= m[k] ? valid(x[k], sx[k]) & valid(y[k], sy[k]) : (x[k] - x[k] == 0.0) & (y[k] - y[k] == 0.0);
+            }
+            if (all) {
+                params = s.params;
+                for (size_t a=0; a<params; a++) {
+                    p[a] = dot(&s.fit_x[a*n], x, n) + dot(&s.fit_y[a*n], y, n);
+                }
+                const double* mx[NUM_PARAMS];
+                const double* my[NUM_PARAMS];
+                for (size_t a=0; a<NUM_PARAMS; a++) {
+                    mx[a] = &s.model_x[a*n];
+                    my[a] = &s.model_y[a*n];
+                }
+                double sum = 0.0;
+                for (size_t k=0; k<n; k++) {
+                    const double rx = x[k] - (mx[0][k]*p[0] + mx[1][k]*p[1] + mx[4][k]*p[4]);
+                    const double ry = y[k] - (my[2][k]*p[2] + my[3][k]*p[3] + my[4][k]*p[4]);
+                    sum += m[k] ? rx*rx + ry*ry : 0.0;
+                }
+                readings = 2u*s.num_modelled;
+                rms = std::sqrt(sum/readings);
+            } else {
+                params = fit_partial(s, orbit, p, rms, readings);
+            }
+        }
+        const bool fitted = params > 0u;
+        out.x[f] = fitted ? p[0] : NaN;
+        out.xp[f] = fitted ? p[1] : NaN;
+        out.y[f] = fitted ? p[2] : NaN;
+        out.yp[f] = fitted ? p[3] : NaN;
+        out.delta[f] = params == NUM_PARAMS ? p[4] : NaN;
+        out.rms[f] = fitted ? rms : NaN;
+        out.readings[f] = epicsUInt32(readings);
+    }
+}
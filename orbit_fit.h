@@ -0,0 +1,78 @@
+#ifndef ORBIT_FIT_H
+#define ORBIT_FIT_H
+
+#include <string>
+#include <vector>
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include "orbit.h"
+
+// Linear optics of one plane at one element, as given by the model: beta
+// (m), alpha, betatron phase (rad), dispersion (m) and its slope.
+struct PlaneOptics {
+    double beta, alpha, psi, eta, etap;
+};
+
+// One row of the MODEL_PV twiss table.
+struct ElementOptics {
+    std::string name;
+    // reference momentum (eV), or 0 if the model doesn't give it
+    double p0c;
+    PlaneOptics x, y;
+};
+
+// The trajectory and energy fitted at each fit point for one pulse, from
+// OrbitFit::fit().  Entries are NaN where there was nothing to fit.
+struct OrbitFitResult {
+    epicsTimeStamp ts;
+    // position (mm) and angle (mrad) in each plane at the fit point
+    std::vector<double> x, xp, y, yp;
+    // relative energy offset, NaN if there is no dispersion to fit it from
+    std::vector<double> delta;
+    // rms of the fit residuals, mm
+    std::vector<double> rms;
+    // X and Y readings which went into the fit
+    std::vector<epicsUInt32> readings;
+};
+
+// Fits each pulse's orbit, at each of a set of fit points (BPMs), to a
+// launch position and angle in each plane and a relative energy offset,
+// using the model's transfer from the fit point to it and the next few
+// BPMs.  The least squares solution is worked out when the model or BPMs
+// change, so a pulse with every reading valid costs a matrix-vector
+// product; a pulse with readings missing solves its own normal equations.
+// Not thread safe.
+class OrbitFit {
+public:
+    // Set up for orbits of the BPMs 'bpm_names', fitting at each of 'points'
+    // from it and the next bpms_per_fit-1 BPMs.  Fit points without optics
+    // in 'model', or too few BPMs after them, always come out NaN.
+    void build(const std::vector<std::string>& bpm_names, const std::vector<ElementOptics>& model,
+               const std::vector<std::string>& points, size_t bpms_per_fit);
+    const std::vector<std::string>& points() const { return point_names; }
+    void fit(const OrbitData& orbit, OrbitFitResult& out) const;
+private:
+    // The X reading of the k'th BPM from 'first' is the sum over parameters
+    // p of model_x[p*count + k] times (x, x', y, y', delta)[p], and likewise
+    // for Y.  From a full set of readings, parameter p is the sum over k of
+    // fit_x[p*count + k]*X[k] + fit_y[p*count + k]*Y[k].
+    struct Segment {
+        size_t first, count;
+        // parameters fitted: 5, 4 if there is no dispersion to fit the
+        // energy from, or 0 if the segment can't be fitted at all
+        size_t params;
+        // 1 for each BPM the model has optics for; the others' readings
+        // are left out of the fit, its residuals and its count
+        std::vector<unsigned char> modelled;
+        size_t num_modelled;
+        std::vector<double> model_x, model_y;
+        std::vector<double> fit_x, fit_y;
+    };
+    // Fit from the valid readings only, returning the parameters fitted.
+    size_t fit_partial(const Segment& s, const OrbitData& orbit, double* p, double& rms, size_t& readings) const;
+    std::vector<std::string> point_names;
+    std::vector<Segment> segments;
+    size_t num_bpms;
+};
+
+#endif //ORBIT_FIT_H
@@ -0,0 +1,438 @@
+#include "orbit_mia.h"
+#include <cmath>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <algorithm>
+
+// The Gram matrix, a times its transpose, is the expensive part: BPMs^2 x
+// pulses multiply-adds, against BPMs^2 x modes for each pass of the subspace
+// iteration which finds the modes from it.  It is worked out in tiles of
+// BLOCK_BPMS x BLOCK_BPMS, and BLOCK_PULSES at a time, so the two sets of
+// readings a tile needs stay in cache; the tiles are shared out between
+// threads.
+static const size_t BLOCK_BPMS = 64u;
+static const size_t BLOCK_PULSES = 512u;
+// Most passes of the subspace iteration, and when to stop: each mode's
+// residual |G q - lambda q| below this fraction of the largest eigenvalue.
+static const size_t MAX_ITERATIONS = 200u;
+static const double TOLERANCE = 1e-6;
+static const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+MIAWorkers::MIAWorkers(size_t threads) :
+job(nullptr),
+count(0u),
+next(0u),
+steps(0u),
+busy(0u),
+stopping(false)
+{
+    for (size_t t=1; t<threads; t++) {
+        helpers.push_back(std::thread(&MIAWorkers::work, this));
+    }
+}
+
+MIAWorkers::~MIAWorkers() {
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (size_t t=0; t<helpers.size(); t++) {
+        helpers[t].join();
+    }
+}
+
+void MIAWorkers::run(size_t n, const std::function<void(size_t)>& f) {
+    if (helpers.empty() || n < 2u) {
+        for (size_t k=0; k<n; k++) {
+            f(k);
+        }
+        return;
+    }
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        job = &f;
+        count = n;
+        next = 0u;
+        busy = helpers.size();
+        steps++;
+    }
+    start.notify_all();
+    take();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return busy == 0u; });
+    job = nullptr;
+}
+
+void MIAWorkers::work() {
+    size_t seen = 0u;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        start.wait(lock, [&]() { return stopping || steps != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = steps;
+        lock.unlock();
+        take();
+        lock.lock();
+        if (--busy == 0u) {
+            done.notify_one();
+        }
+    }
+}
+
+// Items of the current step, until there are none left.
+void MIAWorkers::take() {
+    for (size_t k = next++; k < count; k = next++) {
+        (*job)(k);
+    }
+}
+
+// Four running sums rather than one, so the adds don't wait on each other
+// and the compiler can pair them up into vector operations.
+static double dot(const double* __restrict__ x, const double* __restrict__ y, size_t n) {
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    size_t p = 0;
+    for (; p + 4u <= n; p += 4u) {
+        s0 += x[p]*y[p];
+        s1 += x[p + 1u]*y[p + 1u];
+        s2 += x[p + 2u]*y[p + 2u];
+        s3 += x[p + 3u]*y[p + 3u];
+    }
+    for (; p<n; p++) {
+        s0 += x[p]*y[p];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+static void axpy(size_t n, double alpha, const double* __restrict__ x, double* __restrict__ y) {
+    for (size_t p=0; p<n; p++) {
+        y[p] += alpha*x[p];
+    }
+}
+
+// The upper triangle of one tile of the Gram matrix g (n x n) of a (n rows
+// of p readings).
+static void gram_tile(const double* a, size_t n, size_t p, size_t i0, size_t j0, double* g) {
+    const size_t i1 = std::min(i0 + BLOCK_BPMS, n), j1 = std::min(j0 + BLOCK_BPMS, n);
+    for (size_t i=i0; i<i1; i++) {
+        std::fill(g + i*n + std::max(i, j0), g + i*n + j1, 0.0);
+    }
+    for (size_t p0=0; p0<p; p0+=BLOCK_PULSES) {
+        const size_t np = std::min(BLOCK_PULSES, p - p0);
+        for (size_t i=i0; i<i1; i++) {
+            const double* ai = a + i*p + p0;
+            double* gi = g + i*n;
+            for (size_t j=std::max(i, j0); j<j1; j++) {
+                gi[j] += dot(ai, a + j*p + p0, np);
+            }
+        }
+    }
+}
+
+// Eigenvalues and vectors of the symmetric k x k matrix h, by cyclic Jacobi
+// rotations: on return h's diagonal holds the eigenvalues, and the columns
+// of v the vectors.  Only used on the small Rayleigh-Ritz matrix.
+static void jacobi(std::vector<double>& h, std::vector<double>& v, size_t k) {
+    v.assign(k*k, 0.0);
+    for (size_t i=0; i<k; i++) {
+        v[i*k + i] = 1.0;
+    }
+    for (size_t sweep=0; sweep<100u; sweep++) {
+        double off = 0.0, diag = 0.0;
+        for (size_t i=0; i<k; i++) {
+            diag += h[i*k + i]*h[i*k + i];
+            for (size_t j=i+1; j<k; j++) {
+                off += h[i*k + j]*h[i*k + j];
+            }
+        }
+        if (off <= 1e-30*diag || off == 0.0) {
+            return;
+        }
+        for (size_t p=0; p<k; p++) {
+            for (size_t q=p+1; q<k; q++) {
+                const double hpq = h[p*k + q];
+                if (hpq == 0.0) {
+                    continue;
+                }
+                const double theta = (h[q*k + q] - h[p*k + p])/(2.0*hpq);
+                const double t = (theta >= 0.0 ? 1.0 : -1.0)/(std::fabs(theta) + std::sqrt(theta*theta + 1.0));
+                const double c = 1.0/std::sqrt(t*t + 1.0), s = t*c;
+                for (size_t r=0; r<k; r++) {
+                    const double hrp = h[r*k + p], hrq = h[r*k + q];
+                    h[r*k + p] = c*hrp - s*hrq;
+                    h[r*k + q] = s*hrp + c*hrq;
+                }
+                for (size_t r=0; r<k; r++) {
+                    const double hpr = h[p*k + r], hqr = h[q*k + r];
+                    h[p*k + r] = c*hpr - s*hqr;
+                    h[q*k + r] = s*hpr + c*hqr;
+                }
+                for (size_t r=0; r<k; r++) {
+                    const double vrp = v[r*k + p], vrq = v[r*k + q];
+                    v[r*k + p] = c*vrp - s*vrq;
+                    v[r*k + q] = s*vrp + c*vrq;
+                }
+            }
+        }
+    }
+}
+
+// Make the k rows of q (n long) orthonormal, by modified Gram-Schmidt.  A
+// row which turns out to lie in the span of the ones before is replaced by
+// a random one.
+static void orthonormalize(std::vector<double>& q, size_t k, size_t n, std::mt19937& rng) {
+    std::normal_distribution<double> normal(0.0, 1.0);
+    for (size_t m=0; m<k; m++) {
+        double* qm = &q[m*n];
+        for (size_t attempt=0; attempt<4u; attempt++) {
+            const double before = std::sqrt(dot(qm, qm, n));
+            for (size_t l=0; l<m; l++) {
+                axpy(n, -dot(&q[l*n], qm, n), &q[l*n], qm);
+            }
+            const double norm = std::sqrt(dot(qm, qm, n));
+            if (norm > 1e-10*before && norm > 0.0) {
+                for (size_t i=0; i<n; i++) {
+                    qm[i] /= norm;
+                }
+                break;
+            }
+            for (size_t i=0; i<n; i++) {
+                qm[i] = normal(rng);
+            }
+        }
+    }
+}
+
+OrbitMIA::OrbitMIA(size_t window, size_t modes, size_t threads) :
+length(std::max(window, size_t(2u))),
+num_modes(std::max(modes, size_t(1u))),
+num_threads(std::max(threads, size_t(1u))),
+num_bpms(0u),
+head(0u),
+pulses(0u),
+stamps(length),
+snap_pulses(0u),
+snap_bpms(0u),
+workers(num_threads)
+{
+    work[0].q_bpms = work[1].q_bpms = 0u;
+}
+
+void OrbitMIA::add(const OrbitData& orbit) {
+    if (orbit.size() != num_bpms || rows[0].empty()) {
+        num_bpms = orbit.size();
+        head = 0u;
+        pulses = 0u;
+        rows[0].assign(length*num_bpms, NaN);
+        rows[1].assign(length*num_bpms, NaN);
+    }
+    const size_t N = num_bpms;
+    for (size_t j=0; j<2u; j++) {
+        const double* x = orbit.value[j].data();
+        const epicsUInt16* severity = orbit.severity[j].data();
+        double* row = &rows[j][head*N];
+        for (size_t i=0; i<N; i++) {
+            const double xi = x[i];
+            const bool ok = (severity[i] < INVALID_ALARM) & (xi - xi == 0.0);
+            row[i] = ok ? xi : NaN;
+        }
+    }
+    stamps[head] = orbit.ts;
+    head = (head + 1u) % length;
+    pulses = std::min(pulses + 1u, length);
+}
+
+void OrbitMIA::clear() {
+    head = 0u;
+    pulses = 0u;
+}
+
+bool OrbitMIA::snapshot() {
+    if (pulses < 2u || num_bpms == 0u) {
+        return false;
+    }
+    const size_t N = num_bpms, P = pulses, first = (head + length - pulses) % length;
+    snap_pulses = P;
+    snap_bpms = N;
+    snap_stamps.resize(P);
+    for (size_t r=0; r<P; r++) {
+        snap_stamps[r] = stamps[(first + r) % length];
+    }
+    // Turn the rows of pulses into rows of BPMs, a block of pulses at a time
+    // so the writes stay in cache.
+    for (size_t j=0; j<2u; j++) {
+        std::vector<double>& a = work[j].a;
+        a.resize(N*P);
+        for (size_t r0=0; r0<P; r0+=BLOCK_BPMS) {
+            const size_t r1 = std::min(r0 + BLOCK_BPMS, P);
+            for (size_t r=r0; r<r1; r++) {
+                const double* row = &rows[j][((first + r) % length)*N];
+                for (size_t i=0; i<N; i++) {
+                    a[i*P + r] = row[i];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void OrbitMIA::analyse(MIAResult& out) {
+    const size_t P = snap_pulses, N = snap_bpms;
+    out.pulses = P;
+    out.bpms = N;
+    out.modes = std::min(num_modes, std::min(N, P));
+    out.seconds.resize(P);
+    out.nanoseconds.resize(P);
+    for (size_t r=0; r<P; r++) {
+        out.seconds[r] = snap_stamps[r].secPastEpoch;
+        out.nanoseconds[r] = snap_stamps[r].nsec;
+    }
+    if (P > 0u) {
+        out.ts = snap_stamps[P - 1u];
+    }
+    for (size_t j=0; j<2u; j++) {
+        analyse_plane(work[j], out.planes[j]);
+    }
+}
+
+void OrbitMIA::analyse_plane(Work& w, MIAPlane& out) {
+    const size_t P = snap_pulses, N = snap_bpms, K = std::min(num_modes, std::min(N, P));
+    double* a = w.a.data();
+    // Take each BPM about its mean, with missing readings at the mean.
+    for (size_t i=0; i<N; i++) {
+        double* ai = a + i*P;
+        double sum = 0.0, count = 0.0;
+        for (size_t r=0; r<P; r++) {
+            const double x = ai[r];
+            const bool ok = x == x;
+            sum += ok ? x : 0.0;
+            count += ok ? 1.0 : 0.0;
+        }
+        const double mean = count > 0.0 ? sum/count : 0.0;
+        for (size_t r=0; r<P; r++) {
+            const double x = ai[r];
+            ai[r] = x == x ? x - mean : 0.0;
+        }
+    }
+
+    // The Gram matrix, tile by tile, then mirrored.
+    w.gram.resize(N*N);
+    double* g = w.gram.data();
+    const size_t tiles = (N + BLOCK_BPMS - 1u)/BLOCK_BPMS;
+    std::vector<std::pair<size_t, size_t>> pairs;
+    for (size_t bi=0; bi<tiles; bi++) {
+        for (size_t bj=bi; bj<tiles; bj++) {
+            pairs.push_back(std::make_pair(bi*BLOCK_BPMS, bj*BLOCK_BPMS));
+        }
+    }
+    workers.run(pairs.size(), [&](size_t t) {
+        gram_tile(a, N, P, pairs[t].first, pairs[t].second, g);
+    });
+    for (size_t i=0; i<N; i++) {
+        for (size_t j=0; j<i; j++) {
+            g[i*N + j] = g[j*N + i];
+        }
+    }
+
+    out.correlation.resize(N*N);
+    for (size_t i=0; i<N; i++) {
+        for (size_t j=0; j<N; j++) {
+            const double d = std::sqrt(g[i*N + i]*g[j*N + j]);
+            out.correlation[i*N + j] = d > 0.0 ? g[i*N + j]/d : NaN;
+        }
+    }
+
+    // Subspace iteration for the K largest eigenvectors of g, which are the
+    // spatial modes, starting from the last analysis's if the BPMs haven't
+    // changed.  Each pass multiplies the basis q by g, then takes the
+    // Rayleigh-Ritz vectors of the result.
+    std::mt19937 rng(1u);
+    if (w.q_bpms != N || w.q.size() != K*N) {
+        std::normal_distribution<double> normal(0.0, 1.0);
+        w.q.resize(K*N);
+        for (size_t i=0; i<K*N; i++) {
+            w.q[i] = normal(rng);
+        }
+        orthonormalize(w.q, K, N, rng);
+        w.q_bpms = N;
+    }
+    w.z.resize(K*N);
+    std::vector<double> h(K*K), v, lambda(K), rotated(K*N), rotated_z(K*N);
+    std::vector<size_t> order(K);
+    const size_t row_blocks = (N + BLOCK_BPMS - 1u)/BLOCK_BPMS;
+    for (size_t iteration=0; ; iteration++) {
+        workers.run(row_blocks, [&](size_t b) {
+            for (size_t i=b*BLOCK_BPMS, I=std::min(i + BLOCK_BPMS, N); i<I; i++) {
+                for (size_t m=0; m<K; m++) {
+                    w.z[m*N + i] = dot(g + i*N, &w.q[m*N], N);
+                }
+            }
+        });
+        for (size_t l=0; l<K; l++) {
+            for (size_t m=0; m<K; m++) {
+                h[l*K + m] = 0.5*(dot(&w.q[l*N], &w.z[m*N], N) + dot(&w.q[m*N], &w.z[l*N], N));
+            }
+        }
+        jacobi(h, v, K);
+        for (size_t m=0; m<K; m++) {
+            order[m] = m;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t l, size_t m) { return h[l*K + l] > h[m*K + m]; });
+        std::fill(rotated.begin(), rotated.end(), 0.0);
+        std::fill(rotated_z.begin(), rotated_z.end(), 0.0);
+        for (size_t m=0; m<K; m++) {
+            const size_t col = order[m];
+            lambda[m] = h[col*K + col];
+            for (size_t l=0; l<K; l++) {
+                axpy(N, v[l*K + col], &w.q[l*N], &rotated[m*N]);
+                axpy(N, v[l*K + col], &w.z[l*N], &rotated_z[m*N]);
+            }
+        }
+        w.q.swap(rotated);
+        w.z.swap(rotated_z);
+        double worst = 0.0;
+        for (size_t m=0; m<K; m++) {
+            double r2 = 0.0;
+            for (size_t i=0; i<N; i++) {
+                const double r = w.z[m*N + i] - lambda[m]*w.q[m*N + i];
+                r2 += r*r;
+            }
+            worst = std::max(worst, std::sqrt(r2));
+        }
+        if (!(worst > TOLERANCE*lambda[0]) || iteration + 1u >= MAX_ITERATIONS) {
+            break;
+        }
+        w.q.swap(w.z);
+        orthonormalize(w.q, K, N, rng);
+    }
+
+    out.singular_values.resize(K);
+    out.spatial.resize(K*N);
+    out.temporal.assign(K*P, 0.0);
+    for (size_t m=0; m<K; m++) {
+        const double sigma = std::sqrt(std::max(lambda[m], 0.0));
+        out.singular_values[m] = sigma;
+        // Signs are arbitrary: make the biggest entry positive, so a mode
+        // doesn't flip from one update to the next.
+        const double* qm = &w.q[m*N];
+        size_t biggest = 0u;
+        for (size_t i=1; i<N; i++) {
+            biggest = std::fabs(qm[i]) > std::fabs(qm[biggest]) ? i : biggest;
+        }
+        const double sign = qm[biggest] < 0.0 ? -1.0 : 1.0;
+        double* spatial = &out.spatial[m*N];
+        for (size_t i=0; i<N; i++) {
+            spatial[i] = sign*qm[i];
+        }
+        if (sigma > 0.0) {
+            double* temporal = &out.temporal[m*P];
+            for (size_t i=0; i<N; i++) {
+                axpy(P, spatial[i]/sigma, a + i*P, temporal);
+            }
+        }
+    }
+}
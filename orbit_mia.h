@@ -0,0 +1,122 @@
+#ifndef ORBIT_MIA_H
+#define ORBIT_MIA_H
+
+#include <vector>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include "orbit.h"
+
+// Model-independent analysis of one plane (X or Y) over a window of
+// pulses, from OrbitMIA::analyse().  Matrices are row-major.  A BPM with no
+// valid samples gets a correlation of NaN, and zeros in the modes.
+struct MIAPlane {
+    // largest first
+    std::vector<double> singular_values;
+    // modes x BPMs: the BPM pattern of each mode, with unit length
+    std::vector<double> spatial;
+    // modes x pulses: how much of each mode each pulse has, with unit length
+    std::vector<double> temporal;
+    // BPMs x BPMs
+    std::vector<double> correlation;
+};
+
+struct MIAResult {
+    // timestamp of the newest pulse
+    epicsTimeStamp ts;
+    size_t pulses;
+    size_t bpms;
+    size_t modes;
+    // per pulse, oldest first
+    std::vector<epicsUInt32> seconds;
+    std::vector<epicsUInt32> nanoseconds;
+    // X and Y
+    std::array<MIAPlane, 2> planes;
+};
+
+// 'threads'-1 helper threads, kept for the life of an OrbitMIA, which
+// share out each step of an analysis with the thread running it.  An
+// analysis has a step for every pass of the subspace iteration, too many to
+// start threads for each.
+class MIAWorkers {
+public:
+    explicit MIAWorkers(size_t threads);
+    ~MIAWorkers();
+    // Run f(0) to f(count - 1) on the helpers and this thread.
+    void run(size_t count, const std::function<void(size_t)>& f);
+private:
+    void work();
+    void take();
+    std::mutex mutex;
+    std::condition_variable start, done;
+    // the step being run, and the next item of it to take
+    const std::function<void(size_t)>* job;
+    size_t count;
+    std::atomic<size_t> next;
+    // steps started, and helpers still on the current one
+    size_t steps;
+    size_t busy;
+    bool stopping;
+    std::vector<std::thread> helpers;
+    MIAWorkers(const MIAWorkers&);
+    MIAWorkers& operator=(const MIAWorkers&);
+};
+
+// Keeps the X and Y readings of the last 'window' orbits, and works out
+// from them the BPM correlation matrix and the leading 'modes' singular
+// modes of each plane.  Each BPM's readings are taken about its mean over
+// the window.  Readings with a severity of INVALID or worse are left out,
+// which counts them as being at the mean.
+//
+// add() is cheap, just copying the orbit in.  snapshot() copies the buffer
+// out for analyse(), which does the work, on 'threads' threads.  add() and
+// snapshot() must not run at the same time.  analyse() can run alongside
+// add(), but not snapshot(), which rewrites the copy analyse() works on.
+class OrbitMIA {
+public:
+    OrbitMIA(size_t window, size_t modes, size_t threads);
+    size_t window() const { return length; }
+    // Add one orbit, dropping the oldest once the window is full.  Orbits
+    // of another size start the buffer again.
+    void add(const OrbitData& orbit);
+    // Empty the buffer, as when the BPMs change.
+    void clear();
+    // Take a copy of the orbits buffered so far for analyse().  Returns
+    // false if there are too few to analyse.
+    bool snapshot();
+    void analyse(MIAResult& out);
+private:
+    // one plane of a snapshot, and its modes from the last analysis, which
+    // start the next one off
+    struct Work {
+        // BPMs x pulses: each BPM's readings, contiguous
+        std::vector<double> a;
+        // BPMs x BPMs: a times its transpose
+        std::vector<double> gram;
+        // modes x BPMs
+        std::vector<double> q, z;
+        size_t q_bpms;
+    };
+    void analyse_plane(Work& w, MIAPlane& out);
+    const size_t length;
+    const size_t num_modes;
+    const size_t num_threads;
+    size_t num_bpms;
+    // where the next orbit goes, and how many the buffer holds
+    size_t head, pulses;
+    // 'length' rows of num_bpms per plane, NaN for readings left out
+    std::array<std::vector<double>, 2> rows;
+    std::vector<epicsTimeStamp> stamps;
+    // the snapshot
+    size_t snap_pulses, snap_bpms;
+    std::vector<epicsTimeStamp> snap_stamps;
+    std::array<Work, 2> work;
+    MIAWorkers workers;
+};
+
+#endif //ORBIT_MIA_H
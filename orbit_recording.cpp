@@ -0,0 +1,307 @@
+#include "orbit_recording.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <algorithm>
+
+static const char recordingMagic[8] = {'O', 'R', 'B', 'I', 'T', 'R', 'E', 'C'};
+static const epicsUInt32 recordingVersion = 1u;
+// target size of a segment, and what file offsets are rounded to so that
+// any segment can be mapped on its own, whatever the page size
+static size_t segmentBytes = 64u << 20;
+static size_t mapAlignment = 64u << 10;
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1u) / to * to;
+}
+
+static std::runtime_error file_error(const std::string& path, const char* what, int err) {
+    return std::runtime_error(path + ": " + what + ": " + strerror(err));
+}
+
+OrbitRecordingWriter::OrbitRecordingWriter(const std::string& path, const std::vector<std::string>& names, const std::vector<double>& zs) :
+fd(-1),
+header(0),
+num_bpms(names.size()),
+count(0u),
+skipped(0u),
+segment(0),
+segment_number(0u)
+{
+    size_t names_size = 0u;
+    for (size_t i=0; i<num_bpms; i++) {
+        names_size += names[i].size() + 1u;
+    }
+    const size_t header_size = round_up(sizeof(RecordingHeader) + num_bpms*sizeof(double) + names_size, mapAlignment);
+    const size_t columns = NUM_AXES*num_bpms;
+    const size_t record_size = round_up(sizeof(RecordHeader) + columns*(sizeof(double) + 2u*sizeof(epicsUInt16)), 8u);
+    const size_t per_segment = std::max(size_t(1u), segmentBytes/(record_size + sizeof(epicsUInt64)));
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        throw file_error(path, "open", errno);
+    }
+    const int err = posix_fallocate(fd, 0, header_size);
+    if (err != 0) {
+        ::close(fd);
+        throw file_error(path, "allocate", err);
+    }
+    void* mem = mmap(NULL, header_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        const int err = errno;
+        ::close(fd);
+        throw file_error(path, "mmap", err);
+    }
+    header = static_cast<RecordingHeader*>(mem);
+    memcpy(header->magic, recordingMagic, sizeof(recordingMagic));
+    header->version = recordingVersion;
+    header->num_bpms = epicsUInt32(num_bpms);
+    header->header_size = header_size;
+    header->index_size = per_segment*sizeof(epicsUInt64);
+    header->record_size = record_size;
+    header->records_per_segment = per_segment;
+    header->segment_size = round_up(header->index_size + per_segment*record_size, mapAlignment);
+    header->count = 0u;
+    char* p = reinterpret_cast<char*>(header + 1);
+    if (num_bpms > 0u) {
+        memcpy(p, zs.data(), num_bpms*sizeof(double));
+    }
+    p += num_bpms*sizeof(double);
+    for (size_t i=0; i<num_bpms; i++) {
+        memcpy(p, names[i].c_str(), names[i].size() + 1u);
+        p += names[i].size() + 1u;
+    }
+}
+
+OrbitRecordingWriter::~OrbitRecordingWriter() {
+    if (segment) {
+        munmap(segment, header->segment_size);
+    }
+    if (header) {
+        munmap(header, header->header_size);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+// Grow the file by segment 's', and map it in place of the last one.
+void OrbitRecordingWriter::map_segment(size_t s) {
+    const size_t size = header->segment_size;
+    const off_t offset = off_t(header->header_size + s*size);
+    const int err = posix_fallocate(fd, offset, size);
+    if (err != 0) {
+        throw std::runtime_error(std::string("allocate segment: ") + strerror(err));
+    }
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error(std::string("mmap segment: ") + strerror(errno));
+    }
+    if (segment) {
+        munmap(segment, size);
+    }
+    segment = static_cast<char*>(mem);
+    segment_number = s;
+}
+
+bool OrbitRecordingWriter::append(const OrbitData& orbit) {
+    if (orbit.size() != num_bpms) {
+        skipped++;
+        return false;
+    }
+    const size_t s = count / header->records_per_segment, r = count % header->records_per_segment;
+    if (!segment || s != segment_number) {
+        map_segment(s);
+    }
+    reinterpret_cast<epicsUInt64*>(segment)[r] = epicsUInt64(orbit.ts.secPastEpoch) << 32 | orbit.ts.nsec;
+    char* rec = segment + header->index_size + r*header->record_size;
+    RecordHeader* rh = reinterpret_cast<RecordHeader*>(rec);
+    rh->secPastEpoch = orbit.ts.secPastEpoch;
+    rh->nsec = orbit.ts.nsec;
+    rh->flags = orbit.complete ? RECORD_COMPLETE : 0u;
+    rh->reserved = 0u;
+    double* values = reinterpret_cast<double*>(rh + 1);
+    epicsUInt16* severities = reinterpret_cast<epicsUInt16*>(values + NUM_AXES*num_bpms);
+    epicsUInt16* statuses = severities + NUM_AXES*num_bpms;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        std::copy(orbit.value[j].begin(), orbit.value[j].end(), values + j*num_bpms);
+        std::copy(orbit.severity[j].begin(), orbit.severity[j].end(), severities + j*num_bpms);
+        std::copy(orbit.status[j].begin(), orbit.status[j].end(), statuses + j*num_bpms);
+    }
+    header->count = ++count;
+    return true;
+}
+
+OrbitRecordingReader::OrbitRecordingReader(const std::string& path) :
+fd(-1),
+base(0),
+length(0u),
+header(0),
+count(0u)
+{
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw file_error(path, "open", errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        const int err = errno;
+        ::close(fd);
+        throw file_error(path, "stat", err);
+    }
+    length = size_t(st.st_size);
+    if (length < sizeof(RecordingHeader)) {
+        ::close(fd);
+        throw std::runtime_error(path + ": not an orbit recording");
+    }
+    void* mem = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        const int err = errno;
+        ::close(fd);
+        throw file_error(path, "mmap", err);
+    }
+    base = static_cast<const char*>(mem);
+    header = reinterpret_cast<const RecordingHeader*>(base);
+    if (memcmp(header->magic, recordingMagic, sizeof(recordingMagic)) != 0 || header->version != recordingVersion || header->header_size > length || header->segment_size == 0u || header->records_per_segment == 0u) {
+        munmap(const_cast<char*>(base), length);
+        ::close(fd);
+        throw std::runtime_error(path + ": not an orbit recording");
+    }
+    // Only trust records which are wholly in the file.
+    const size_t segments = (length - header->header_size) / header->segment_size;
+    count = std::min(size_t(header->count), segments*header->records_per_segment);
+    const double* z = reinterpret_cast<const double*>(header + 1);
+    bpm_zs.assign(z, z + header->num_bpms);
+    const char* name = reinterpret_cast<const char*>(z + header->num_bpms);
+    for (size_t i=0; i<header->num_bpms; i++) {
+        bpm_names.push_back(name);
+        name += bpm_names.back().size() + 1u;
+    }
+}
+
+OrbitRecordingReader::~OrbitRecordingReader() {
+    munmap(const_cast<char*>(base), length);
+    ::close(fd);
+}
+
+const char* OrbitRecordingReader::record(size_t i) const {
+    const size_t s = i / header->records_per_segment, r = i % header->records_per_segment;
+    return base + header->header_size + s*header->segment_size + header->index_size + r*header->record_size;
+}
+
+epicsUInt64 OrbitRecordingReader::key(size_t i) const {
+    const size_t s = i / header->records_per_segment, r = i % header->records_per_segment;
+    return reinterpret_cast<const epicsUInt64*>(base + header->header_size + s*header->segment_size)[r];
+}
+
+epicsTimeStamp OrbitRecordingReader::timestamp(size_t i) const {
+    const RecordHeader* rh = reinterpret_cast<const RecordHeader*>(record(i));
+    epicsTimeStamp ts;
+    ts.secPastEpoch = rh->secPastEpoch;
+    ts.nsec = rh->nsec;
+    return ts;
+}
+
+bool OrbitRecordingReader::complete(size_t i) const {
+    return reinterpret_cast<const RecordHeader*>(record(i))->flags & RECORD_COMPLETE;
+}
+
+const double* OrbitRecordingReader::values(size_t i) const {
+    return reinterpret_cast<const double*>(record(i) + sizeof(RecordHeader));
+}
+
+const epicsUInt16* OrbitRecordingReader::severities(size_t i) const {
+    return reinterpret_cast<const epicsUInt16*>(values(i) + NUM_AXES*header->num_bpms);
+}
+
+const epicsUInt16* OrbitRecordingReader::statuses(size_t i) const {
+    return severities(i) + NUM_AXES*header->num_bpms;
+}
+
+size_t OrbitRecordingReader::find(epicsUInt64 k) const {
+    size_t lo = 0u, hi = count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo)/2u;
+        if (key(mid) < k) {
+            lo = mid + 1u;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+OrbitRecorder::OrbitRecorder(Orbit& orbit, const std::string& path, QueuePolicy policy) :
+orbit(orbit),
+path(path),
+policy(policy),
+failed(false),
+files(0u)
+{
+    orbit.add_receiver(this);
+}
+
+OrbitRecorder::~OrbitRecorder() {
+    close();
+}
+
+void OrbitRecorder::close() {
+    orbit.remove_receiver(this);
+    finish();
+}
+
+// Close the file, saying how many orbits didn't fit it.
+void OrbitRecorder::finish() {
+    if (writer && writer->mismatched() > 0u) {
+        printf("%zu orbits of the wrong size were not recorded\n", writer->mismatched());
+    }
+    writer.reset();
+}
+
+// Deeper than the PVA receivers' queues, since a segment being allocated
+// can hold up a write.
+ReceiverOptions OrbitRecorder::options() const {
+    return ReceiverOptions(256u, policy);
+}
+
+// A recording has one list of BPMs, so a reload starts the next file.
+void OrbitRecorder::setNames(const std::vector<std::string>& n) {
+    if (writer && n != names) {
+        finish();
+        files++;
+    }
+    names = n;
+}
+
+void OrbitRecorder::setZs(const std::vector<double>& z) {
+    zs = z;
+}
+
+void OrbitRecorder::setCompletedOrbit(const OrbitData& o) {
+    if (failed) {
+        return;
+    }
+    try {
+        if (!writer) {
+            // Never overwrite an earlier recording: take the next free name.
+            std::string file(files == 0u ? path : path + "." + std::to_string(files));
+            while (::access(file.c_str(), F_OK) == 0) {
+                file = path + "." + std::to_string(++files);
+            }
+            writer.reset(new OrbitRecordingWriter(file, names, zs));
+            printf("Recording orbits to %s\n", file.c_str());
+        }
+        if (!writer->append(o) && writer->mismatched() == 1u) {
+            printf("Not recording orbits of %zu BPMs to a recording of %zu\n", o.size(), names.size());
+        }
+    } catch (std::exception& err) {
+        printf("Stopped recording orbits to %s: %s\n", path.c_str(), err.what());
+        writer.reset();
+        failed = true;
+    }
+}
@@ -0,0 +1,130 @@
+#ifndef ORBIT_RECORDING_H
+#define ORBIT_RECORDING_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include "orbit.h"
+
+// On-disk layout of an orbit recording.  A header (padded to a page) gives
+// the geometry and the BPMs, then come fixed-size segments, each grown into
+// the file and mapped whole.  A segment starts with the index, the key
+// (seconds << 32 | nsec) of each of its records, followed by the records.
+// A record is the pulse's timestamp and flags, then the values, severities
+// and statuses, each stored as X, Y and TMIT columns of num_bpms entries.
+// Records are fixed size and in timestamp order, so record i and the
+// first record after a given time are found without scanning.
+struct RecordingHeader {
+    char magic[8];
+    epicsUInt32 version;
+    epicsUInt32 num_bpms;
+    epicsUInt64 header_size;
+    epicsUInt64 segment_size;
+    epicsUInt64 index_size;
+    epicsUInt64 record_size;
+    epicsUInt64 records_per_segment;
+    // records written; the writer bumps this after each record
+    epicsUInt64 count;
+    // followed by num_bpms z positions (double), then num_bpms names, each
+    // NUL terminated
+};
+
+struct RecordHeader {
+    epicsUInt32 secPastEpoch;
+    epicsUInt32 nsec;
+    // RECORD_COMPLETE if every connected channel reported
+    epicsUInt32 flags;
+    epicsUInt32 reserved;
+};
+
+static const epicsUInt32 RECORD_COMPLETE = 1u;
+
+// Appends orbits to a recording.
+class OrbitRecordingWriter {
+public:
+    // Throws std::runtime_error if the file can't be created, or already
+    // exists.
+    OrbitRecordingWriter(const std::string& path, const std::vector<std::string>& names, const std::vector<double>& zs);
+    ~OrbitRecordingWriter();
+    // False, and the orbit counted in mismatched(), if it doesn't have
+    // the recording's number of BPMs.
+    bool append(const OrbitData& orbit);
+    size_t size() const { return count; }
+    size_t mismatched() const { return skipped; }
+private:
+    void map_segment(size_t segment);
+    int fd;
+    RecordingHeader* header;
+    size_t num_bpms;
+    size_t count;
+    size_t skipped;
+    // the segment being filled, and which one it is
+    char* segment;
+    size_t segment_number;
+    OrbitRecordingWriter(const OrbitRecordingWriter&);
+    OrbitRecordingWriter& operator=(const OrbitRecordingWriter&);
+};
+
+// Reads a recording, mapping the whole file.  Sees the records written as
+// of when it was opened.
+class OrbitRecordingReader {
+public:
+    // Throws std::runtime_error if the file can't be read or isn't a recording.
+    explicit OrbitRecordingReader(const std::string& path);
+    ~OrbitRecordingReader();
+    size_t size() const { return count; }
+    const std::vector<std::string>& names() const { return bpm_names; }
+    const std::vector<double>& zs() const { return bpm_zs; }
+    epicsUInt64 key(size_t i) const;
+    epicsTimeStamp timestamp(size_t i) const;
+    bool complete(size_t i) const;
+    // X, Y then TMIT columns of num_bpms entries, for record i
+    const double* values(size_t i) const;
+    const epicsUInt16* severities(size_t i) const;
+    const epicsUInt16* statuses(size_t i) const;
+    // First record at or after 'key', or size() if there is none.  A
+    // binary search of the index.
+    size_t find(epicsUInt64 key) const;
+private:
+    const char* record(size_t i) const;
+    int fd;
+    const char* base;
+    size_t length;
+    const RecordingHeader* header;
+    size_t count;
+    std::vector<std::string> bpm_names;
+    std::vector<double> bpm_zs;
+    OrbitRecordingReader(const OrbitRecordingReader&);
+    OrbitRecordingReader& operator=(const OrbitRecordingReader&);
+};
+
+// Records every orbit it receives.  The file is created when the first
+// orbit arrives; if that fails, recording is switched off with a message.
+// When the orbit's BPMs are reloaded, recording carries on in PATH.1,
+// then PATH.2 and so on.  An existing file is never overwritten: names
+// already taken, say by an earlier run, are skipped.
+struct OrbitRecorder : public Receiver
+{
+    OrbitRecorder(Orbit& orbit, const std::string& path, QueuePolicy policy = QUEUE_DROP_OLDEST);
+    virtual ~OrbitRecorder();
+    Orbit& orbit;
+    const std::string path;
+    const QueuePolicy policy;
+    void close();
+    virtual ReceiverOptions options() const;
+    virtual void setNames(const std::vector<std::string>& n);
+    virtual void setZs(const std::vector<double>& zs);
+    virtual void setCompletedOrbit(const OrbitData& o);
+private:
+    void finish();
+    std::vector<std::string> names;
+    std::vector<double> zs;
+    std::unique_ptr<OrbitRecordingWriter> writer;
+    bool failed;
+    // files finished because the BPMs changed
+    size_t files;
+};
+
+#endif //ORBIT_RECORDING_H
@@ -0,0 +1,257 @@
+#include "orbit_statistics.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+// The kernels below are kept simple enough for the compiler to vectorize:
+// one pass over contiguous columns, every load unconditional, and selects
+// rather than branches (so '&' rather than '&&').  The columns never
+// overlap, and saying so with __restrict__ spares the compiler checking.
+
+// Store one axis of an orbit into a window row.  'x - x == 0' is false for
+// NaN and infinity, which can't be summed either.
+static void store(size_t N, const double* __restrict__ x, const epicsUInt16* __restrict__ severity, double* __restrict__ v, double* __restrict__ w) {
+    for (size_t i=0; i<N; i++) {
+        const double xi = x[i];
+        const bool ok = (severity[i] < INVALID_ALARM) & (xi - xi == 0.0);
+        w[i] = ok ? 1.0 : 0.0;
+        v[i] = ok ? xi : 0.0;
+    }
+}
+
+// Add (sign 1) or take out (sign -1) one row of an axis.
+static void accumulate(size_t N, double sign, const double* __restrict__ v, const double* __restrict__ w, const double* __restrict__ ref,
+                       double* __restrict__ n, double* __restrict__ s1, double* __restrict__ s2) {
+    for (size_t i=0; i<N; i++) {
+        const double d = w[i]*(v[i] - ref[i]);
+        n[i] += sign*w[i];
+        s1[i] += sign*d;
+        s2[i] += sign*d*d;
+    }
+}
+
+// The same for a TMIT-weighted mean, weighting each valid sample by the
+// TMIT of the same BPM and pulse, if that is valid too.
+static void accumulate_weighted(size_t N, double sign, const double* __restrict__ v, const double* __restrict__ w, const double* __restrict__ ref,
+                                const double* __restrict__ t, const double* __restrict__ wt, double* __restrict__ n, double* __restrict__ s1) {
+    for (size_t i=0; i<N; i++) {
+        const double tw = w[i]*wt[i]*t[i];
+        n[i] += sign*tw;
+        s1[i] += sign*tw*(v[i] - ref[i]);
+    }
+}
+
+RollingStatistics::RollingStatistics(size_t window) :
+length(std::max(window, size_t(1u))),
+num_bpms(0u),
+head(0u),
+pulses(0u)
+{
+    latest.secPastEpoch = 0;
+    latest.nsec = 0;
+}
+
+void RollingStatistics::reset(size_t n) {
+    num_bpms = n;
+    head = 0u;
+    pulses = 0u;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        values[j].assign(length*num_bpms, 0.0);
+        weights[j].assign(length*num_bpms, 0.0);
+        reference[j].assign(num_bpms, 0.0);
+        sums[j].n.assign(num_bpms, 0.0);
+        sums[j].s1.assign(num_bpms, 0.0);
+        sums[j].s2.assign(num_bpms, 0.0);
+    }
+    for (size_t a=0; a<2u; a++) {
+        tmit_sums[a].n.assign(num_bpms, 0.0);
+        tmit_sums[a].s1.assign(num_bpms, 0.0);
+    }
+}
+
+void RollingStatistics::take(size_t row, double sign) {
+    const size_t N = num_bpms;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        accumulate(N, sign, &values[j][row], &weights[j][row], reference[j].data(), sums[j].n.data(), sums[j].s1.data(), sums[j].s2.data());
+    }
+    for (size_t a=0; a<2u; a++) {
+        accumulate_weighted(N, sign, &values[a][row], &weights[a][row], reference[a].data(), &values[AXIS_TMIT][row], &weights[AXIS_TMIT][row], tmit_sums[a].n.data(), tmit_sums[a].s1.data());
+    }
+}
+
+// Move each reference to the mean so far, and sum the window again.
+void RollingStatistics::rebase() {
+    const size_t N = num_bpms;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        double* ref = reference[j].data();
+        const double* n = sums[j].n.data();
+        const double* s1 = sums[j].s1.data();
+        for (size_t i=0; i<N; i++) {
+            const double r = ref[i], m = s1[i]/n[i];
+            ref[i] = n[i] > 0.0 ? r + m : r;
+        }
+        std::fill(sums[j].n.begin(), sums[j].n.end(), 0.0);
+        std::fill(sums[j].s1.begin(), sums[j].s1.end(), 0.0);
+        std::fill(sums[j].s2.begin(), sums[j].s2.end(), 0.0);
+    }
+    for (size_t a=0; a<2u; a++) {
+        std::fill(tmit_sums[a].n.begin(), tmit_sums[a].n.end(), 0.0);
+        std::fill(tmit_sums[a].s1.begin(), tmit_sums[a].s1.end(), 0.0);
+    }
+    for (size_t r=0; r<pulses; r++) {
+        take(r*num_bpms, 1.0);
+    }
+}
+
+void RollingStatistics::add(const OrbitData& orbit) {
+    if (orbit.size() != num_bpms || values[AXIS_X].empty()) {
+        reset(orbit.size());
+    }
+    const size_t N = num_bpms, row = head*N;
+    if (pulses == length) {
+        take(row, -1.0);
+    }
+    for (size_t j=0; j<NUM_AXES; j++) {
+        store(N, orbit.value[j].data(), orbit.severity[j].data(), &values[j][row], &weights[j][row]);
+        if (pulses == 0u) {
+            // Near enough to the mean to start with.
+            std::copy(values[j].begin() + row, values[j].begin() + row + N, reference[j].begin());
+        }
+    }
+    take(row, 1.0);
+    latest = orbit.ts;
+    pulses = std::min(pulses + 1u, length);
+    head = (head + 1u) % length;
+    if (head == 0u) {
+        rebase();
+    }
+}
+
+void RollingStatistics::compute(OrbitStatistics& out) const {
+    const size_t N = num_bpms;
+    const double inf = std::numeric_limits<double>::infinity();
+    out.ts = latest;
+    out.pulses = pulses;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        out.count[j].resize(N);
+        out.mean[j].resize(N);
+        out.rms[j].resize(N);
+        out.min[j].assign(N, inf);
+        out.max[j].assign(N, -inf);
+        const double* n = sums[j].n.data();
+        const double* s1 = sums[j].s1.data();
+        const double* s2 = sums[j].s2.data();
+        const double* ref = reference[j].data();
+        double* mean = out.mean[j].data();
+        double* rms = out.rms[j].data();
+        epicsUInt32* count = out.count[j].data();
+        for (size_t i=0; i<N; i++) {
+            const double ni = n[i], m = s1[i]/ni;
+            const double var = s2[i]/ni - m*m;
+            const double sd = std::sqrt(var > 0.0 ? var : 0.0);
+            mean[i] = ni > 0.0 ? ref[i] + m : NAN;
+            rms[i] = ni > 0.0 ? sd : NAN;
+            count[i] = epicsUInt32(ni > 0.0 ? ni + 0.5 : 0.0);
+        }
+        double* mn = out.min[j].data();
+        double* mx = out.max[j].data();
+        for (size_t r=0; r<pulses; r++) {
+            const double* v = &values[j][r*N];
+            const double* w = &weights[j][r*N];
+            for (size_t i=0; i<N; i++) {
+                const double vi = v[i], lo = mn[i], hi = mx[i];
+                const bool ok = w[i] > 0.0;
+                mn[i] = ok & (vi < lo) ? vi : lo;
+                mx[i] = ok & (vi > hi) ? vi : hi;
+            }
+        }
+        for (size_t i=0; i<N; i++) {
+            const double lo = mn[i], hi = mx[i];
+            mn[i] = n[i] > 0.0 ? lo : NAN;
+            mx[i] = n[i] > 0.0 ? hi : NAN;
+        }
+    }
+    std::vector<double>* weighted[2] = {&out.x_tmit_mean, &out.y_tmit_mean};
+    for (size_t a=0; a<2u; a++) {
+        weighted[a]->resize(N);
+        const double* n = tmit_sums[a].n.data();
+        const double* s1 = tmit_sums[a].s1.data();
+        const double* ref = reference[a].data();
+        double* mean = weighted[a]->data();
+        for (size_t i=0; i<N; i++) {
+            const double m = ref[i] + s1[i]/n[i];
+            mean[i] = n[i] > 0.0 ? m : NAN;
+        }
+    }
+}
+
+// Fold one axis of an orbit into a window's totals.
+static void fold(size_t N, const double* __restrict__ x, const epicsUInt16* __restrict__ severity,
+                 double* __restrict__ n, double* __restrict__ sum, double* __restrict__ lo, double* __restrict__ hi) {
+    for (size_t i=0; i<N; i++) {
+        const double xi = x[i], l = lo[i], h = hi[i];
+        const bool ok = (severity[i] < INVALID_ALARM) & (xi - xi == 0.0);
+        n[i] += ok ? 1.0 : 0.0;
+        sum[i] += ok ? xi : 0.0;
+        lo[i] = ok & (xi < l) ? xi : l;
+        hi[i] = ok & (xi > h) ? xi : h;
+    }
+}
+
+BoxcarStatistics::BoxcarStatistics() :
+num_bpms(0u),
+count(0u)
+{
+    first.secPastEpoch = last.secPastEpoch = 0;
+    first.nsec = last.nsec = 0;
+}
+
+void BoxcarStatistics::clear() {
+    const double inf = std::numeric_limits<double>::infinity();
+    count = 0u;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        n[j].assign(num_bpms, 0.0);
+        sum[j].assign(num_bpms, 0.0);
+        min[j].assign(num_bpms, inf);
+        max[j].assign(num_bpms, -inf);
+    }
+}
+
+void BoxcarStatistics::add(const OrbitData& orbit) {
+    if (orbit.size() != num_bpms || n[AXIS_X].size() != num_bpms) {
+        num_bpms = orbit.size();
+        clear();
+    }
+    for (size_t j=0; j<NUM_AXES; j++) {
+        fold(num_bpms, orbit.value[j].data(), orbit.severity[j].data(), n[j].data(), sum[j].data(), min[j].data(), max[j].data());
+    }
+    if (count == 0u) {
+        first = orbit.ts;
+    }
+    last = orbit.ts;
+    count++;
+}
+
+void BoxcarStatistics::compute(OrbitWindow& out) const {
+    const size_t N = num_bpms;
+    out.first = first;
+    out.last = last;
+    out.pulses = count;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        out.count[j].resize(N);
+        out.mean[j].resize(N);
+        out.min[j].resize(N);
+        out.max[j].resize(N);
+        const double* nj = n[j].data();
+        const double* s = sum[j].data();
+        const double* lo = min[j].data();
+        const double* hi = max[j].data();
+        for (size_t i=0; i<N; i++) {
+            const double ni = nj[i], m = s[i]/ni;
+            out.count[j][i] = epicsUInt32(ni + 0.5);
+            out.mean[j][i] = ni > 0.0 ? m : NAN;
+            out.min[j][i] = ni > 0.0 ? lo[i] : NAN;
+            out.max[j][i] = ni > 0.0 ? hi[i] : NAN;
+        }
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef ORBIT_STATISTICS_H
+#define ORBIT_STATISTICS_H
+
+#include <vector>
+#include <array>
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include "orbit.h"
+
+// Per-BPM statistics over a window of recent pulses, from
+// RollingStatistics::compute().  Entries are NaN for a BPM axis with no
+// valid samples in the window.
+struct OrbitStatistics {
+    epicsTimeStamp ts;
+    // pulses in the window so far, up to its length
+    size_t pulses;
+    // valid samples of each BPM axis
+    std::array<std::vector<epicsUInt32>, NUM_AXES> count;
+    std::array<std::vector<double>, NUM_AXES> mean;
+    // standard deviation about the mean, i.e. the pulse to pulse jitter
+    std::array<std::vector<double>, NUM_AXES> rms;
+    std::array<std::vector<double>, NUM_AXES> min;
+    std::array<std::vector<double>, NUM_AXES> max;
+    // mean X and Y weighted by the same pulse's TMIT
+    std::vector<double> x_tmit_mean;
+    std::vector<double> y_tmit_mean;
+};
+
+// Keeps the last 'window' orbits and running sums over them, updated as
+// each orbit comes in by taking out the pulse leaving the window and adding
+// the new one.  A sample counts if its severity is below INVALID, so
+// missing BPMs are left out.
+//
+// The sums are of each value's offset from a reference near the BPM's mean,
+// so the variance doesn't lose its precision to a large mean (TMIT, or an
+// offset BPM).  Once per window the reference moves to the current mean and
+// the sums are worked out again from scratch, which also stops rounding
+// errors from piling up.
+//
+// Every loop runs over BPMs, on contiguous columns and without branches, so
+// the compiler can vectorize it.  Not thread safe.
+class RollingStatistics {
+public:
+    explicit RollingStatistics(size_t window);
+    size_t window() const { return length; }
+    // Start again, for orbits of 'num_bpms' BPMs.
+    void reset(size_t num_bpms);
+    // Add one orbit, dropping the oldest once the window is full.  Orbits
+    // of another size start the statistics again.
+    void add(const OrbitData& orbit);
+    void compute(OrbitStatistics& out) const;
+private:
+    // totals for one axis, or for one of the TMIT-weighted means
+    struct Sums {
+        std::vector<double> n, s1, s2;
+    };
+    void take(size_t row, double sign);
+    void rebase();
+    const size_t length;
+    size_t num_bpms;
+    // where the next orbit goes, and how many the window holds
+    size_t head, pulses;
+    epicsTimeStamp latest;
+    // 'length' rows of num_bpms for each axis: the values, and 1 for a
+    // valid sample or 0 (with the value 0) for one left out
+    std::array<std::vector<double>, NUM_AXES> values;
+    std::array<std::vector<double>, NUM_AXES> weights;
+    std::array<std::vector<double>, NUM_AXES> reference;
+    std::array<Sums, NUM_AXES> sums;
+    // for X and Y: TMIT, and TMIT times the offset, where both are valid
+    std::array<Sums, 2> tmit_sums;
+};
+
+// Per-BPM summary of the orbits in one boxcar window, from
+// BoxcarStatistics::compute().  Entries are NaN for a BPM axis with no
+// valid samples in the window.
+struct OrbitWindow {
+    // first and last pulse in the window
+    epicsTimeStamp first, last;
+    size_t pulses;
+    std::array<std::vector<epicsUInt32>, NUM_AXES> count;
+    std::array<std::vector<double>, NUM_AXES> mean;
+    std::array<std::vector<double>, NUM_AXES> min;
+    std::array<std::vector<double>, NUM_AXES> max;
+};
+
+// Count, sum, min and max of each BPM axis over the orbits added since the
+// last clear(), for boxcar averages and envelopes.  Samples count on the
+// same terms as for RollingStatistics, and the loops are written the same
+// way.  Not thread safe.
+class BoxcarStatistics {
+public:
+    BoxcarStatistics();
+    size_t pulses() const { return count; }
+    void clear();
+    // Orbits of another size than the ones before start the window again.
+    void add(const OrbitData& orbit);
+    void compute(OrbitWindow& out) const;
+private:
+    size_t num_bpms, count;
+    epicsTimeStamp first, last;
+    std::array<std::vector<double>, NUM_AXES> n, sum, min, max;
+};
+
+#endif //ORBIT_STATISTICS_H
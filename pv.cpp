@@ -2,13 +2,18 @@
 #include "orbit.h"
 #include <db_access.h>
 #include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <set>
+#include <thread>
+#include <exception>
 #include <epicsThread.h>
 #include <cadef.h>
 #include <pv/reftrack.h>
 #include <errlog.h>
 
-namespace pvd = epics::pvData;
-
 namespace {
     struct eca_error : public std::runtime_error
     {
@@ -35,16 +40,36 @@ void onError(exception_handler_args args)
                  args.pFile, args.lineNo, args.ctx);
 }
 
-size_t DBRValue::Holder::num_instances;
+std::atomic<size_t> DBRValue::num_allocations(0u);
 
-DBRValue::Holder::Holder() : sevr(4), stat(LINK_ALARM), count(1u) {
-    REFTRACE_INCREMENT(num_instances);
-    ts.secPastEpoch = 0;
-    ts.nsec = 0;
+void DBRValue::assign(short type, epicsUInt32 n, const void* src) {
+    const size_t elem_size = dbr_value_size[type];
+    dbr_type = type;
+    count = n;
+    if(n <= 1u) {
+        assert(elem_size <= sizeof(scalar));
+        memcpy(&scalar, src, n*elem_size);
+        return;
+    }
+    const size_t size = elem_size * n;
+    if(array.capacity() < size) {
+        num_allocations++;
+    }
+    array.resize(size);
+    memcpy(array.data(), src, size);
 }
 
-DBRValue::Holder::~Holder() {
-    REFTRACE_DECREMENT(num_instances);
+double DBRValue::as_double(size_t i) const {
+    const void* p = data();
+    switch(dbr_type) {
+        case DBR_TIME_DOUBLE: return static_cast<const epicsFloat64*>(p)[i];
+        case DBR_TIME_FLOAT: return static_cast<const epicsFloat32*>(p)[i];
+        case DBR_TIME_LONG: return static_cast<const epicsInt32*>(p)[i];
+        case DBR_TIME_SHORT: return static_cast<const epicsInt16*>(p)[i];
+        case DBR_TIME_ENUM: return static_cast<const epicsUInt16*>(p)[i];
+        case DBR_TIME_CHAR: return static_cast<const epicsUInt8*>(p)[i];
+        default: return 0.0;
+    }
 }
 
 size_t CAContext::num_instances;
@@ -138,21 +163,72 @@ CAContext::Attach::~Attach()
     }
 }
 
+Channel::Channel(const std::string& name, Orbit& orbit, size_t index, size_t limit) :
+    name(name),
+    orbit(orbit),
+    index(index),
+    connected(false),
+    queued(false),
+    values(limit),
+    overflows(0u),
+    stale(0u),
+    max_queued(0u)
+{
+    last_event.secPastEpoch = 0;
+    last_event.nsec = 0;
+}
+
+void Channel::post(const epicsTimeStamp& ts, epicsUInt16 sevr, epicsUInt16 stat, short type, epicsUInt32 count, const void* data) {
+    const bool advanced = epicsTimeDiffInSeconds(&ts, &last_event) > 0;
+    last_event = ts;
+    if(!advanced) {
+        stale++;
+        return;
+    }
+    enqueue(ts, sevr, stat, type, count, data);
+}
+
+void Channel::enqueue(const epicsTimeStamp& ts, epicsUInt16 sevr, epicsUInt16 stat, short type, epicsUInt32 count, const void* data) {
+    // Fill the next queue slot directly; a full queue drops this update.
+    DBRValue* val = values.back();
+    if(!val) {
+        overflows++;
+        return;
+    }
+    val->sevr = sevr;
+    val->stat = stat;
+    val->ts = ts;
+    val->received = std::chrono::steady_clock::now();
+    val->assign(type, count, data);
+    values.push();
+    const size_t depth = values.size();
+    if(depth > max_queued.load(std::memory_order_relaxed)) {
+        max_queued.store(depth, std::memory_order_relaxed);
+    }
+    if(!queued.exchange(true)) {
+        orbit.channel_ready(this);
+    }
+}
+
+void Channel::set_connected(bool up) {
+    if(up) {
+        last_event.secPastEpoch = 0;
+        last_event.nsec = 0;
+    }
+    connected = up;
+    orbit.connection_changed();
+}
+
 size_t PV::num_instances;
 
-PV::PV(const std::string& pvname, const CAContext& context, size_t limit, Orbit& orbit) : 
+PV::PV(const std::string& pvname, const CAContext& context) : 
     pvname(pvname),
     context(context),
-    orbit(orbit),
     connected(false),
-    ready(false),
-    limit(limit),
     chan(0),
     ev(0)
 {
     REFTRACE_INCREMENT(num_instances);
-    last_event.secPastEpoch = 0;
-    last_event.nsec = 0;
     if(!context.context){
         return;
     }
@@ -163,7 +239,6 @@ PV::PV(const std::string& pvname, const CAContext& context, size_t limit, Orbit&
 }
 
 PV::~PV() {
-    printf("Clearing PV: %s\n", pvname.c_str());
     close();
     REFTRACE_DECREMENT(num_instances);
 }
@@ -188,31 +263,18 @@ void PV::close() {
     eca_error::check(err);
 }
 
-void PV::clear(size_t remain) {
+void PV::add_sink(Channel* sink) {
     Guard G(mutex);
-    while(values.size() > remain) {
-        values.pop_front();
+    sinks.push_back(sink);
+    if(connected) {
+        sink->set_connected(true);
     }
 }
 
-DBRValue PV::pop() {
-    DBRValue ret;
-    {
-        Guard G(mutex);
-        if(!values.empty()) {
-            ret = values.front();
-            values.pop_front();
-        }
-    }
-    return ret;
-}
-
-void PV::push(DBRValue& v) {
-    while(values.size() > limit) {
-        values.pop_front();
-    }
-    values.push_back(DBRValue());
-    values.back().swap(v);
+size_t PV::remove_sink(Channel* sink) {
+    Guard G(mutex);
+    sinks.erase(std::remove(sinks.begin(), sinks.end(), sink), sinks.end());
+    return sinks.size();
 }
 
 void PV::connectionCallback(connection_handler_args args) {
@@ -227,12 +289,10 @@ void PV::connectionCallback(connection_handler_args args) {
             }
             const int err = ca_create_subscription(promoted, 0, args.chid, DBE_VALUE|DBE_ALARM, &monitorCallback, self, &self->ev);
             eca_error::check(err);
-            {
-                Guard G(self->mutex);
-                self->last_event.secPastEpoch = 0;
-                self->last_event.nsec = 0;
-                self->connected = true;
-                self->limit = size_t(4u);
+            Guard G(self->mutex);
+            self->connected = true;
+            for(size_t i=0, N=self->sinks.size(); i<N; i++) {
+                self->sinks[i]->set_connected(true);
             }
         } else if(args.op == CA_OP_CONN_DOWN) {
             if(!self->ev) {
@@ -240,19 +300,12 @@ void PV::connectionCallback(connection_handler_args args) {
             }
             const int err = ca_clear_subscription(self->ev);
             self->ev = 0;
-        
-            DBRValue val(new DBRValue::Holder);
-            epicsTimeGetCurrent(&val->ts);
-            bool notify = false;
             {
                 Guard G(self->mutex);
-                notify = self->values.empty();
                 self->connected = false;
-                self->push(val);
-            }
-            if(notify) {
-                //self->ready = true;
-                self->orbit.wake();
+                for(size_t i=0, N=self->sinks.size(); i<N; i++) {
+                    self->sinks[i]->set_connected(false);
+                }
             }
             eca_error::check(err);
         }
@@ -261,65 +314,125 @@ void PV::connectionCallback(connection_handler_args args) {
     }
 }
 
+// The sink list only changes when an orbit subscribes or unsubscribes, so
+// the lock taken here is uncontended in steady state.
 void PV::monitorCallback(event_handler_args args) {
     PV *self = static_cast<PV*>(args.usr);
     try {
         if(!dbr_type_is_TIME(args.type)) {
             throw std::runtime_error("CA server doesn't honor DBR_TIME_*");
         }
-        size_t count = args.count;
-        size_t elem_size = dbr_value_size[args.type];
-        size_t size = dbr_size_n(args.type, args.count);
-        if(args.count == 0 && size > elem_size) {
-            size -= elem_size;
-        }
-        pvd::ScalarType type;
-        switch(args.type) {
-            case DBR_TIME_STRING: type = pvd::pvString; break;
-            case DBR_TIME_SHORT: type = pvd::pvShort; break;
-            case DBR_TIME_FLOAT: type = pvd::pvFloat; break;
-            case DBR_TIME_ENUM: type = pvd::pvShort; break;
-            case DBR_TIME_CHAR: type = pvd::pvByte; break;
-            case DBR_TIME_LONG: type = pvd::pvInt; break;
-            case DBR_TIME_DOUBLE: type = pvd::pvDouble; break;
-            default:
-                type = pvd::pvByte; break;
+        if(args.type == DBR_TIME_STRING) {
+            printf("%s DBF_STRING not supported, ignoring\n", self->pvname.c_str());
+            return;
         }
         dbr_time_double meta;
         memcpy(&meta, args.dbr, offsetof(dbr_time_double, value));
-        pvd::shared_vector<void> buf;
-        if(type != pvd::pvString) {
-            buf = pvd::ScalarTypeFunc::allocArray(type, count);
-            if(buf.size() != elem_size * count) {
-                throw std::logic_error("DBR buffer size computation error");
-            }
-            memcpy(buf.data(), dbr_value_ptr(args.dbr, args.type), buf.size());
-        } else {
-            printf("%s DBF_STRING not supported, ignoring\n", self->pvname.c_str());
-            return;
+        const void* data = dbr_value_ptr(args.dbr, args.type);
+        Guard G(self->mutex);
+        for(size_t i=0, N=self->sinks.size(); i<N; i++) {
+            self->sinks[i]->post(meta.stamp, meta.severity, meta.status, args.type, args.count, data);
         }
-        
-        DBRValue val(new DBRValue::Holder);
-        val->sevr = meta.severity;
-        val->stat = meta.status;
-        val->ts = meta.stamp;
-        val->count = count;
-        val->buffer = pvd::freeze(buf);
-        assert(val->buffer.data() != nullptr);
-        bool notify = false;
-        {
-            Guard G(self->mutex);
-            if(epicsTimeDiffInSeconds(&meta.stamp, &self->last_event) > 0) {
-                notify = self->values.empty();
-                self->push(val);
+    } catch(std::exception& err) {
+        printf("Unexpected exception in PV::monitorCallback() for %s: %s\n", ca_name(args.chid), err.what());
+    }
+}
+
+CAChannelPool::CAChannelPool(size_t num_contexts, unsigned int prio) :
+    next_context(0u)
+{
+    for(size_t i=0; i<std::max(num_contexts, size_t(1u)); i++) {
+        contexts.push_back(std::make_shared<CAContext>(prio));
+    }
+}
+
+CAChannelPool::~CAChannelPool() {
+    // Channels must go before the contexts they live in.
+    pvs.clear();
+}
+
+void CAChannelPool::subscribe(Channel* sink) {
+    Guard G(mutex);
+    std::shared_ptr<PV>& entry = pvs[sink->name];
+    if(!entry) {
+        entry.reset(new PV(sink->name, *contexts[next_context]));
+        next_context = (next_context + 1u) % contexts.size();
+    }
+    entry->add_sink(sink);
+}
+
+// New channels are created by one thread per context, attached to it once,
+// and each context is flushed when its channels are all created, so the
+// searches go out together instead of trickling out one channel at a time.
+// If any context fails, none of the sinks are subscribed, and the channels
+// created for them are cleared again (outside the pool lock).
+void CAChannelPool::subscribe_all(const std::vector<Channel*>& sinks) {
+    std::vector<std::shared_ptr<PV>> dropped;
+    Guard G(mutex);
+    std::vector<std::vector<std::pair<std::string, std::shared_ptr<PV>*>>> created(contexts.size());
+    std::set<std::string> scheduled;
+    for(size_t i=0, N=sinks.size(); i<N; i++) {
+        std::shared_ptr<PV>& entry = pvs[sinks[i]->name];
+        if(!entry && scheduled.insert(sinks[i]->name).second) {
+            created[next_context].push_back(std::make_pair(sinks[i]->name, &entry));
+            next_context = (next_context + 1u) % contexts.size();
+        }
+    }
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> errors(contexts.size());
+    for(size_t k=0; k<contexts.size(); k++) {
+        if(created[k].empty()) {
+            continue;
+        }
+        workers.push_back(std::thread([this, k, &created, &errors]() {
+            try {
+                const CAContext& context = *contexts[k];
+                CAContext::Attach A(context);
+                for(size_t i=0, N=created[k].size(); i<N; i++) {
+                    created[k][i].second->reset(new PV(created[k][i].first, context));
+                }
+                ca_flush_io();
+            } catch(...) {
+                errors[k] = std::current_exception();
+            }
+        }));
+    }
+    for(size_t w=0; w<workers.size(); w++) {
+        workers[w].join();
+    }
+    for(size_t k=0; k<errors.size(); k++) {
+        if(errors[k]) {
+            for(std::set<std::string>::const_iterator it=scheduled.begin(); it!=scheduled.end(); ++it) {
+                dropped.push_back(pvs[*it]);
+                pvs.erase(*it);
             }
-            self->last_event = meta.stamp;
+            std::rethrow_exception(errors[k]);
         }
-        if(notify) {
-            //self->ready = true;
-            self->orbit.wake();
+    }
+    for(size_t i=0, N=sinks.size(); i<N; i++) {
+        pvs[sinks[i]->name]->add_sink(sinks[i]);
+    }
+}
+
+void CAChannelPool::unsubscribe(Channel* sink) {
+    std::shared_ptr<PV> pv;
+    {
+        Guard G(mutex);
+        std::map<std::string, std::shared_ptr<PV>>::iterator it(pvs.find(sink->name));
+        if(it == pvs.end()) {
+            return;
         }
-    } catch(std::exception& err) {
-        printf("Unexpected exception in PV::monitorCallback() for %s: %s\n", ca_name(args.chid), err.what());
+        if(it->second->remove_sink(sink) > 0u) {
+            return;
+        }
+        pv = it->second;
+        pvs.erase(it);
     }
-}
\ No newline at end of file
+    // Last user gone; the CA channel is cleared outside the pool lock.
+    pv.reset();
+}
+
+size_t CAChannelPool::size() {
+    Guard G(mutex);
+    return pvs.size();
+}
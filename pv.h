@@ -2,13 +2,18 @@
 #define PV_H
 
 #include <string>
-#include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include <cadef.h>
 #include <alarm.h>
 #include <epicsTime.h>
 #include <epicsMutex.h>
 #include <epicsGuard.h>
-#include <pv/sharedVector.h>
+#include "queue.h"
 
 typedef epicsGuard<epicsMutex> Guard;
 typedef epicsGuardRelease<epicsMutex> UnGuard;
@@ -33,57 +38,183 @@ struct CAContext {
     EPICS_NOT_COPYABLE(CAContext)
 };
 
+// One update from a channel.  DBRValues live in the slots of a PV's queue
+// and are refilled in place by the monitor callback, so the steady state
+// allocates nothing: a single element is kept inline, and the buffer for
+// longer arrays is retained and reused by the next update.
 struct DBRValue {
-    struct Holder {
-        static size_t num_instances;
-        epicsTimeStamp ts;
-        epicsUInt16 sevr;
-        epicsUInt16 stat;
-        epicsUInt32 count;
-        epics::pvData::shared_vector<const void> buffer;
-        Holder();
-        ~Holder();
-    };
+    // number of times an array buffer had to grow
+    static std::atomic<size_t> num_allocations;
+    epicsTimeStamp ts;
+    epicsUInt16 sevr;
+    epicsUInt16 stat;
+    epicsUInt32 count;
+    // DBR_TIME_* type of the value, or -1 if this holds no value
+    short dbr_type;
+    // when the update reached us
+    std::chrono::steady_clock::time_point received;
 private:
-    std::shared_ptr<Holder> held;
+    union {
+        epicsFloat64 f64;
+        epicsFloat32 f32;
+        epicsInt32 i32;
+        epicsInt16 i16;
+        epicsUInt16 u16;
+        epicsUInt8 u8;
+    } scalar;
+    std::vector<char> array;
 public:
-    DBRValue() {}
-    DBRValue(Holder *H) : held(H) {}
-    bool valid() const { return !!held; }
-    Holder* operator->() {return held.get();}
-    const Holder* operator->() const {return held.get();}
+    DBRValue() : sevr(4), stat(LINK_ALARM), count(1u), dbr_type(-1) {
+        ts.secPastEpoch = 0;
+        ts.nsec = 0;
+        scalar.f64 = 0.0;
+    }
+    bool valid() const { return dbr_type >= 0; }
+    void assign(short type, epicsUInt32 n, const void* src);
+    const void* data() const { return count <= 1u ? static_cast<const void*>(&scalar) : static_cast<const void*>(array.data()); }
+    double as_double(size_t i=0) const;
     void swap(DBRValue& o) {
-        held.swap(o.held);
+        std::swap(ts, o.ts);
+        std::swap(sevr, o.sevr);
+        std::swap(stat, o.stat);
+        std::swap(count, o.count);
+        std::swap(dbr_type, o.dbr_type);
+        std::swap(received, o.received);
+        std::swap(scalar, o.scalar);
+        array.swap(o.array);
     }
+    // Forget the value, but keep the array buffer for reuse.
     void reset() {
-        held.reset();
+        dbr_type = -1;
+        sevr = 4;
+        stat = LINK_ALARM;
     }
 };
 
+// One orbit's end of a channel: the queue of updates waiting for that
+// orbit.  The producer is whatever feeds the channel (for CA, the monitor
+// callback of the PV it is subscribed to) and the consumer is the orbit's
+// processing thread.
+struct Channel {
+    Channel(const std::string& name, Orbit& orbit, size_t index, size_t limit);
+    const std::string name;
+    Orbit& orbit;
+    // position of this channel in the orbit (3*bpm + axis)
+    const size_t index;
+    std::atomic<bool> connected;
+    // set while this channel is on the orbit's list of channels with pending data
+    std::atomic<bool> queued;
+    // updates waiting for the orbit, filled in place by post()
+    SPSCQueue<DBRValue> values;
+    // updates discarded because 'values' was full
+    std::atomic<size_t> overflows;
+    // updates discarded because their timestamp did not advance
+    std::atomic<size_t> stale;
+    // deepest 'values' has been
+    std::atomic<size_t> max_queued;
+    // Producer side: queue one update, copying 'count' elements of DBR_TIME_*
+    // 'type' from 'data'.
+    void post(const epicsTimeStamp& ts, epicsUInt16 sevr, epicsUInt16 stat, short type, epicsUInt32 count, const void* data);
+    // post() without discarding updates whose timestamp didn't advance, for
+    // a source which repeats or reorders updates on purpose.
+    void enqueue(const epicsTimeStamp& ts, epicsUInt16 sevr, epicsUInt16 stat, short type, epicsUInt32 count, const void* data);
+    void set_connected(bool up);
+private:
+    epicsTimeStamp last_event;
+    EPICS_NOT_COPYABLE(Channel)
+};
+
+// A block of pulses from a table source, which delivers many channels'
+// values already lined up by pulse: row r is pulse ts[r], and column k
+// holds channel 'channels[k]' of the orbit.  Stored column by column, so
+// each column of the table is copied in one go.
+struct RowBlock {
+    std::vector<epicsTimeStamp> ts;
+    std::vector<size_t> channels;
+    // columns.size() x ts.size(), column-major
+    std::vector<double> values;
+    std::vector<epicsUInt16> sevr;
+    std::vector<epicsUInt16> stat;
+    // when the block reached us
+    std::chrono::steady_clock::time_point received;
+    size_t rows() const { return ts.size(); }
+};
+
+// An orbit's end of a table source: blocks waiting for the orbit, which
+// bypass the per-channel queues.  The producer fills back() in place (the
+// vectors keep their storage from one block to the next), push()es, then
+// wakes the orbit.
+struct TableFeed {
+    explicit TableFeed(size_t limit) : blocks(limit), overflows(0u) {}
+    SPSCQueue<RowBlock> blocks;
+    // blocks discarded because the queue was full
+    std::atomic<size_t> overflows;
+};
+
+// One CA channel, shared by every Channel subscribed to its name.
 struct PV {
 public:
-    PV(const std::string& pvname, const CAContext& context, size_t limit, Orbit& orbit);
+    PV(const std::string& pvname, const CAContext& context);
     ~PV();
     static size_t num_instances;
     const std::string pvname;
     const CAContext& context;
-    Orbit& orbit;
     bool connected;
-    bool ready;
+    // guards 'sinks', 'connected', and the CA handles
     mutable epicsMutex mutex;
-    std::deque<DBRValue> values;
-    DBRValue pop();
-    size_t limit;
+    void add_sink(Channel* sink);
+    // Returns the number of sinks left.  Once this returns, 'sink' is no
+    // longer used.
+    size_t remove_sink(Channel* sink);
     void close();
-    void clear(size_t remain);
 private:
     void connect();
+    std::vector<Channel*> sinks;
     chid chan;
     evid ev;
-    epicsTimeStamp last_event;
-    void push(DBRValue& v);
     static void connectionCallback(struct connection_handler_args args);
     static void monitorCallback(struct event_handler_args args);
 };
 
-#endif //PV_H
\ No newline at end of file
+// Feeds Channels with updates for their names.  All updates for one
+// Channel must come from one thread at a time, since post() is the
+// producer side of a single-producer queue.
+class ChannelSource {
+public:
+    virtual ~ChannelSource() {}
+    // Start feeding 'sink'.  Calls sink->set_connected() as the channel
+    // comes and goes, and sink->post() for each update.
+    virtual void subscribe(Channel* sink) = 0;
+    // subscribe() to each of 'sinks'.  Sources which can set many channels
+    // up faster together do so.
+    virtual void subscribe_all(const std::vector<Channel*>& sinks) {
+        for (size_t i=0, N=sinks.size(); i<N; i++) {
+            subscribe(sinks[i]);
+        }
+    }
+    // Once this returns, 'sink' is no longer used.
+    virtual void unsubscribe(Channel* sink) = 0;
+    // number of distinct channels being fed
+    virtual size_t size() = 0;
+};
+
+// Owns the CA contexts and the CA channels for every orbit in the process.
+// Channels are spread over the contexts, and each PV name is subscribed to
+// once however many orbits use it.
+class CAChannelPool : public ChannelSource {
+public:
+    CAChannelPool(size_t num_contexts, unsigned int prio);
+    virtual ~CAChannelPool();
+    virtual void subscribe(Channel* sink);
+    virtual void subscribe_all(const std::vector<Channel*>& sinks);
+    virtual void unsubscribe(Channel* sink);
+    virtual size_t size();
+private:
+    std::vector<std::shared_ptr<CAContext>> contexts;
+    epicsMutex mutex;
+    std::map<std::string, std::shared_ptr<PV>> pvs;
+    size_t next_context;
+    EPICS_NOT_COPYABLE(CAChannelPool)
+};
+
+#endif //PV_H
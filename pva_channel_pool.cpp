@@ -0,0 +1,156 @@
+#include "pva_channel_pool.h"
+#include <stdio.h>
+#include <algorithm>
+#include <db_access.h>
+#include <pv/reftrack.h>
+
+// Updates the server may send ahead of our acknowledgements.
+static unsigned pvaQueueSize = 8;
+
+size_t PVAChannel::num_instances;
+
+PVAChannel::PVAChannel(const std::string& pvname, pvxs::client::Context& context, unsigned queue_size) :
+    pvname(pvname),
+    connected(false)
+{
+    REFTRACE_INCREMENT(num_instances);
+    sub = context.monitor(pvname)
+        .record("pipeline", true)
+        .record("queueSize", uint32_t(queue_size))
+        .maskConnected(false)
+        .maskDisconnected(false)
+        .event([this](pvxs::client::Subscription& s) { onEvent(s); })
+        .exec();
+}
+
+PVAChannel::~PVAChannel() {
+    close();
+    REFTRACE_DECREMENT(num_instances);
+}
+
+void PVAChannel::close() {
+    if(!sub) {
+        return;
+    }
+    // Waits out a callback in progress.
+    sub->cancel();
+    sub.reset();
+}
+
+void PVAChannel::add_sink(Channel* sink) {
+    Guard G(mutex);
+    sinks.push_back(sink);
+    if(connected) {
+        sink->set_connected(true);
+    }
+}
+
+size_t PVAChannel::remove_sink(Channel* sink) {
+    Guard G(mutex);
+    sinks.erase(std::remove(sinks.begin(), sinks.end(), sink), sinks.end());
+    return sinks.size();
+}
+
+void PVAChannel::set_connected(bool up) {
+    Guard G(mutex);
+    connected = up;
+    for(size_t i=0, N=sinks.size(); i<N; i++) {
+        sinks[i]->set_connected(up);
+    }
+}
+
+// Called on the context's worker thread whenever the queue becomes
+// non-empty; empty it, acknowledging as we go.
+void PVAChannel::onEvent(pvxs::client::Subscription& s) {
+    while(true) {
+        try {
+            pvxs::Value update(s.pop());
+            if(!update) {
+                return;
+            }
+            post(update);
+        } catch(pvxs::client::Connected&) {
+            set_connected(true);
+        } catch(pvxs::client::Disconnect&) {
+            set_connected(false);
+        } catch(pvxs::client::RemoteError& err) {
+            printf("Monitor error for %s: %s\n", pvname.c_str(), err.what());
+        } catch(std::exception& err) {
+            printf("Unexpected exception in PVAChannel::onEvent() for %s: %s\n", pvname.c_str(), err.what());
+        }
+    }
+}
+
+// Hand an NTScalar or NTScalarArray update to the sinks, in the same form
+// as a CA monitor's DBR_TIME_DOUBLE.
+void PVAChannel::post(const pvxs::Value& update) {
+    epicsTimeStamp ts;
+    const epicsInt64 seconds = update["timeStamp.secondsPastEpoch"].as<epicsInt64>();
+    ts.secPastEpoch = epicsUInt32(seconds - POSIX_TIME_AT_EPICS_EPOCH);
+    ts.nsec = update["timeStamp.nanoseconds"].as<epicsUInt32>();
+    epicsUInt16 sevr = 0u, stat = 0u;
+    update["alarm.severity"].as(sevr);
+    update["alarm.status"].as(stat);
+    const pvxs::Value value(update["value"]);
+    double scalar;
+    pvxs::shared_array<const double> array;
+    Guard G(mutex);
+    if(value.as(scalar)) {
+        for(size_t i=0, N=sinks.size(); i<N; i++) {
+            sinks[i]->post(ts, sevr, stat, DBR_TIME_DOUBLE, 1u, &scalar);
+        }
+    } else if(value.as(array)) {
+        for(size_t i=0, N=sinks.size(); i<N; i++) {
+            sinks[i]->post(ts, sevr, stat, DBR_TIME_DOUBLE, epicsUInt32(array.size()), array.data());
+        }
+    }
+}
+
+PVAChannelPool::PVAChannelPool(size_t num_contexts) :
+    next_context(0u)
+{
+    for(size_t i=0; i<std::max(num_contexts, size_t(1u)); i++) {
+        contexts.push_back(pvxs::client::Config::from_env().build());
+    }
+}
+
+PVAChannelPool::~PVAChannelPool() {
+    // Monitors must go before the contexts they live in.
+    channels.clear();
+    for(size_t i=0, N=contexts.size(); i<N; i++) {
+        contexts[i].close();
+    }
+}
+
+void PVAChannelPool::subscribe(Channel* sink) {
+    Guard G(mutex);
+    std::shared_ptr<PVAChannel>& entry = channels[sink->name];
+    if(!entry) {
+        entry.reset(new PVAChannel(sink->name, contexts[next_context], pvaQueueSize));
+        next_context = (next_context + 1u) % contexts.size();
+    }
+    entry->add_sink(sink);
+}
+
+void PVAChannelPool::unsubscribe(Channel* sink) {
+    std::shared_ptr<PVAChannel> channel;
+    {
+        Guard G(mutex);
+        std::map<std::string, std::shared_ptr<PVAChannel>>::iterator it(channels.find(sink->name));
+        if(it == channels.end()) {
+            return;
+        }
+        if(it->second->remove_sink(sink) > 0u) {
+            return;
+        }
+        channel = it->second;
+        channels.erase(it);
+    }
+    // Last user gone; the monitor is cancelled outside the pool lock.
+    channel.reset();
+}
+
+size_t PVAChannelPool::size() {
+    Guard G(mutex);
+    return channels.size();
+}
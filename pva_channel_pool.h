@@ -0,0 +1,56 @@
+#ifndef PVA_CHANNEL_POOL_H
+#define PVA_CHANNEL_POOL_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <pvxs/client.h>
+#include <pvxs/data.h>
+#include "pv.h"
+
+// One pvAccess monitor, shared by every Channel subscribed to its name.
+// The monitor is pipelined, so the server keeps a window of updates in
+// flight instead of waiting for each to be acknowledged.
+struct PVAChannel {
+public:
+    PVAChannel(const std::string& pvname, pvxs::client::Context& context, unsigned queue_size);
+    ~PVAChannel();
+    static size_t num_instances;
+    const std::string pvname;
+    bool connected;
+    // guards 'sinks' and 'connected'
+    mutable epicsMutex mutex;
+    void add_sink(Channel* sink);
+    // Returns the number of sinks left.  Once this returns, 'sink' is no
+    // longer used.
+    size_t remove_sink(Channel* sink);
+    void close();
+private:
+    void onEvent(pvxs::client::Subscription& sub);
+    void post(const pvxs::Value& update);
+    void set_connected(bool up);
+    std::vector<Channel*> sinks;
+    std::shared_ptr<pvxs::client::Subscription> sub;
+    EPICS_NOT_COPYABLE(PVAChannel)
+};
+
+// Feeds Channels from pvAccess monitors rather than CA, for IOCs which
+// serve PVA natively.  Like CAChannelPool, names are spread over a number
+// of client contexts and each is subscribed to once.
+class PVAChannelPool : public ChannelSource {
+public:
+    explicit PVAChannelPool(size_t num_contexts);
+    virtual ~PVAChannelPool();
+    virtual void subscribe(Channel* sink);
+    virtual void unsubscribe(Channel* sink);
+    virtual size_t size();
+private:
+    std::vector<pvxs::client::Context> contexts;
+    epicsMutex mutex;
+    std::map<std::string, std::shared_ptr<PVAChannel>> channels;
+    size_t next_context;
+    EPICS_NOT_COPYABLE(PVAChannelPool)
+};
+
+#endif //PVA_CHANNEL_POOL_H
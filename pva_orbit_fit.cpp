@@ -0,0 +1,172 @@
+#include "pva_orbit_fit.h"
+#include <stdio.h>
+#include <algorithm>
+#include <pvxs/data.h>
+#include <pvxs/sharedArray.h>
+
+template<typename T>
+static pvxs::shared_array<const T> to_array(const std::vector<T>& v) {
+    pvxs::shared_array<T> arr(v.size());
+    std::copy(v.begin(), v.end(), arr.begin());
+    return arr.freeze();
+}
+
+static pvxs::shared_array<const double> column(const pvxs::Value& table, const char* name) {
+    return table["value"][name].as<pvxs::shared_array<const void>>().castTo<const double>();
+}
+
+// Read the optics of every element from a model twiss table.  p0c is
+// optional; everything else must be there.
+static void read_optics(const pvxs::Value& table, std::vector<ElementOptics>& model) {
+    const pvxs::shared_array<const std::string> names(table["value"]["device_name"].as<pvxs::shared_array<const void>>().castTo<const std::string>());
+    const char* fields[2][5] = {
+        {"beta_x", "alpha_x", "psi_x", "eta_x", "etap_x"},
+        {"beta_y", "alpha_y", "psi_y", "eta_y", "etap_y"},
+    };
+    pvxs::shared_array<const double> cols[2][5];
+    for (size_t j=0; j<2u; j++) {
+        for (size_t k=0; k<5u; k++) {
+            cols[j][k] = column(table, fields[j][k]);
+        }
+    }
+    pvxs::shared_array<const double> p0c;
+    if (table["value"]["p0c"].valid()) {
+        p0c = column(table, "p0c");
+    }
+    model.resize(names.size());
+    for (size_t i=0, N=names.size(); i<N; i++) {
+        ElementOptics& e = model[i];
+        e.name = names[i];
+        e.p0c = i < p0c.size() ? p0c[i] : 0.0;
+        PlaneOptics* planes[2] = {&e.x, &e.y};
+        for (size_t j=0; j<2u; j++) {
+            double v[5];
+            for (size_t k=0; k<5u; k++) {
+                v[k] = i < cols[j][k].size() ? cols[j][k][i] : 0.0;
+            }
+            planes[j]->beta = v[0];
+            planes[j]->alpha = v[1];
+            planes[j]->psi = v[2];
+            planes[j]->eta = v[3];
+            planes[j]->etap = v[4];
+        }
+    }
+}
+
+PVAOrbitFit::PVAOrbitFit(Orbit& orbit, pvxs::client::Context& context, const std::string& model_pv,
+                         const std::vector<std::string>& points, size_t bpms_per_fit, QueuePolicy policy) :
+orbit(orbit),
+model_pv(model_pv),
+points(points),
+bpms_per_fit(bpms_per_fit),
+policy(policy),
+ready(false)
+{
+    pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+
+    fitValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitFit", {
+        pvxs::members::StringA("labels"),
+        pvxs::members::Struct("value", {
+            pvxs::members::StringA("device_name"),
+            pvxs::members::Float64A("x"),
+            pvxs::members::Float64A("xp"),
+            pvxs::members::Float64A("y"),
+            pvxs::members::Float64A("yp"),
+            pvxs::members::Float64A("delta"),
+            pvxs::members::Float64A("rms"),
+            pvxs::members::UInt32A("readings"),
+        }),
+        pvxs::members::String("descriptor"),
+        pvxs::members::Struct("timeStamp", "time_t", time_t),
+    }).create();
+    pvxs::shared_array<std::string> labels({"device_name", "x", "xp", "y", "yp", "delta", "rms", "readings"});
+    fitValue["labels"] = labels.freeze();
+    fitValue["descriptor"] = "LCLS Orbit Fit";
+    fitValue["value.device_name"] = to_array(points);
+    orbit.add_receiver(this);
+    sub = context.monitor(model_pv)
+        .event([this](pvxs::client::Subscription& s) { onEvent(s); })
+        .exec();
+}
+
+PVAOrbitFit::~PVAOrbitFit() {
+    close();
+}
+
+void PVAOrbitFit::close() {
+    if (sub) {
+        sub->cancel();
+        sub.reset();
+    }
+    orbit.remove_receiver(this);
+    pv->close();
+}
+
+ReceiverOptions PVAOrbitFit::options() const {
+    return ReceiverOptions(16u, policy);
+}
+
+void PVAOrbitFit::setNames(const std::vector<std::string>& n) {
+    Guard G(mutex);
+    names = n;
+    rebuild();
+}
+
+void PVAOrbitFit::setZs(const std::vector<double>& zs) {
+}
+
+// Called on the client context's worker thread for each new model.
+void PVAOrbitFit::onEvent(pvxs::client::Subscription& s) {
+    while (true) {
+        try {
+            pvxs::Value update(s.pop());
+            if (!update) {
+                return;
+            }
+            std::vector<ElementOptics> optics;
+            read_optics(update, optics);
+            Guard G(mutex);
+            model.swap(optics);
+            rebuild();
+            printf("Orbit fit optics loaded from %s.\n", model_pv.c_str());
+        } catch (pvxs::client::Disconnect&) {
+        } catch (pvxs::client::RemoteError& err) {
+            printf("Monitor error for %s: %s\n", model_pv.c_str(), err.what());
+        } catch (std::exception& err) {
+            printf("Could not read optics from %s: %s\n", model_pv.c_str(), err.what());
+        }
+    }
+}
+
+void PVAOrbitFit::rebuild() {
+    fit.build(names, model, points, bpms_per_fit);
+    ready = !names.empty() && !model.empty();
+}
+
+void PVAOrbitFit::setCompletedOrbit(const OrbitData& o) {
+    Guard G(mutex);
+    if (!ready) {
+        return;
+    }
+    fit.fit(o, result);
+    fitValue["value.x"] = to_array(result.x);
+    fitValue["value.xp"] = to_array(result.xp);
+    fitValue["value.y"] = to_array(result.y);
+    fitValue["value.yp"] = to_array(result.yp);
+    fitValue["value.delta"] = to_array(result.delta);
+    fitValue["value.rms"] = to_array(result.rms);
+    fitValue["value.readings"] = to_array(result.readings);
+    fitValue["timeStamp.secondsPastEpoch"] = result.ts.secPastEpoch;
+    fitValue["timeStamp.nanoseconds"] = result.ts.nsec;
+    if (!pv->isOpen()) {
+        pv->open(fitValue);
+    } else {
+        pv->post(fitValue);
+    }
+    fitValue.unmark();
+}
@@ -0,0 +1,47 @@
+#ifndef PVA_ORBIT_FIT_H
+#define PVA_ORBIT_FIT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+#include <pvxs/client.h>
+#include "orbit.h"
+#include "orbit_fit.h"
+
+// Posts, for every orbit, the launch position and angle in X and Y and
+// the relative energy offset fitted at each of 'points' (BPM names) from it
+// and the next bpms_per_fit-1 BPMs, with the same timestamp as the orbit.
+// The optics come from a monitor on 'model_pv', so the fit follows the
+// model as it changes.  Nothing is posted until the model has arrived.
+struct PVAOrbitFit : public Receiver
+{
+    PVAOrbitFit(Orbit& orbit, pvxs::client::Context& context, const std::string& model_pv,
+                const std::vector<std::string>& points, size_t bpms_per_fit, QueuePolicy policy = QUEUE_DROP_OLDEST);
+    virtual ~PVAOrbitFit();
+    Orbit& orbit;
+    const std::string model_pv;
+    const std::vector<std::string> points;
+    const size_t bpms_per_fit;
+    const QueuePolicy policy;
+    std::shared_ptr<pvxs::server::SharedPV> pv;
+    pvxs::Value fitValue;
+    void close();
+    virtual ReceiverOptions options() const;
+    virtual void setNames(const std::vector<std::string>& n);
+    virtual void setZs(const std::vector<double>& zs);
+    virtual void setCompletedOrbit(const OrbitData& o);
+private:
+    void onEvent(pvxs::client::Subscription& s);
+    void rebuild();
+    epicsMutex mutex;
+    std::vector<std::string> names;
+    std::vector<ElementOptics> model;
+    OrbitFit fit;
+    bool ready;
+    OrbitFitResult result;
+    std::shared_ptr<pvxs::client::Subscription> sub;
+};
+
+#endif // PVA_ORBIT_FIT_H
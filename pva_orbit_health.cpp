@@ -0,0 +1,190 @@
+#include "pva_orbit_health.h"
+#include "pva_channel_pool.h"
+#include <pvxs/data.h>
+#include <pvxs/sharedArray.h>
+#include <cmath>
+#include <algorithm>
+
+static pvxs::Member histogram_t(const std::string& name) {
+    return pvxs::members::Struct(name, {
+        pvxs::members::UInt64("count"),
+        pvxs::members::Float64("mean_us"),
+        pvxs::members::Float64("max_us"),
+        pvxs::members::UInt64A("counts"),
+    });
+}
+
+PVAOrbitHealth::PVAOrbitHealth(Orbit& orbit, double period) :
+orbit(orbit),
+period(period),
+running(true)
+{
+    pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+
+    healthValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitServerHealth", {
+        pvxs::members::Struct("orbits", {
+            pvxs::members::UInt64("completed"),
+            pvxs::members::UInt64("dropped"),
+            pvxs::members::UInt64("expired"),
+            pvxs::members::UInt64("partial"),
+            pvxs::members::UInt64("final"),
+            pvxs::members::UInt32("pending"),
+            pvxs::members::Float64("deadline"),
+        }),
+        pvxs::members::Struct("values", {
+            pvxs::members::UInt64("late"),
+            pvxs::members::UInt64("duplicates"),
+            pvxs::members::UInt64("backfilled"),
+            pvxs::members::UInt64("stale"),
+            pvxs::members::UInt64("overflows"),
+        }),
+        pvxs::members::Struct("channels", {
+            pvxs::members::UInt32("total"),
+            pvxs::members::UInt32("connected"),
+            pvxs::members::UInt32("max_queued"),
+        }),
+        pvxs::members::Struct("receivers", {
+            pvxs::members::UInt64A("queued"),
+            pvxs::members::UInt64A("max_queued"),
+            pvxs::members::UInt64A("delivered"),
+            pvxs::members::UInt64A("dropped"),
+            pvxs::members::Float64A("max_lag"),
+        }),
+        pvxs::members::Struct("latency", {
+            pvxs::members::Float64A("bucket_upper_us"),
+            histogram_t("ingest"),
+            histogram_t("post"),
+        }),
+        pvxs::members::Struct("process", {
+            histogram_t("update_connections"),
+            histogram_t("dequeue"),
+            histogram_t("check"),
+            histogram_t("deliver"),
+        }),
+        pvxs::members::Struct("startup", {
+            pvxs::members::Float64("subscribed"),
+            pvxs::members::Float64("first_connect"),
+            pvxs::members::Float64("publishing"),
+            pvxs::members::Float64("first_orbit"),
+            pvxs::members::UInt64("held"),
+        }),
+        pvxs::members::Struct("objects", {
+            pvxs::members::UInt32("ca_contexts"),
+            pvxs::members::UInt32("ca_channels"),
+            pvxs::members::UInt32("pva_channels"),
+            pvxs::members::UInt64("orbit_buffers"),
+            pvxs::members::UInt64("value_buffer_allocations"),
+        }),
+        pvxs::members::String("descriptor"),
+        pvxs::members::Struct("timeStamp", "time_t", time_t),
+    }).create();
+    healthValue["descriptor"] = "LCLS Orbit Server Health";
+    pvxs::shared_array<double> upper(Histogram::NUM_BUCKETS);
+    for (size_t i=0; i<Histogram::NUM_BUCKETS; i++) {
+        upper[i] = i + 1u < Histogram::NUM_BUCKETS ? Histogram::upper_us(i) : INFINITY;
+    }
+    healthValue["latency.bucket_upper_us"] = upper.freeze();
+    post();
+    worker = std::thread(&PVAOrbitHealth::run, this);
+}
+
+PVAOrbitHealth::~PVAOrbitHealth() {
+    close();
+}
+
+void PVAOrbitHealth::close() {
+    running = false;
+    wakeup.signal();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    pv->close();
+}
+
+void PVAOrbitHealth::run() {
+    while (running) {
+        wakeup.wait(period);
+        if (running) {
+            post();
+        }
+    }
+}
+
+void PVAOrbitHealth::postHistogram(const std::string& field, const Histogram::Snapshot& h) {
+    healthValue[field + ".count"] = epicsUInt64(h.count);
+    healthValue[field + ".mean_us"] = h.count ? h.sum*1e6/h.count : 0.0;
+    healthValue[field + ".max_us"] = h.max*1e6;
+    pvxs::shared_array<epicsUInt64> counts(h.counts.size());
+    std::copy(h.counts.begin(), h.counts.end(), counts.begin());
+    healthValue[field + ".counts"] = counts.freeze();
+}
+
+void PVAOrbitHealth::post() {
+    const OrbitHealth h(orbit.health());
+    healthValue["orbits.completed"] = epicsUInt64(h.completed);
+    healthValue["orbits.dropped"] = epicsUInt64(h.dropped);
+    healthValue["orbits.expired"] = epicsUInt64(h.expired);
+    healthValue["orbits.partial"] = epicsUInt64(h.partial);
+    healthValue["orbits.final"] = epicsUInt64(h.finals);
+    healthValue["orbits.pending"] = epicsUInt32(h.pending);
+    healthValue["orbits.deadline"] = h.deadline;
+    healthValue["values.late"] = epicsUInt64(h.late);
+    healthValue["values.duplicates"] = epicsUInt64(h.duplicates);
+    healthValue["values.backfilled"] = epicsUInt64(h.backfilled);
+    healthValue["values.stale"] = epicsUInt64(h.stale);
+    healthValue["values.overflows"] = epicsUInt64(h.overflows);
+    healthValue["channels.total"] = epicsUInt32(h.channels);
+    healthValue["channels.connected"] = epicsUInt32(h.connected);
+    healthValue["channels.max_queued"] = epicsUInt32(h.channel_max_queued);
+
+    const size_t NR = h.receivers.size();
+    pvxs::shared_array<epicsUInt64> queued(NR), max_queued(NR), delivered(NR), dropped(NR);
+    pvxs::shared_array<double> max_lag(NR);
+    for (size_t r=0; r<NR; r++) {
+        queued[r] = h.receivers[r].queued;
+        max_queued[r] = h.receivers[r].max_queued;
+        delivered[r] = h.receivers[r].delivered;
+        dropped[r] = h.receivers[r].dropped;
+        max_lag[r] = h.receivers[r].max_lag;
+    }
+    healthValue["receivers.queued"] = queued.freeze();
+    healthValue["receivers.max_queued"] = max_queued.freeze();
+    healthValue["receivers.delivered"] = delivered.freeze();
+    healthValue["receivers.dropped"] = dropped.freeze();
+    healthValue["receivers.max_lag"] = max_lag.freeze();
+
+    postHistogram("latency.ingest", h.ingest_latency);
+    postHistogram("latency.post", h.post_latency);
+    postHistogram("process.update_connections", h.update_time);
+    postHistogram("process.dequeue", h.dequeue_time);
+    postHistogram("process.check", h.check_time);
+    postHistogram("process.deliver", h.deliver_time);
+
+    healthValue["startup.subscribed"] = h.startup.subscribed;
+    healthValue["startup.first_connect"] = h.startup.first_connect;
+    healthValue["startup.publishing"] = h.startup.publishing;
+    healthValue["startup.first_orbit"] = h.startup.first_orbit;
+    healthValue["startup.held"] = epicsUInt64(h.startup.held);
+
+    healthValue["objects.ca_contexts"] = epicsUInt32(CAContext::num_instances);
+    healthValue["objects.ca_channels"] = epicsUInt32(PV::num_instances);
+    healthValue["objects.pva_channels"] = epicsUInt32(PVAChannel::num_instances);
+    healthValue["objects.orbit_buffers"] = epicsUInt64(h.orbit_allocations);
+    healthValue["objects.value_buffer_allocations"] = epicsUInt64(DBRValue::num_allocations);
+
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    healthValue["timeStamp.secondsPastEpoch"] = now.secPastEpoch;
+    healthValue["timeStamp.nanoseconds"] = now.nsec;
+    if (!pv->isOpen()) {
+        pv->open(healthValue);
+    } else {
+        pv->post(healthValue);
+    }
+    healthValue.unmark();
+}
@@ -0,0 +1,34 @@
+#ifndef PVA_ORBIT_HEALTH_H
+#define PVA_ORBIT_HEALTH_H
+
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+#include <epicsEvent.h>
+#include "orbit.h"
+
+// Posts an orbit's health counters and latency histograms, plus process
+// wide object counts, every 'period' seconds.  Counters and histograms are
+// cumulative since startup; clients can difference successive updates.
+struct PVAOrbitHealth
+{
+    PVAOrbitHealth(Orbit& orbit, double period = 1.0);
+    ~PVAOrbitHealth();
+    Orbit& orbit;
+    const double period;
+    std::shared_ptr<pvxs::server::SharedPV> pv;
+    pvxs::Value healthValue;
+    void close();
+private:
+    void run();
+    void post();
+    void postHistogram(const std::string& field, const Histogram::Snapshot& h);
+    std::atomic<bool> running;
+    epicsEvent wakeup;
+    std::thread worker;
+};
+
+#endif // PVA_ORBIT_HEALTH_H
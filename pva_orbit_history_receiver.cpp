@@ -0,0 +1,153 @@
+#include "pva_orbit_history_receiver.h"
+#include <algorithm>
+#include <pvxs/data.h>
+
+static const char* axis_prefix[NUM_AXES] = {"x", "y", "tmit"};
+
+template<typename T>
+static pvxs::shared_array<const T> to_array(const std::vector<T>& v) {
+    pvxs::shared_array<T> arr(v.size());
+    std::copy(v.begin(), v.end(), arr.begin());
+    return arr.freeze();
+}
+
+PVAOrbitHistoryReceiver::PVAOrbitHistoryReceiver(Orbit& orbit, size_t depth, QueuePolicy policy) :
+orbit(orbit),
+depth(depth),
+policy(policy),
+num_bpms(0u),
+num_pulses(0u)
+{
+    pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+    auto alarm_t = {
+        pvxs::members::Int32("severity"),
+        pvxs::members::Int32("status"),
+        pvxs::members::String("message"),
+    };
+
+    historyValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitHistory", {
+        pvxs::members::Struct("value", {
+            pvxs::members::StringA("device_name"),
+            pvxs::members::Float64A("z"),
+            pvxs::members::UInt32A("secondsPastEpoch"),
+            pvxs::members::UInt32A("nanoseconds"),
+            pvxs::members::Float64A("x_val"),
+            pvxs::members::UInt16A("x_severity"),
+            pvxs::members::UInt16A("x_status"),
+            pvxs::members::Float64A("y_val"),
+            pvxs::members::UInt16A("y_severity"),
+            pvxs::members::UInt16A("y_status"),
+            pvxs::members::Float64A("tmit_val"),
+            pvxs::members::UInt16A("tmit_severity"),
+            pvxs::members::UInt16A("tmit_status"),
+        }),
+        pvxs::members::UInt32A("dimension"),
+        pvxs::members::String("descriptor"),
+        pvxs::members::Struct("alarm", "alarm_t", alarm_t),
+        pvxs::members::Struct("timeStamp", "time_t", time_t),
+    }).create();
+    historyValue["descriptor"] = "LCLS Orbit History";
+    orbit.add_receiver(this);
+}
+
+PVAOrbitHistoryReceiver::~PVAOrbitHistoryReceiver() {
+    close();
+}
+
+void PVAOrbitHistoryReceiver::close() {
+    orbit.remove_receiver(this);
+    pv->close();
+}
+
+ReceiverOptions PVAOrbitHistoryReceiver::options() const {
+    return ReceiverOptions(16u, policy);
+}
+
+void PVAOrbitHistoryReceiver::setNames(const std::vector<std::string>& names) {
+    Guard G(mutex);
+    // Other BPMs, even as many as before: start a new block.
+    if (names != bpm_names) {
+        bpm_names = names;
+        num_bpms = 0u;
+        num_pulses = 0u;
+    }
+    pvxs::shared_array<std::string> ns(names.size());
+    for(size_t i=0, N=names.size(); i<N; i++) {
+        ns[i] = names[i];
+    }
+    historyValue["value.device_name"] = ns.freeze();
+}
+
+void PVAOrbitHistoryReceiver::setZs(const std::vector<double>& zs) {
+    Guard G(mutex);
+    pvxs::shared_array<double> z(zs.size());
+    for(size_t i=0, N=zs.size(); i<N; i++) {
+        z[i] = zs[i];
+    }
+    historyValue["value.z"] = z.freeze();
+}
+
+void PVAOrbitHistoryReceiver::setCompletedOrbit(const OrbitData& o) {
+    Guard G(mutex);
+    if (o.size() != num_bpms) {
+        //First orbit, or the BPM list changed: start a new block.
+        num_bpms = o.size();
+        num_pulses = 0u;
+        seconds.resize(depth);
+        nanoseconds.resize(depth);
+        for (size_t j=0; j<NUM_AXES; j++) {
+            value[j].resize(depth*num_bpms);
+            severity[j].resize(depth*num_bpms);
+            status[j].resize(depth*num_bpms);
+            last_value[j].assign(num_bpms, 0.0);
+        }
+    }
+    seconds[num_pulses] = o.ts.secPastEpoch;
+    nanoseconds[num_pulses] = o.ts.nsec;
+    const size_t row = num_pulses*num_bpms;
+    for (size_t j=0; j<NUM_AXES; j++) {
+        const std::vector<double>& val = o.value[j];
+        const std::vector<epicsUInt16>& sev = o.severity[j];
+        std::vector<double>& last = last_value[j];
+        double* out = &value[j][row];
+        //Values which did not arrive hold the last good reading.
+        for (size_t i=0; i<num_bpms; i++) {
+            if (sev[i] != MISSING_SEVERITY) {
+                last[i] = val[i];
+            }
+            out[i] = last[i];
+        }
+        std::copy(o.severity[j].begin(), o.severity[j].end(), severity[j].begin() + row);
+        std::copy(o.status[j].begin(), o.status[j].end(), status[j].begin() + row);
+    }
+    if (++num_pulses == depth) {
+        post();
+        num_pulses = 0u;
+    }
+}
+
+void PVAOrbitHistoryReceiver::post() {
+    historyValue["value.secondsPastEpoch"] = to_array(seconds);
+    historyValue["value.nanoseconds"] = to_array(nanoseconds);
+    for (size_t j=0; j<NUM_AXES; j++) {
+        const std::string prefix = std::string("value.") + axis_prefix[j];
+        historyValue[prefix + "_val"] = to_array(value[j]);
+        historyValue[prefix + "_severity"] = to_array(severity[j]);
+        historyValue[prefix + "_status"] = to_array(status[j]);
+    }
+    pvxs::shared_array<epicsUInt32> dims({epicsUInt32(depth), epicsUInt32(num_bpms)});
+    historyValue["dimension"] = dims.freeze();
+    historyValue["timeStamp.secondsPastEpoch"] = seconds[depth - 1u];
+    historyValue["timeStamp.nanoseconds"] = nanoseconds[depth - 1u];
+    if (!pv->isOpen()) {
+        pv->open(historyValue);
+    } else {
+        pv->post(historyValue);
+    }
+    historyValue.unmark();
+}
@@ -0,0 +1,46 @@
+#ifndef PVA_ORBIT_HISTORY_RECEIVER_H
+#define PVA_ORBIT_HISTORY_RECEIVER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+#include <pvxs/sharedArray.h>
+#include "orbit.h"
+
+// Collects completed orbits into blocks of 'depth' pulses and posts each
+// block as one update: per-pulse timestamps, plus pulses x BPMs matrices
+// (row-major, one row per pulse) for every column of the orbit table.
+// Only lossless if the orbit uses DELIVER_ALL.
+struct PVAOrbitHistoryReceiver : public Receiver
+{
+    PVAOrbitHistoryReceiver(Orbit& orbit, size_t depth, QueuePolicy policy = QUEUE_DROP_OLDEST);
+    virtual ~PVAOrbitHistoryReceiver();
+    Orbit& orbit;
+    const size_t depth;
+    const QueuePolicy policy;
+    std::shared_ptr<pvxs::server::SharedPV> pv;
+    epicsMutex mutex;
+    pvxs::Value historyValue;
+    void close();
+    virtual ReceiverOptions options() const;
+    virtual void setNames(const std::vector<std::string>& n);
+    virtual void setZs(const std::vector<double>& zs);
+    virtual void setCompletedOrbit(const OrbitData& o);
+private:
+    void post();
+    // the BPMs in the block
+    std::vector<std::string> bpm_names;
+    size_t num_bpms;
+    size_t num_pulses;
+    std::vector<epicsUInt32> seconds;
+    std::vector<epicsUInt32> nanoseconds;
+    std::array<std::vector<double>, NUM_AXES> value;
+    std::array<std::vector<epicsUInt16>, NUM_AXES> severity;
+    std::array<std::vector<epicsUInt16>, NUM_AXES> status;
+    // the last good reading of each BPM, held across blocks
+    std::array<std::vector<double>, NUM_AXES> last_value;
+};
+
+#endif // PVA_ORBIT_HISTORY_RECEIVER_H
@@ -0,0 +1,95 @@
+#include "pva_orbit_lateness.h"
+#include <algorithm>
+#include <pvxs/data.h>
+#include <pvxs/sharedArray.h>
+
+static const char* axis_prefix[NUM_AXES] = {"value.x", "value.y", "value.tmit"};
+
+template<typename T>
+static pvxs::shared_array<const T> to_array(const std::vector<T>& v) {
+    pvxs::shared_array<T> arr(v.size());
+    std::copy(v.begin(), v.end(), arr.begin());
+    return arr.freeze();
+}
+
+PVAOrbitLateness::PVAOrbitLateness(Orbit& orbit, double period) :
+orbit(orbit),
+period(period),
+running(true)
+{
+    pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+
+    latenessValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitLateness", {
+        pvxs::members::StringA("labels"),
+        pvxs::members::Struct("value", {
+            pvxs::members::StringA("device_name"),
+            pvxs::members::Float64A("x_median_us"),
+            pvxs::members::Float64A("x_p99_us"),
+            pvxs::members::UInt64A("x_last"),
+            pvxs::members::Float64A("y_median_us"),
+            pvxs::members::Float64A("y_p99_us"),
+            pvxs::members::UInt64A("y_last"),
+            pvxs::members::Float64A("tmit_median_us"),
+            pvxs::members::Float64A("tmit_p99_us"),
+            pvxs::members::UInt64A("tmit_last"),
+        }),
+        pvxs::members::String("descriptor"),
+        pvxs::members::Struct("timeStamp", "time_t", time_t),
+    }).create();
+    pvxs::shared_array<std::string> labels({"device_name", "x_median_us", "x_p99_us", "x_last", "y_median_us", "y_p99_us", "y_last", "tmit_median_us", "tmit_p99_us", "tmit_last"});
+    latenessValue["labels"] = labels.freeze();
+    latenessValue["descriptor"] = "LCLS Orbit BPM Lateness";
+    post();
+    worker = std::thread(&PVAOrbitLateness::run, this);
+}
+
+PVAOrbitLateness::~PVAOrbitLateness() {
+    close();
+}
+
+void PVAOrbitLateness::close() {
+    running = false;
+    wakeup.signal();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    pv->close();
+}
+
+void PVAOrbitLateness::run() {
+    while (running) {
+        wakeup.wait(period);
+        if (running) {
+            post();
+        }
+    }
+}
+
+void PVAOrbitLateness::post() {
+    const OrbitLateness l(orbit.lateness());
+    if (l.names != names || !pv->isOpen()) {
+        names = l.names;
+        latenessValue["value.device_name"] = to_array(names);
+    }
+    for (size_t j=0; j<NUM_AXES; j++) {
+        const std::string prefix(axis_prefix[j]);
+        latenessValue[prefix + "_median_us"] = to_array(l.median_us[j]);
+        latenessValue[prefix + "_p99_us"] = to_array(l.p99_us[j]);
+        latenessValue[prefix + "_last"] = to_array(l.last[j]);
+    }
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    latenessValue["timeStamp.secondsPastEpoch"] = now.secPastEpoch;
+    latenessValue["timeStamp.nanoseconds"] = now.nsec;
+    if (!pv->isOpen()) {
+        pv->open(latenessValue);
+    } else {
+        pv->post(latenessValue);
+    }
+    latenessValue.unmark();
+}
@@ -0,0 +1,38 @@
+#ifndef PVA_ORBIT_LATENESS_H
+#define PVA_ORBIT_LATENESS_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+#include <epicsEvent.h>
+#include "orbit.h"
+
+// Posts a table of how late each BPM axis reports relative to the first
+// value of the same pulse (median and p99 over recent pulses, in
+// microseconds), and how many pulses each was the last to arrive for,
+// every 'period' seconds.  The BPMs at the top of the 'last' columns are
+// the ones setting the orbit's latency.
+struct PVAOrbitLateness
+{
+    PVAOrbitLateness(Orbit& orbit, double period = 1.0);
+    ~PVAOrbitLateness();
+    Orbit& orbit;
+    const double period;
+    std::shared_ptr<pvxs::server::SharedPV> pv;
+    pvxs::Value latenessValue;
+    void close();
+private:
+    void run();
+    void post();
+    // BPMs last posted, which change when the orbit's list is reloaded
+    std::vector<std::string> names;
+    std::atomic<bool> running;
+    epicsEvent wakeup;
+    std::thread worker;
+};
+
+#endif // PVA_ORBIT_LATENESS_H
@@ -0,0 +1,137 @@
+#include "pva_orbit_mia.h"
+#include <algorithm>
+#include <pvxs/data.h>
+#include <pvxs/sharedArray.h>
+
+static const char* plane_prefix[2] = {"value.x", "value.y"};
+
+template<typename T>
+static pvxs::shared_array<const T> to_array(const std::vector<T>& v) {
+    pvxs::shared_array<T> arr(v.size());
+    std::copy(v.begin(), v.end(), arr.begin());
+    return arr.freeze();
+}
+
+PVAOrbitMIA::PVAOrbitMIA(Orbit& orbit, size_t window, size_t modes, size_t threads, double period, QueuePolicy policy) :
+orbit(orbit),
+period(period),
+policy(policy),
+layouts(0u),
+mia(window, modes, threads),
+running(true)
+{
+    pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+
+    miaValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitMIA", {
+        pvxs::members::Struct("value", {
+            pvxs::members::StringA("device_name"),
+            pvxs::members::UInt32A("secondsPastEpoch"),
+            pvxs::members::UInt32A("nanoseconds"),
+            pvxs::members::Float64A("x_singular_values"),
+            pvxs::members::Float64A("x_spatial"),
+            pvxs::members::Float64A("x_temporal"),
+            pvxs::members::Float64A("x_correlation"),
+            pvxs::members::Float64A("y_singular_values"),
+            pvxs::members::Float64A("y_spatial"),
+            pvxs::members::Float64A("y_temporal"),
+            pvxs::members::Float64A("y_correlation"),
+        }),
+        pvxs::members::UInt32("window"),
+        pvxs::members::UInt32("pulses"),
+        pvxs::members::UInt32("modes"),
+        pvxs::members::String("descriptor"),
+        pvxs::members::Struct("timeStamp", "time_t", time_t),
+    }).create();
+    miaValue["descriptor"] = "LCLS Orbit Model-Independent Analysis";
+    miaValue["window"] = epicsUInt32(mia.window());
+    orbit.add_receiver(this);
+    worker = std::thread(&PVAOrbitMIA::run, this);
+}
+
+PVAOrbitMIA::~PVAOrbitMIA() {
+    close();
+}
+
+void PVAOrbitMIA::close() {
+    orbit.remove_receiver(this);
+    running = false;
+    wakeup.signal();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    pv->close();
+}
+
+ReceiverOptions PVAOrbitMIA::options() const {
+    return ReceiverOptions(16u, policy);
+}
+
+void PVAOrbitMIA::setNames(const std::vector<std::string>& names) {
+    Guard G(mutex);
+    // Other BPMs, even as many as before: the window starts again, and an
+    // analysis of the old one isn't posted.
+    if (names != bpm_names) {
+        bpm_names = names;
+        mia.clear();
+        layouts++;
+    }
+    miaValue["value.device_name"] = to_array(names);
+}
+
+void PVAOrbitMIA::setZs(const std::vector<double>& zs) {
+}
+
+void PVAOrbitMIA::setCompletedOrbit(const OrbitData& o) {
+    Guard G(mutex);
+    mia.add(o);
+}
+
+void PVAOrbitMIA::run() {
+    while (running) {
+        wakeup.wait(period);
+        bool ready;
+        size_t snapped;
+        {
+            Guard G(mutex);
+            ready = running && mia.snapshot();
+            snapped = layouts;
+        }
+        if (ready) {
+            mia.analyse(result);
+            post(snapped);
+        }
+    }
+}
+
+// Post the analysis of a snapshot taken with 'snapped' layouts seen.
+void PVAOrbitMIA::post(size_t snapped) {
+    Guard G(mutex);
+    if (snapped != layouts) {
+        return;
+    }
+    for (size_t j=0; j<2u; j++) {
+        const std::string prefix(plane_prefix[j]);
+        const MIAPlane& plane = result.planes[j];
+        miaValue[prefix + "_singular_values"] = to_array(plane.singular_values);
+        miaValue[prefix + "_spatial"] = to_array(plane.spatial);
+        miaValue[prefix + "_temporal"] = to_array(plane.temporal);
+        miaValue[prefix + "_correlation"] = to_array(plane.correlation);
+    }
+    miaValue["value.secondsPastEpoch"] = to_array(result.seconds);
+    miaValue["value.nanoseconds"] = to_array(result.nanoseconds);
+    miaValue["pulses"] = epicsUInt32(result.pulses);
+    miaValue["modes"] = epicsUInt32(result.modes);
+    miaValue["timeStamp.secondsPastEpoch"] = result.ts.secPastEpoch;
+    miaValue["timeStamp.nanoseconds"] = result.ts.nsec;
+    if (!pv->isOpen()) {
+        pv->open(miaValue);
+    } else {
+        pv->post(miaValue);
+    }
+    miaValue.unmark();
+}
@@ -0,0 +1,49 @@
+#ifndef PVA_ORBIT_MIA_H
+#define PVA_ORBIT_MIA_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+#include <epicsEvent.h>
+#include "orbit.h"
+#include "orbit_mia.h"
+
+// Keeps the last 'window' orbits and every 'period' seconds posts, for X
+// and Y, the BPM correlation matrix and the leading 'modes' singular values
+// with their spatial and temporal vectors.  Orbits are only copied in as
+// they arrive; the analysis runs on a thread of its own (and 'threads'-1
+// helpers), so however long it takes it can't hold up assembly.  Sees
+// every orbit only if the orbit uses DELIVER_ALL.
+struct PVAOrbitMIA : public Receiver
+{
+    PVAOrbitMIA(Orbit& orbit, size_t window, size_t modes, size_t threads, double period = 5.0, QueuePolicy policy = QUEUE_DROP_OLDEST);
+    virtual ~PVAOrbitMIA();
+    Orbit& orbit;
+    const double period;
+    const QueuePolicy policy;
+    std::shared_ptr<pvxs::server::SharedPV> pv;
+    pvxs::Value miaValue;
+    void close();
+    virtual ReceiverOptions options() const;
+    virtual void setNames(const std::vector<std::string>& n);
+    virtual void setZs(const std::vector<double>& zs);
+    virtual void setCompletedOrbit(const OrbitData& o);
+private:
+    void run();
+    void post(size_t snapped);
+    epicsMutex mutex;
+    // the BPMs in the window, and how many lists there have been
+    std::vector<std::string> bpm_names;
+    size_t layouts;
+    OrbitMIA mia;
+    MIAResult result;
+    std::atomic<bool> running;
+    epicsEvent wakeup;
+    std::thread worker;
+};
+
+#endif // PVA_ORBIT_MIA_H
@@ -0,0 +1,157 @@
+#include "pva_orbit_packed.h"
+#include <pvxs/data.h>
+#include <algorithm>
+
+PVAOrbitPackedReceiver::PVAOrbitPackedReceiver(Orbit& orbit, PackedPrecision precision, QueuePolicy policy) :
+orbit(orbit),
+precision(precision),
+policy(policy),
+initialized(false),
+incomplete(false)
+{
+    pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+    auto alarm_t = {
+        pvxs::members::Int32("severity"),
+        pvxs::members::Int32("status"),
+        pvxs::members::String("message"),
+    };
+
+    orbitValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitMatrix", {
+        pvxs::members::StringA("labels"),
+        pvxs::members::Struct("value", {
+            pvxs::members::StringA("device_name"),
+            pvxs::members::Float64A("z"),
+            precision == PACKED_FLOAT32 ? pvxs::members::Float32A("val") : pvxs::members::Float64A("val"),
+            pvxs::members::UInt16A("status"),
+        }),
+        pvxs::members::UInt32A("dimension"),
+        pvxs::members::String("descriptor"),
+        pvxs::members::Struct("alarm", "alarm_t", alarm_t),
+        pvxs::members::Struct("timeStamp", "time_t", time_t),
+    }).create();
+    pvxs::shared_array<std::string> labels({"x", "y", "tmit"});
+    orbitValue["labels"] = labels.freeze();
+    orbitValue["descriptor"] = "LCLS Orbit Data, packed";
+    orbit.add_receiver(this);
+}
+
+PVAOrbitPackedReceiver::~PVAOrbitPackedReceiver() {
+    close();
+}
+
+void PVAOrbitPackedReceiver::close() {
+    orbit.remove_receiver(this);
+    pv->close();
+}
+
+ReceiverOptions PVAOrbitPackedReceiver::options() const {
+    return ReceiverOptions(16u, policy);
+}
+
+void PVAOrbitPackedReceiver::setNames(const std::vector<std::string>& names) {
+    Guard G(mutex);
+    pvxs::shared_array<std::string> ns(names.size());
+    std::copy(names.begin(), names.end(), ns.begin());
+    device_names = ns.freeze();
+    orbitValue["value.device_name"] = device_names;
+    // The held values belong to the old BPMs, even if there are as many
+    // new ones: start over at the next orbit.
+    for (size_t j=0; j<NUM_AXES; j++) {
+        last_value[j].clear();
+    }
+    last_status.clear();
+    initialized = false;
+}
+
+void PVAOrbitPackedReceiver::setZs(const std::vector<double>& zs) {
+    Guard G(mutex);
+    pvxs::shared_array<double> z(zs.size());
+    std::copy(zs.begin(), zs.end(), z.begin());
+    z_vals = z.freeze();
+    orbitValue["value.z"] = z_vals;
+    initialized = false;
+}
+
+// Interleave the X, Y and TMIT columns into rows of three.
+template<typename T>
+static pvxs::shared_array<const T> pack(ColumnPool<T>& pool, const std::array<std::vector<double>, NUM_AXES>& cols) {
+    pvxs::shared_array<T> m(pool.get());
+    T* __restrict__ out = m.data();
+    const double* __restrict__ x = cols[AXIS_X].data();
+    const double* __restrict__ y = cols[AXIS_Y].data();
+    const double* __restrict__ tmit = cols[AXIS_TMIT].data();
+    for (size_t i=0, N=cols[AXIS_X].size(); i<N; i++) {
+        out[3*i] = T(x[i]);
+        out[3*i + 1] = T(y[i]);
+        out[3*i + 2] = T(tmit[i]);
+    }
+    return m.freeze();
+}
+
+void PVAOrbitPackedReceiver::setCompletedOrbit(const OrbitData& o) {
+    Guard G(mutex);
+    const size_t N = o.size();
+    if (last_value[AXIS_X].size() != N) {
+        for (size_t j=0; j<NUM_AXES; j++) {
+            last_value[j].assign(N, 0.0);
+        }
+        status.assign(NUM_AXES*N, 0u);
+        last_status.clear();
+        double_pool.resize(NUM_AXES*N);
+        float_pool.resize(NUM_AXES*N);
+        status_pool.resize(NUM_AXES*N);
+        initialized = false;
+    }
+    pvxs::Value update(orbitValue.cloneEmpty());
+    for (size_t j=0; j<NUM_AXES; j++) {
+        const std::vector<double>& value = o.value[j];
+        const std::vector<epicsUInt16>& severity = o.severity[j];
+        const std::vector<epicsUInt16>& stat = o.status[j];
+        std::vector<double>& last = last_value[j];
+        //Values which did not arrive hold the last good reading.
+        for (size_t i=0; i<N; i++) {
+            if (severity[i] != MISSING_SEVERITY) {
+                last[i] = value[i];
+            }
+            status[NUM_AXES*i + j] = epicsUInt16(severity[i] | (stat[i] << 8));
+        }
+    }
+    if (precision == PACKED_FLOAT32) {
+        update["value.val"] = pack(float_pool, last_value);
+    } else {
+        update["value.val"] = pack(double_pool, last_value);
+    }
+    if (!initialized || status != last_status) {
+        pvxs::shared_array<epicsUInt16> s(status_pool.get());
+        std::copy(status.begin(), status.end(), s.begin());
+        update["value.status"] = s.freeze();
+        last_status = status;
+    }
+    if (!initialized) {
+        update["value.device_name"] = device_names;
+        update["value.z"] = z_vals;
+        pvxs::shared_array<epicsUInt32> dim({epicsUInt32(N), epicsUInt32(NUM_AXES)});
+        update["dimension"] = dim.freeze();
+    }
+    //Orbits published before every BPM reported raise a minor alarm.
+    if (!initialized || o.complete == incomplete) {
+        incomplete = !o.complete;
+        update["alarm.severity"] = incomplete ? 1 : 0;
+        update["alarm.message"] = incomplete ? "Incomplete" : "";
+    }
+    update["timeStamp.secondsPastEpoch"] = o.ts.secPastEpoch;
+    update["timeStamp.nanoseconds"] = o.ts.nsec;
+    if (!pv->isOpen()) {
+        orbitValue.assign(update);
+        pv->open(orbitValue);
+        orbitValue.unmark();
+    } else {
+        pv->post(update);
+    }
+    initialized = true;
+}
@@ -0,0 +1,50 @@
+#ifndef PVA_ORBIT_PACKED_H
+#define PVA_ORBIT_PACKED_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+#include <pvxs/sharedArray.h>
+#include "orbit.h"
+#include "column_pool.h"
+
+enum PackedPrecision {PACKED_FLOAT64, PACKED_FLOAT32};
+
+// Posts each orbit as two matrices instead of nine columns: value.val, BPMs
+// x 3 (X, Y, TMIT) row-major, as float64 or float32, and value.status, the
+// same shape of uint16, each the severity plus 256 times the status.  A
+// client gets an orbit with one copy, into an array of dimension[0] rows of
+// three.  Like PVAOrbitReceiver, missing values hold their last good value,
+// and value.status, device_name and z are only sent when they change.
+struct PVAOrbitPackedReceiver : public Receiver
+{
+    PVAOrbitPackedReceiver(Orbit& orbit, PackedPrecision precision = PACKED_FLOAT64, QueuePolicy policy = QUEUE_DROP_OLDEST);
+    virtual ~PVAOrbitPackedReceiver();
+    Orbit& orbit;
+    const PackedPrecision precision;
+    const QueuePolicy policy;
+    std::shared_ptr<pvxs::server::SharedPV> pv;
+    epicsMutex mutex;
+    pvxs::Value orbitValue;
+    void close();
+    virtual ReceiverOptions options() const;
+    virtual void setNames(const std::vector<std::string>& n);
+    virtual void setZs(const std::vector<double>& zs);
+    virtual void setCompletedOrbit(const OrbitData& o);
+private:
+    bool initialized;
+    bool incomplete;
+    // last good value of every entry, and the status matrix as last posted
+    std::array<std::vector<double>, NUM_AXES> last_value;
+    std::vector<epicsUInt16> status, last_status;
+    // as last set, sent again after a reload
+    pvxs::shared_array<const std::string> device_names;
+    pvxs::shared_array<const double> z_vals;
+    ColumnPool<double> double_pool;
+    ColumnPool<float> float_pool;
+    ColumnPool<epicsUInt16> status_pool;
+};
+
+#endif // PVA_ORBIT_PACKED_H
@@ -1,12 +1,15 @@
 #include "pva_orbit_receiver.h"
-#include <pv/sharedVector.h>
 #include <pvxs/data.h>
-#include <db_access.h>
+#include <algorithm>
 
 
-PVAOrbitReceiver::PVAOrbitReceiver(Orbit& orbit) :
+PVAOrbitReceiver::PVAOrbitReceiver(Orbit& orbit, QueuePolicy policy, bool final, size_t every) :
 orbit(orbit),
-initialized(false)
+policy(policy),
+final(final),
+every(every),
+initialized(false),
+incomplete(false)
 {
     pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
     auto time_t = {
@@ -56,113 +59,106 @@ void PVAOrbitReceiver::close() {
     pv->close();
 }
 
+ReceiverOptions PVAOrbitReceiver::options() const {
+    return ReceiverOptions(16u, policy, final, every);
+}
+
+// The names and z go out with the next update, and clients get every
+// column in full again, since the BPMs may have changed.
 void PVAOrbitReceiver::setNames(const std::vector<std::string>& names) {
+    Guard G(mutex);
     pvxs::shared_array<std::string> ns(names.size());
     for(size_t i=0, N=names.size(); i<N; i++) {
         ns[i] = names[i];
     }
-    orbitValue["value.device_name"] = ns.freeze();
+    _names = ns.freeze();
+    orbitValue["value.device_name"] = _names;
+    // The held values belong to the old BPMs, even if there are as many
+    // new ones: start over at the next orbit.
+    for (size_t j=0; j<NUM_AXES; j++) {
+        last_value[j].clear();
+        last_severity[j].clear();
+        last_status[j].clear();
+    }
+    initialized = false;
 }
 
 void PVAOrbitReceiver::setZs(const std::vector<double>& zs) {
+    Guard G(mutex);
     pvxs::shared_array<double> z(zs.size());
     for(size_t i=0, N=zs.size(); i<N; i++) {
         z[i] = zs[i];
     }
-    orbitValue["value.z"] = z.freeze();
+    _zs = z.freeze();
+    orbitValue["value.z"] = _zs;
+    initialized = false;
 }
 
+static const char* axis_prefix[NUM_AXES] = {"value.x", "value.y", "value.tmit"};
+
+// Post an alarm column only if it differs from what was last posted.
+void PVAOrbitReceiver::postColumn(pvxs::Value& update, const std::string& field, const std::vector<epicsUInt16>& col, std::vector<epicsUInt16>& last) {
+    if (initialized && col == last) {
+        return;
+    }
+    pvxs::shared_array<uint16_t> arr(alarm_pool.get());
+    std::copy(col.begin(), col.end(), arr.begin());
+    update[field] = arr.freeze();
+    last = col;
+}
+
+// Each update carries only the columns which changed, in buffers recycled
+// from earlier posts.  The names, z and labels are sent with the first
+// update, and again only when the BPMs are reloaded.
 void PVAOrbitReceiver::setCompletedOrbit(const OrbitData& o) {
     Guard G(mutex);
-    pvxs::shared_array<double> x_val(o.values.size());
-    pvxs::shared_array<uint16_t> x_severity(o.values.size());
-    pvxs::shared_array<uint16_t> x_status(o.values.size());
-    pvxs::shared_array<double> y_val(o.values.size());
-    pvxs::shared_array<uint16_t> y_severity(o.values.size());
-    pvxs::shared_array<uint16_t> y_status(o.values.size());
-    pvxs::shared_array<double> tmit_val(o.values.size());
-    pvxs::shared_array<uint16_t> tmit_severity(o.values.size());
-    pvxs::shared_array<uint16_t> tmit_status(o.values.size());
-    pvxs::shared_array<const double> last_xval(o.values.size());
-    pvxs::shared_array<const double> last_yval(o.values.size());
-    pvxs::shared_array<const double> last_tmitval(o.values.size());
-    if (initialized) {
-        last_xval = orbitValue["value"]["x_val"].as<pvxs::shared_array<const double>>();
-        last_yval = orbitValue["value"]["y_val"].as<pvxs::shared_array<const double>>();
-        last_tmitval = orbitValue["value"]["tmit_val"].as<pvxs::shared_array<const double>>();
-    }
-    for (size_t i=0, N=o.values.size(); i<N; i++) {
-        DBRValue xval = o.values[i][0];
-        if (xval.valid() && xval->sevr != 4) {
-            assert(xval->count == 1);
-            const epics::pvData::shared_vector<const double>& xval_float_buffer(epics::pvData::static_shared_vector_cast<const double>(xval->buffer));
-            x_val[i] = xval_float_buffer[0];
-            x_severity[i] = xval->sevr;
-            x_status[i]= xval->stat;
-        } else {
-            x_val[i] = last_xval.at(i);
-            x_severity[i] = 4;
+    const size_t N = o.size();
+    if (last_value[AXIS_X].size() != N) {
+        for (size_t j=0; j<NUM_AXES; j++) {
+            last_value[j].assign(N, 0.0);
+            last_severity[j].clear();
+            last_status[j].clear();
         }
-        
-        DBRValue yval = o.values[i][1];
-        if (yval.valid() && yval->sevr != 4) {
-            assert(yval->count == 1);
-            const epics::pvData::shared_vector<const double>& yval_float_buffer(epics::pvData::static_shared_vector_cast<const double>(yval->buffer));
-            y_val[i] = yval_float_buffer[0];
-            y_severity[i] = yval->sevr;
-            y_status[i]= yval->stat;
-        } else {
-            y_val[i] = last_yval.at(i);
-            y_severity[i] = 4;
-        }
-        
-        DBRValue tmitval = o.values[i][2];
-        if (tmitval.valid() && tmitval->sevr != 4) {
-            assert(tmitval->count == 1);
-            const epics::pvData::shared_vector<const double>& tmitval_float_buffer(epics::pvData::static_shared_vector_cast<const double>(tmitval->buffer));
-            tmit_val[i] = tmitval_float_buffer[0];
-            tmit_severity[i] = tmitval->sevr;
-            tmit_status[i]= tmitval->stat;
-        } else {
-            tmit_val[i] = last_tmitval.at(i);
-            tmit_severity[i] = 4;
-        }
-        
+        value_pool.resize(N);
+        alarm_pool.resize(N);
+        initialized = false;
     }
-    orbitValue["value.x_val"] = x_val.freeze();
-    orbitValue["value.x_val"].mark();
-    orbitValue["value.x_severity"] = x_severity.freeze();
-    orbitValue["value.x_severity"].mark();
-    orbitValue["value.x_status"] = x_status.freeze();
-    orbitValue["value.x_status"].mark();
-    
-    orbitValue["value.y_val"] = y_val.freeze();
-    orbitValue["value.y_val"].mark();
-    orbitValue["value.y_severity"] = y_severity.freeze();
-    orbitValue["value.y_severity"].mark();
-    orbitValue["value.y_status"] = y_status.freeze();
-    orbitValue["value.y_status"].mark();
-    
-    orbitValue["value.tmit_val"] = tmit_val.freeze();
-    orbitValue["value.tmit_val"].mark();
-    orbitValue["value.tmit_severity"] = tmit_severity.freeze();
-    orbitValue["value.tmit_severity"].mark();
-    orbitValue["value.tmit_status"] = tmit_status.freeze();
-    orbitValue["value.tmit_status"].mark();
-    
-    orbitValue["timeStamp.secondsPastEpoch"] = o.ts.secPastEpoch;
-    orbitValue["timeStamp.secondsPastEpoch"].mark();
-    orbitValue["timeStamp.nanoseconds"] = o.ts.nsec;
-    orbitValue["timeStamp.nanoseconds"].mark();
-    auto newOrbitValue = orbitValue.clone();
-    {
-        if (!pv->isOpen()) {
-            pv->open(std::move(newOrbitValue));
-        } else {
-            pv->post(std::move(newOrbitValue));
+    pvxs::Value update(orbitValue.cloneEmpty());
+    if (!initialized) {
+        update["value.device_name"] = _names;
+        update["value.z"] = _zs;
+    }
+    for (size_t j=0; j<NUM_AXES; j++) {
+        const std::string prefix(axis_prefix[j]);
+        const std::vector<double>& value = o.value[j];
+        const std::vector<epicsUInt16>& severity = o.severity[j];
+        std::vector<double>& last = last_value[j];
+        pvxs::shared_array<double> val(value_pool.get());
+        //Values which did not arrive hold the last good reading.
+        for (size_t i=0; i<N; i++) {
+            if (severity[i] != MISSING_SEVERITY) {
+                last[i] = value[i];
+            }
+            val[i] = last[i];
         }
+        update[prefix + "_val"] = val.freeze();
+        postColumn(update, prefix + "_severity", severity, last_severity[j]);
+        postColumn(update, prefix + "_status", o.status[j], last_status[j]);
+    }
+    //Orbits published before every BPM reported raise a minor alarm.
+    if (!initialized || o.complete == incomplete) {
+        incomplete = !o.complete;
+        update["alarm.severity"] = incomplete ? 1 : 0;
+        update["alarm.message"] = incomplete ? "Incomplete" : "";
+    }
+    update["timeStamp.secondsPastEpoch"] = o.ts.secPastEpoch;
+    update["timeStamp.nanoseconds"] = o.ts.nsec;
+    if (!pv->isOpen()) {
+        orbitValue.assign(update);
+        pv->open(orbitValue);
+        orbitValue.unmark();
+    } else {
+        pv->post(update);
     }
     initialized = true;
-    orbitValue.unmark(); //Set all fields to unchanged in preparation for the next update.
-    
 }
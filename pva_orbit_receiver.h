@@ -9,25 +9,43 @@
 #include <pvxs/sharedArray.h>
 #include <pvxs/nt.h>
 #include "orbit.h"
+#include "column_pool.h"
 
 struct PVAOrbitReceiver : public Receiver
 {
     static size_t num_instances;
-    PVAOrbitReceiver(Orbit& orbit);
+    // 'final' posts corrected orbits of pulses published at their deadline,
+    // instead of the normal stream.  'every' posts only every so many orbits.
+    PVAOrbitReceiver(Orbit& orbit, QueuePolicy policy = QUEUE_DROP_OLDEST, bool final = false, size_t every = 1u);
     virtual ~PVAOrbitReceiver();
     Orbit& orbit;
+    // what to do when posting falls behind assembly
+    const QueuePolicy policy;
+    const bool final;
+    const size_t every;
     std::shared_ptr<pvxs::server::SharedPV> pv;
     epicsMutex mutex;
     pvxs::Value orbitValue;
     void close();
+    virtual ReceiverOptions options() const;
     virtual void setNames(const std::vector<std::string>& n);
     virtual void setZs(const std::vector<double>& zs);
     virtual void setCompletedOrbit(const OrbitData& o);
 private:
-    pvxs::shared_array<std::string> _names;
-    pvxs::shared_array<double> _zs;
+    // as last set, for re-posting after a reload
+    pvxs::shared_array<const std::string> _names;
+    pvxs::shared_array<const double> _zs;
     bool initialized;
-    OrbitData publishedOrbit;
+    // whether the alarm last posted marked the orbit incomplete
+    bool incomplete;
+    // Last good value of every entry, held for entries which go missing,
+    // and the severity and status columns as last posted.
+    std::array<std::vector<double>, NUM_AXES> last_value;
+    std::array<std::vector<epicsUInt16>, NUM_AXES> last_severity;
+    std::array<std::vector<epicsUInt16>, NUM_AXES> last_status;
+    ColumnPool<double> value_pool;
+    ColumnPool<uint16_t> alarm_pool;
+    void postColumn(pvxs::Value& update, const std::string& field, const std::vector<epicsUInt16>& col, std::vector<epicsUInt16>& last);
 };
 
 
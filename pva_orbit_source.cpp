@@ -0,0 +1,499 @@
+#include "pva_orbit_source.h"
+#include <pvxs/data.h>
+#include <pvxs/nt.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+
+static const char* column_field[PVAOrbitSource::NUM_COLUMNS] = {
+    "value.device_name", "value.z",
+    "value.x_val", "value.x_severity", "value.x_status",
+    "value.y_val", "value.y_severity", "value.y_status",
+    "value.tmit_val", "value.tmit_severity", "value.tmit_status",
+};
+
+static const unsigned ALL_COLUMNS = (1u << PVAOrbitSource::NUM_COLUMNS) - 1u;
+
+static const size_t NEVER = SIZE_MAX;
+
+PVAOrbitSource::PVAOrbitSource(Orbit& orbit, const std::string& pvname, QueuePolicy policy) :
+orbit(orbit),
+pvname(pvname),
+policy(policy),
+have_orbit(false),
+incomplete(false)
+{
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+    auto alarm_t = {
+        pvxs::members::Int32("severity"),
+        pvxs::members::Int32("status"),
+        pvxs::members::String("message"),
+    };
+
+    tableValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitTable", {
+        pvxs::members::StringA("labels"),
+        pvxs::members::Struct("value", {
+            pvxs::members::StringA("device_name"),
+            pvxs::members::Float64A("z"),
+            pvxs::members::Float64A("x_val"),
+            pvxs::members::UInt16A("x_severity"),
+            pvxs::members::UInt16A("x_status"),
+            pvxs::members::Float64A("y_val"),
+            pvxs::members::UInt16A("y_severity"),
+            pvxs::members::UInt16A("y_status"),
+            pvxs::members::Float64A("tmit_val"),
+            pvxs::members::UInt16A("tmit_severity"),
+            pvxs::members::UInt16A("tmit_status"),
+        }),
+        pvxs::members::String("descriptor"),
+        pvxs::members::Struct("alarm", "alarm_t", alarm_t),
+        pvxs::members::Struct("timeStamp", "time_t", time_t),
+    }).create();
+    pvxs::shared_array<std::string> labels({"device_name", "z", "x_val", "x_severity", "x_status", "x_ts_seconds", "x_ts_nanos", "y_val", "y_severity", "y_status", "y_ts_seconds", "y_ts_nanos", "tmit_val", "tmit_severity", "tmit_status", "tmit_ts_seconds", "tmit_ts_nanos"});
+    tableValue["labels"] = labels.freeze();
+    tableValue["descriptor"] = "LCLS Orbit Data";
+    generation.fill(0u);
+    orbit.add_receiver(this);
+}
+
+PVAOrbitSource::~PVAOrbitSource() {
+    close();
+}
+
+void PVAOrbitSource::close() {
+    orbit.remove_receiver(this);
+    std::set<std::shared_ptr<pvxs::server::ChannelControl>> open;
+    {
+        Guard G(mutex);
+        open.swap(channels);
+    }
+    for (auto it = open.begin(); it != open.end(); ++it) {
+        (*it)->close();
+    }
+}
+
+ReceiverOptions PVAOrbitSource::options() const {
+    return ReceiverOptions(16u, policy);
+}
+
+// The area of a BPM, the second part of its name (LTUH in BPMS:LTUH:250).
+static std::string area_of(const std::string& name) {
+    size_t start = name.find(':');
+    if (start == std::string::npos) {
+        return std::string();
+    }
+    start++;
+    size_t end = name.find(':', start);
+    return name.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+bool PVAOrbitSource::Request::selects(const std::string& name, double z) const {
+    if (!bpms.empty() && bpms.count(name) == 0u) {
+        return false;
+    }
+    if (!regions.empty() && std::find(regions.begin(), regions.end(), area_of(name)) == regions.end()) {
+        return false;
+    }
+    //A BPM without a known z never falls within a range.
+    if ((zmin > -HUGE_VAL || zmax < HUGE_VAL) && !(z >= zmin && z <= zmax)) {
+        return false;
+    }
+    return true;
+}
+
+bool PVAOrbitSource::Request::everything() const {
+    return bpms.empty() && regions.empty() && zmin == -HUGE_VAL && zmax == HUGE_VAL;
+}
+
+static std::vector<std::string> split_list(const std::string& s) {
+    std::vector<std::string> out;
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find('|', start);
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+        if (end > start) {
+            out.push_back(s.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return out;
+}
+
+static bool has_children(const pvxs::Value& v) {
+    for (auto child : v.ichildren()) {
+        (void)child;
+        return true;
+    }
+    return false;
+}
+
+bool PVAOrbitSource::parseRequest(const pvxs::Value& pvRequest, Request& request, std::string& error) const {
+    std::string opt;
+    request.zmin = -HUGE_VAL;
+    request.zmax = HUGE_VAL;
+    request.decimate = 1u;
+    request.columns = ALL_COLUMNS;
+    if (pvRequest["record._options.bpms"].as(opt)) {
+        std::vector<std::string> bpms(split_list(opt));
+        request.bpms.insert(bpms.begin(), bpms.end());
+    }
+    if (pvRequest["record._options.regions"].as(opt)) {
+        request.regions = split_list(opt);
+    }
+    const char* zopts[2] = {"record._options.zmin", "record._options.zmax"};
+    double* zs[2] = {&request.zmin, &request.zmax};
+    for (size_t k=0; k<2; k++) {
+        if (pvRequest[zopts[k]].as(opt)) {
+            char* end;
+            *zs[k] = strtod(opt.c_str(), &end);
+            if (opt.empty() || *end != '\0') {
+                error = std::string("Bad ") + (k == 0 ? "zmin" : "zmax") + ": " + opt;
+                return false;
+            }
+        }
+    }
+    if (pvRequest["record._options.decimate"].as(opt)) {
+        char* end;
+        long n = strtol(opt.c_str(), &end, 10);
+        if (opt.empty() || *end != '\0' || n < 1) {
+            error = "Bad decimate: " + opt;
+            return false;
+        }
+        request.decimate = size_t(n);
+    }
+    //field(value.x_val,...) limits the columns, field(value) or none means all.
+    const pvxs::Value field(pvRequest["field"]);
+    if (field.valid() && has_children(field)) {
+        const pvxs::Value value(field["value"]);
+        if (!value.valid()) {
+            request.columns = 0u;
+        } else if (has_children(value)) {
+            request.columns = 0u;
+            for (auto child : value.ichildren()) {
+                const std::string name("value." + value.nameOf(child));
+                for (unsigned col=0; col<NUM_COLUMNS; col++) {
+                    if (name == column_field[col]) {
+                        request.columns |= 1u << col;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// The group for the BPMs a request selects, which is new, and not yet in
+// 'groups', if no subscriber selects them already.
+std::shared_ptr<PVAOrbitSource::Group> PVAOrbitSource::findGroup(const Request& request) {
+    bool all = request.everything();
+    std::vector<size_t> bpms;
+    if (!all) {
+        for (size_t i=0, N=names.size(); i<N; i++) {
+            if (request.selects(names[i], i < zs.size() ? zs[i] : NAN)) {
+                bpms.push_back(i);
+            }
+        }
+    }
+    for (size_t g=0, NG=groups.size(); g<NG; g++) {
+        if (groups[g]->all == all && groups[g]->bpms == bpms) {
+            return groups[g];
+        }
+    }
+    auto group = std::make_shared<Group>();
+    group->all = all;
+    group->bpms.swap(bpms);
+    group->gathered.fill(NEVER);
+    group->value_pool.resize(group->bpms.size());
+    group->alarm_pool.resize(group->bpms.size());
+    return group;
+}
+
+// Work out again which BPMs each group selects, after the names or z change.
+void PVAOrbitSource::regroup() {
+    std::vector<std::shared_ptr<Group>> old;
+    old.swap(groups);
+    for (size_t g=0, NG=old.size(); g<NG; g++) {
+        for (size_t s=0, NS=old[g]->subscribers.size(); s<NS; s++) {
+            std::shared_ptr<Subscriber> sub(old[g]->subscribers[s]);
+            sub->group = findGroup(sub->request);
+            if (sub->group->subscribers.empty()) {
+                groups.push_back(sub->group);
+            }
+            sub->group->subscribers.push_back(sub);
+            //The client's table changes shape, so send it all again.
+            sub->sent.fill(NEVER);
+        }
+    }
+}
+
+void PVAOrbitSource::setNames(const std::vector<std::string>& n) {
+    Guard G(mutex);
+    names = n;
+    pvxs::shared_array<std::string> ns(n.size());
+    std::copy(n.begin(), n.end(), ns.begin());
+    full = Columns();
+    full.names = ns.freeze();
+    generation[COL_NAME]++;
+    // The held values belong to the old BPMs, even if there are as many
+    // new ones: start over at the next orbit.
+    for (size_t j=0; j<NUM_AXES; j++) {
+        last_value[j].clear();
+    }
+    have_orbit = false;
+    regroup();
+}
+
+void PVAOrbitSource::setZs(const std::vector<double>& z) {
+    Guard G(mutex);
+    zs = z;
+    pvxs::shared_array<double> zv(z.size());
+    std::copy(z.begin(), z.end(), zv.begin());
+    full.z = zv.freeze();
+    generation[COL_Z]++;
+    regroup();
+}
+
+void PVAOrbitSource::onSearch(Search& op) {
+    for (auto& name : op) {
+        if (pvname == name.name()) {
+            name.claim();
+        }
+    }
+}
+
+void PVAOrbitSource::onCreate(std::unique_ptr<pvxs::server::ChannelControl>&& op) {
+    if (op->name() != pvname) {
+        return;
+    }
+    std::shared_ptr<pvxs::server::ChannelControl> chan(std::move(op));
+    chan->onOp([this](std::unique_ptr<pvxs::server::ConnectOp>&& cop) {
+        Request request;
+        std::string error;
+        if (!parseRequest(cop->pvRequest(), request, error)) {
+            cop->error(error);
+            return;
+        }
+        cop->onGet([this, request](std::unique_ptr<pvxs::server::ExecOp>&& eop) {
+            eop->reply(snapshot(request));
+        });
+        cop->onPut([](std::unique_ptr<pvxs::server::ExecOp>&& eop, pvxs::Value&&) {
+            eop->error("Read-only");
+        });
+        cop->connect(tableValue.cloneEmpty());
+    });
+    chan->onSubscribe([this](std::unique_ptr<pvxs::server::MonitorSetupOp>&& sop) {
+        subscribe(std::move(sop));
+    });
+    std::weak_ptr<pvxs::server::ChannelControl> weak(chan);
+    chan->onClose([this, weak](const std::string&) {
+        std::shared_ptr<pvxs::server::ChannelControl> closed(weak.lock());
+        Guard G(mutex);
+        channels.erase(closed);
+    });
+    Guard G(mutex);
+    channels.insert(chan);
+}
+
+void PVAOrbitSource::subscribe(std::unique_ptr<pvxs::server::MonitorSetupOp>&& setup) {
+    auto sub = std::make_shared<Subscriber>();
+    std::string error;
+    if (!parseRequest(setup->pvRequest(), sub->request, error)) {
+        setup->error(error);
+        return;
+    }
+    sub->seen = 0u;
+    sub->sent.fill(NEVER);
+    sub->initialized = false;
+    sub->incomplete = false;
+    Guard G(mutex);
+    std::shared_ptr<Group> group(findGroup(sub->request));
+    if (!group->all && group->bpms.empty()) {
+        setup->error("No BPMs match the request");
+        return;
+    }
+    setup->onClose([this, sub](const std::string&) {
+        unsubscribe(sub);
+    });
+    sub->group = group;
+    sub->op = setup->connect(tableValue.cloneEmpty());
+    if (group->subscribers.empty()) {
+        groups.push_back(group);
+    }
+    group->subscribers.push_back(sub);
+    if (have_orbit) {
+        sub->seen++;
+        sub->op->post(update(*sub));
+    }
+}
+
+void PVAOrbitSource::unsubscribe(const std::shared_ptr<Subscriber>& sub) {
+    Guard G(mutex);
+    std::shared_ptr<Group> group(sub->group);
+    if (!group) {
+        return;
+    }
+    auto& subs = group->subscribers;
+    subs.erase(std::remove(subs.begin(), subs.end(), sub), subs.end());
+    if (subs.empty()) {
+        groups.erase(std::remove(groups.begin(), groups.end(), group), groups.end());
+    }
+    //The op holds this callback, which holds the subscriber.
+    sub->group.reset();
+    sub->op.reset();
+}
+
+template<typename T>
+static pvxs::shared_array<const T> pick(const pvxs::shared_array<const T>& from, const std::vector<size_t>& bpms, pvxs::shared_array<T> to) {
+    for (size_t i=0, N=bpms.size(); i<N; i++) {
+        to[i] = from[bpms[i]];
+    }
+    return to.freeze();
+}
+
+// Bring a group's copy of a column up to date with the full table.
+void PVAOrbitSource::gather(Group& group, unsigned col) {
+    if (group.all || group.gathered[col] == generation[col]) {
+        return;
+    }
+    group.gathered[col] = generation[col];
+    const size_t N = group.bpms.size();
+    Columns& c = group.columns;
+    if (col == COL_NAME) {
+        c.names = pick(full.names, group.bpms, pvxs::shared_array<std::string>(N));
+        return;
+    }
+    if (col == COL_Z) {
+        //z is sent empty until it is known for every BPM.
+        c.z = full.z.size() == names.size() ? pick(full.z, group.bpms, pvxs::shared_array<double>(N)) : pvxs::shared_array<const double>();
+        return;
+    }
+    const size_t j = (col - COL_AXES)/3;
+    const bool have = full.value[j].size() == names.size();
+    switch ((col - COL_AXES) % 3) {
+    case 0:
+        c.value[j] = have ? pick(full.value[j], group.bpms, group.value_pool.get()) : pvxs::shared_array<const double>();
+        break;
+    case 1:
+        c.severity[j] = have ? pick(full.severity[j], group.bpms, group.alarm_pool.get()) : pvxs::shared_array<const epicsUInt16>();
+        break;
+    default:
+        c.status[j] = have ? pick(full.status[j], group.bpms, group.alarm_pool.get()) : pvxs::shared_array<const epicsUInt16>();
+        break;
+    }
+}
+
+// The next update for one subscriber: the columns it asked for which have
+// changed since it was last sent them.
+pvxs::Value PVAOrbitSource::update(Subscriber& sub) {
+    Group& group = *sub.group;
+    const Columns& c = group.all ? full : group.columns;
+    pvxs::Value v(sub.initialized ? tableValue.cloneEmpty() : tableValue.clone());
+    for (unsigned col=0; col<NUM_COLUMNS; col++) {
+        if (!(sub.request.columns & (1u << col)) || sub.sent[col] == generation[col]) {
+            continue;
+        }
+        gather(group, col);
+        sub.sent[col] = generation[col];
+        pvxs::Value field(v[column_field[col]]);
+        if (col == COL_NAME) {
+            field = c.names;
+        } else if (col == COL_Z) {
+            field = c.z;
+        } else {
+            const size_t j = (col - COL_AXES)/3;
+            switch ((col - COL_AXES) % 3) {
+            case 0: field = c.value[j]; break;
+            case 1: field = c.severity[j]; break;
+            default: field = c.status[j]; break;
+            }
+        }
+    }
+    if (!sub.initialized || sub.incomplete != incomplete) {
+        sub.incomplete = incomplete;
+        v["alarm.severity"] = incomplete ? 1 : 0;
+        v["alarm.message"] = incomplete ? "Incomplete" : "";
+    }
+    if (have_orbit) {
+        v["timeStamp.secondsPastEpoch"] = ts.secPastEpoch;
+        v["timeStamp.nanoseconds"] = ts.nsec;
+    }
+    sub.initialized = true;
+    return v;
+}
+
+// The whole table as a request selects it, for a get.
+pvxs::Value PVAOrbitSource::snapshot(const Request& request) {
+    Guard G(mutex);
+    Subscriber sub;
+    sub.request = request;
+    sub.group = findGroup(request);
+    sub.sent.fill(NEVER);
+    sub.initialized = false;
+    sub.incomplete = false;
+    return update(sub);
+}
+
+template<typename T>
+static bool same(const pvxs::shared_array<const T>& a, const std::vector<T>& b) {
+    return a.size() == b.size() && std::equal(b.begin(), b.end(), a.begin());
+}
+
+// Builds the columns of the orbit once, holding the last good value for
+// entries which went missing, then sends each subscriber its share.
+void PVAOrbitSource::setCompletedOrbit(const OrbitData& o) {
+    Guard G(mutex);
+    const size_t N = o.size();
+    if (last_value[AXIS_X].size() != N) {
+        for (size_t j=0; j<NUM_AXES; j++) {
+            last_value[j].assign(N, 0.0);
+        }
+        value_pool.resize(N);
+        alarm_pool.resize(N);
+    }
+    for (size_t j=0; j<NUM_AXES; j++) {
+        const std::vector<double>& value = o.value[j];
+        const std::vector<epicsUInt16>& severity = o.severity[j];
+        std::vector<double>& last = last_value[j];
+        pvxs::shared_array<double> val(value_pool.get());
+        for (size_t i=0; i<N; i++) {
+            if (severity[i] != MISSING_SEVERITY) {
+                last[i] = value[i];
+            }
+            val[i] = last[i];
+        }
+        full.value[j] = val.freeze();
+        generation[COL_AXES + 3*j]++;
+        if (!same(full.severity[j], severity)) {
+            pvxs::shared_array<epicsUInt16> sev(alarm_pool.get());
+            std::copy(severity.begin(), severity.end(), sev.begin());
+            full.severity[j] = sev.freeze();
+            generation[COL_AXES + 3*j + 1]++;
+        }
+        if (!same(full.status[j], o.status[j])) {
+            pvxs::shared_array<epicsUInt16> stat(alarm_pool.get());
+            std::copy(o.status[j].begin(), o.status[j].end(), stat.begin());
+            full.status[j] = stat.freeze();
+            generation[COL_AXES + 3*j + 2]++;
+        }
+    }
+    incomplete = !o.complete;
+    ts = o.ts;
+    have_orbit = true;
+    for (size_t g=0, NG=groups.size(); g<NG; g++) {
+        const std::vector<std::shared_ptr<Subscriber>>& subs = groups[g]->subscribers;
+        for (size_t s=0, NS=subs.size(); s<NS; s++) {
+            Subscriber& sub = *subs[s];
+            if (sub.seen++ % sub.request.decimate != 0u) {
+                continue;
+            }
+            sub.op->post(update(sub));
+        }
+    }
+}
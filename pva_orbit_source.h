@@ -0,0 +1,108 @@
+#ifndef PVA_ORBIT_SOURCE_H
+#define PVA_ORBIT_SOURCE_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <set>
+#include <memory>
+#include <pvxs/server.h>
+#include <pvxs/source.h>
+#include <pvxs/sharedArray.h>
+#include "orbit.h"
+#include "column_pool.h"
+
+// Serves the orbit table under one PV name, like PVAOrbitReceiver, but as
+// a pvxs Source so that each client gets only what its pvRequest asks for:
+//   record[bpms=NAME|NAME|...]   only these BPMs
+//   record[regions=LTUH|UNDH]    only BPMs in these areas (BPMS:<area>:<unit>)
+//   record[zmin=Z,zmax=Z]        only BPMs within this range of z
+//   record[decimate=N]           only every Nth orbit
+//   field(value.x_val,...)       only these columns
+// The columns of each orbit are built once.  Clients without a BPM filter
+// are sent those very arrays, and clients with the same BPM filter share
+// one gathered copy of each column they asked for.
+class PVAOrbitSource : public pvxs::server::Source, public Receiver
+{
+public:
+    PVAOrbitSource(Orbit& orbit, const std::string& pvname, QueuePolicy policy = QUEUE_DROP_OLDEST);
+    virtual ~PVAOrbitSource();
+    Orbit& orbit;
+    const std::string pvname;
+    // what to do when posting falls behind assembly
+    const QueuePolicy policy;
+    void close();
+    virtual ReceiverOptions options() const;
+    virtual void setNames(const std::vector<std::string>& n);
+    virtual void setZs(const std::vector<double>& zs);
+    virtual void setCompletedOrbit(const OrbitData& o);
+    virtual void onSearch(Search& op);
+    virtual void onCreate(std::unique_ptr<pvxs::server::ChannelControl>&& op);
+    // Columns of the table, in the order of the value structure.
+    enum {COL_NAME, COL_Z, COL_AXES, NUM_COLUMNS = COL_AXES + 3*NUM_AXES};
+private:
+    struct Columns {
+        pvxs::shared_array<const std::string> names;
+        pvxs::shared_array<const double> z;
+        std::array<pvxs::shared_array<const double>, NUM_AXES> value;
+        std::array<pvxs::shared_array<const epicsUInt16>, NUM_AXES> severity, status;
+    };
+    // What one client asked for.
+    struct Request {
+        std::set<std::string> bpms;
+        std::vector<std::string> regions;
+        double zmin, zmax;
+        size_t decimate;
+        // bit per column
+        unsigned columns;
+        bool selects(const std::string& name, double z) const;
+        bool everything() const;
+    };
+    struct Group;
+    struct Subscriber {
+        Request request;
+        std::unique_ptr<pvxs::server::MonitorControlOp> op;
+        std::shared_ptr<Group> group;
+        // orbits seen, for decimation
+        size_t seen;
+        // generation of each column last sent
+        std::array<size_t, NUM_COLUMNS> sent;
+        bool initialized, incomplete;
+    };
+    // Clients selecting the same BPMs, and the columns gathered for them.
+    struct Group {
+        // the BPMs selected, or empty when all are
+        std::vector<size_t> bpms;
+        bool all;
+        Columns columns;
+        std::array<size_t, NUM_COLUMNS> gathered;
+        ColumnPool<double> value_pool;
+        ColumnPool<epicsUInt16> alarm_pool;
+        std::vector<std::shared_ptr<Subscriber>> subscribers;
+    };
+    bool parseRequest(const pvxs::Value& pvRequest, Request& request, std::string& error) const;
+    std::shared_ptr<Group> findGroup(const Request& request);
+    void regroup();
+    void subscribe(std::unique_ptr<pvxs::server::MonitorSetupOp>&& op);
+    void unsubscribe(const std::shared_ptr<Subscriber>& sub);
+    void gather(Group& group, unsigned col);
+    pvxs::Value update(Subscriber& sub);
+    pvxs::Value snapshot(const Request& request);
+    epicsMutex mutex;
+    pvxs::Value tableValue;
+    std::set<std::shared_ptr<pvxs::server::ChannelControl>> channels;
+    std::vector<std::shared_ptr<Group>> groups;
+    std::vector<std::string> names;
+    std::vector<double> zs;
+    // Columns of the last orbit, and how many times each has changed.
+    Columns full;
+    std::array<size_t, NUM_COLUMNS> generation;
+    bool have_orbit, incomplete;
+    epicsTimeStamp ts;
+    // Last good value of every entry, held for entries which go missing.
+    std::array<std::vector<double>, NUM_AXES> last_value;
+    ColumnPool<double> value_pool;
+    ColumnPool<epicsUInt16> alarm_pool;
+};
+
+#endif // PVA_ORBIT_SOURCE_H
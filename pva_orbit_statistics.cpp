@@ -0,0 +1,123 @@
+#include "pva_orbit_statistics.h"
+#include <algorithm>
+#include <pvxs/data.h>
+#include <pvxs/sharedArray.h>
+
+static const char* axis_prefix[NUM_AXES] = {"value.x", "value.y", "value.tmit"};
+
+template<typename T>
+static pvxs::shared_array<const T> to_array(const std::vector<T>& v) {
+    pvxs::shared_array<T> arr(v.size());
+    std::copy(v.begin(), v.end(), arr.begin());
+    return arr.freeze();
+}
+
+PVAOrbitStatistics::PVAOrbitStatistics(Orbit& orbit, size_t window, double period, QueuePolicy policy) :
+orbit(orbit),
+period(period),
+policy(policy),
+stats(window),
+next_post(std::chrono::steady_clock::now())
+{
+    pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+
+    statisticsValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitStatistics", {
+        pvxs::members::StringA("labels"),
+        pvxs::members::Struct("value", {
+            pvxs::members::StringA("device_name"),
+            pvxs::members::UInt32A("x_count"),
+            pvxs::members::Float64A("x_mean"),
+            pvxs::members::Float64A("x_rms"),
+            pvxs::members::Float64A("x_min"),
+            pvxs::members::Float64A("x_max"),
+            pvxs::members::Float64A("x_tmit_mean"),
+            pvxs::members::UInt32A("y_count"),
+            pvxs::members::Float64A("y_mean"),
+            pvxs::members::Float64A("y_rms"),
+            pvxs::members::Float64A("y_min"),
+            pvxs::members::Float64A("y_max"),
+            pvxs::members::Float64A("y_tmit_mean"),
+            pvxs::members::UInt32A("tmit_count"),
+            pvxs::members::Float64A("tmit_mean"),
+            pvxs::members::Float64A("tmit_rms"),
+            pvxs::members::Float64A("tmit_min"),
+            pvxs::members::Float64A("tmit_max"),
+        }),
+        pvxs::members::UInt32("window"),
+        pvxs::members::UInt32("pulses"),
+        pvxs::members::String("descriptor"),
+        pvxs::members::Struct("timeStamp", "time_t", time_t),
+    }).create();
+    pvxs::shared_array<std::string> labels({"device_name",
+        "x_count", "x_mean", "x_rms", "x_min", "x_max", "x_tmit_mean",
+        "y_count", "y_mean", "y_rms", "y_min", "y_max", "y_tmit_mean",
+        "tmit_count", "tmit_mean", "tmit_rms", "tmit_min", "tmit_max"});
+    statisticsValue["labels"] = labels.freeze();
+    statisticsValue["descriptor"] = "LCLS Orbit BPM Statistics";
+    statisticsValue["window"] = epicsUInt32(stats.window());
+    orbit.add_receiver(this);
+}
+
+PVAOrbitStatistics::~PVAOrbitStatistics() {
+    close();
+}
+
+void PVAOrbitStatistics::close() {
+    orbit.remove_receiver(this);
+    pv->close();
+}
+
+ReceiverOptions PVAOrbitStatistics::options() const {
+    return ReceiverOptions(16u, policy);
+}
+
+void PVAOrbitStatistics::setNames(const std::vector<std::string>& names) {
+    Guard G(mutex);
+    // Other BPMs, even as many as before: the window starts again.
+    if (names != bpm_names) {
+        bpm_names = names;
+        stats.reset(names.size());
+    }
+    statisticsValue["value.device_name"] = to_array(names);
+}
+
+void PVAOrbitStatistics::setZs(const std::vector<double>& zs) {
+}
+
+void PVAOrbitStatistics::setCompletedOrbit(const OrbitData& o) {
+    Guard G(mutex);
+    stats.add(o);
+    const std::chrono::steady_clock::time_point now(std::chrono::steady_clock::now());
+    if (now >= next_post) {
+        post();
+        next_post = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(period));
+    }
+}
+
+void PVAOrbitStatistics::post() {
+    stats.compute(snapshot);
+    for (size_t j=0; j<NUM_AXES; j++) {
+        const std::string prefix(axis_prefix[j]);
+        statisticsValue[prefix + "_count"] = to_array(snapshot.count[j]);
+        statisticsValue[prefix + "_mean"] = to_array(snapshot.mean[j]);
+        statisticsValue[prefix + "_rms"] = to_array(snapshot.rms[j]);
+        statisticsValue[prefix + "_min"] = to_array(snapshot.min[j]);
+        statisticsValue[prefix + "_max"] = to_array(snapshot.max[j]);
+    }
+    statisticsValue["value.x_tmit_mean"] = to_array(snapshot.x_tmit_mean);
+    statisticsValue["value.y_tmit_mean"] = to_array(snapshot.y_tmit_mean);
+    statisticsValue["pulses"] = epicsUInt32(snapshot.pulses);
+    statisticsValue["timeStamp.secondsPastEpoch"] = snapshot.ts.secPastEpoch;
+    statisticsValue["timeStamp.nanoseconds"] = snapshot.ts.nsec;
+    if (!pv->isOpen()) {
+        pv->open(statisticsValue);
+    } else {
+        pv->post(statisticsValue);
+    }
+    statisticsValue.unmark();
+}
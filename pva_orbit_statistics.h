@@ -0,0 +1,42 @@
+#ifndef PVA_ORBIT_STATISTICS_H
+#define PVA_ORBIT_STATISTICS_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+#include "orbit.h"
+#include "orbit_statistics.h"
+
+// Posts a table of per-BPM statistics over the last 'window' orbits (count
+// of valid samples, mean, rms jitter, min and max for each axis, and the
+// TMIT-weighted mean X and Y) every 'period' seconds, for clients which
+// would otherwise take every orbit to work them out.  Sees every orbit
+// only if the orbit uses DELIVER_ALL.
+struct PVAOrbitStatistics : public Receiver
+{
+    PVAOrbitStatistics(Orbit& orbit, size_t window, double period = 1.0, QueuePolicy policy = QUEUE_DROP_OLDEST);
+    virtual ~PVAOrbitStatistics();
+    Orbit& orbit;
+    const double period;
+    const QueuePolicy policy;
+    std::shared_ptr<pvxs::server::SharedPV> pv;
+    pvxs::Value statisticsValue;
+    void close();
+    virtual ReceiverOptions options() const;
+    virtual void setNames(const std::vector<std::string>& n);
+    virtual void setZs(const std::vector<double>& zs);
+    virtual void setCompletedOrbit(const OrbitData& o);
+private:
+    void post();
+    epicsMutex mutex;
+    // the BPMs in the window
+    std::vector<std::string> bpm_names;
+    RollingStatistics stats;
+    OrbitStatistics snapshot;
+    std::chrono::steady_clock::time_point next_post;
+};
+
+#endif // PVA_ORBIT_STATISTICS_H
@@ -0,0 +1,142 @@
+#include "pva_orbit_window.h"
+#include <cmath>
+#include <algorithm>
+#include <pvxs/data.h>
+#include <pvxs/sharedArray.h>
+
+static const char* axis_prefix[NUM_AXES] = {"value.x", "value.y", "value.tmit"};
+
+template<typename T>
+static pvxs::shared_array<const T> to_array(const std::vector<T>& v) {
+    pvxs::shared_array<T> arr(v.size());
+    std::copy(v.begin(), v.end(), arr.begin());
+    return arr.freeze();
+}
+
+PVAOrbitWindow::PVAOrbitWindow(Orbit& orbit, WindowKind kind, double period, QueuePolicy policy) :
+orbit(orbit),
+kind(kind),
+period(period),
+policy(policy),
+window(-1.0)
+{
+    pv = std::make_shared<pvxs::server::SharedPV>(pvxs::server::SharedPV::buildReadonly());
+    auto time_t = {
+        pvxs::members::Int32("secondsPastEpoch"),
+        pvxs::members::Int32("nanoseconds"),
+        pvxs::members::Int32("userTag"),
+    };
+
+    if (kind == WINDOW_AVERAGE) {
+        windowValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitAverage", {
+            pvxs::members::StringA("labels"),
+            pvxs::members::Struct("value", {
+                pvxs::members::StringA("device_name"),
+                pvxs::members::Float64A("z"),
+                pvxs::members::Float64A("x_val"),
+                pvxs::members::UInt32A("x_count"),
+                pvxs::members::Float64A("y_val"),
+                pvxs::members::UInt32A("y_count"),
+                pvxs::members::Float64A("tmit_val"),
+                pvxs::members::UInt32A("tmit_count"),
+            }),
+            pvxs::members::Float64("period"),
+            pvxs::members::UInt32("pulses"),
+            pvxs::members::String("descriptor"),
+            pvxs::members::Struct("timeStamp", "time_t", time_t),
+        }).create();
+        pvxs::shared_array<std::string> labels({"device_name", "z", "x_val", "x_count", "y_val", "y_count", "tmit_val", "tmit_count"});
+        windowValue["labels"] = labels.freeze();
+        windowValue["descriptor"] = "LCLS Orbit Average";
+    } else {
+        windowValue = pvxs::TypeDef(pvxs::TypeCode::Struct, "OrbitEnvelope", {
+            pvxs::members::StringA("labels"),
+            pvxs::members::Struct("value", {
+                pvxs::members::StringA("device_name"),
+                pvxs::members::Float64A("z"),
+                pvxs::members::Float64A("x_min"),
+                pvxs::members::Float64A("x_max"),
+                pvxs::members::UInt32A("x_count"),
+                pvxs::members::Float64A("y_min"),
+                pvxs::members::Float64A("y_max"),
+                pvxs::members::UInt32A("y_count"),
+                pvxs::members::Float64A("tmit_min"),
+                pvxs::members::Float64A("tmit_max"),
+                pvxs::members::UInt32A("tmit_count"),
+            }),
+            pvxs::members::Float64("period"),
+            pvxs::members::UInt32("pulses"),
+            pvxs::members::String("descriptor"),
+            pvxs::members::Struct("timeStamp", "time_t", time_t),
+        }).create();
+        pvxs::shared_array<std::string> labels({"device_name", "z", "x_min", "x_max", "x_count", "y_min", "y_max", "y_count", "tmit_min", "tmit_max", "tmit_count"});
+        windowValue["labels"] = labels.freeze();
+        windowValue["descriptor"] = "LCLS Orbit Envelope";
+    }
+    windowValue["period"] = period;
+    orbit.add_receiver(this);
+}
+
+PVAOrbitWindow::~PVAOrbitWindow() {
+    close();
+}
+
+void PVAOrbitWindow::close() {
+    orbit.remove_receiver(this);
+    pv->close();
+}
+
+ReceiverOptions PVAOrbitWindow::options() const {
+    return ReceiverOptions(16u, policy);
+}
+
+void PVAOrbitWindow::setNames(const std::vector<std::string>& names) {
+    Guard G(mutex);
+    // Other BPMs, even as many as before: the window starts again.
+    if (names != bpm_names) {
+        bpm_names = names;
+        boxcar.clear();
+    }
+    windowValue["value.device_name"] = to_array(names);
+}
+
+void PVAOrbitWindow::setZs(const std::vector<double>& zs) {
+    Guard G(mutex);
+    windowValue["value.z"] = to_array(zs);
+}
+
+void PVAOrbitWindow::setCompletedOrbit(const OrbitData& o) {
+    Guard G(mutex);
+    const double w = std::floor((o.ts.secPastEpoch + o.ts.nsec*1e-9)/period);
+    if (w != window) {
+        if (boxcar.pulses() > 0u) {
+            post();
+        }
+        boxcar.clear();
+        window = w;
+    }
+    boxcar.add(o);
+}
+
+void PVAOrbitWindow::post() {
+    boxcar.compute(summary);
+    for (size_t j=0; j<NUM_AXES; j++) {
+        const std::string prefix(axis_prefix[j]);
+        if (kind == WINDOW_AVERAGE) {
+            windowValue[prefix + "_val"] = to_array(summary.mean[j]);
+        } else {
+            windowValue[prefix + "_min"] = to_array(summary.min[j]);
+            windowValue[prefix + "_max"] = to_array(summary.max[j]);
+        }
+        windowValue[prefix + "_count"] = to_array(summary.count[j]);
+    }
+    windowValue["pulses"] = epicsUInt32(summary.pulses);
+    windowValue["timeStamp.secondsPastEpoch"] = summary.first.secPastEpoch;
+    windowValue["timeStamp.nanoseconds"] = summary.first.nsec;
+    if (!pv->isOpen()) {
+        pv->open(windowValue);
+    } else {
+        pv->post(windowValue);
+    }
+    windowValue.unmark();
+}
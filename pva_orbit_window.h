@@ -0,0 +1,52 @@
+#ifndef PVA_ORBIT_WINDOW_H
+#define PVA_ORBIT_WINDOW_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+#include "orbit.h"
+#include "orbit_statistics.h"
+
+// What PVAOrbitWindow posts for each window.
+enum WindowKind {
+    // per BPM axis, the mean of the valid samples and how many there were
+    WINDOW_AVERAGE,
+    // per BPM axis, the smallest and largest valid sample, and the count
+    WINDOW_ENVELOPE,
+};
+
+// Posts one table per 'period' seconds of pulses, summarizing the orbits
+// whose timestamps fall in that window: a boxcar average, or a min/max
+// envelope.  Windows are aligned to whole multiples of 'period', and each
+// is posted when the first pulse of the next one arrives, with the
+// timestamp of its first pulse.  Sees every orbit only if the orbit uses
+// DELIVER_ALL.
+struct PVAOrbitWindow : public Receiver
+{
+    PVAOrbitWindow(Orbit& orbit, WindowKind kind, double period, QueuePolicy policy = QUEUE_DROP_OLDEST);
+    virtual ~PVAOrbitWindow();
+    Orbit& orbit;
+    const WindowKind kind;
+    const double period;
+    const QueuePolicy policy;
+    std::shared_ptr<pvxs::server::SharedPV> pv;
+    pvxs::Value windowValue;
+    void close();
+    virtual ReceiverOptions options() const;
+    virtual void setNames(const std::vector<std::string>& n);
+    virtual void setZs(const std::vector<double>& zs);
+    virtual void setCompletedOrbit(const OrbitData& o);
+private:
+    void post();
+    epicsMutex mutex;
+    // the BPMs in the window
+    std::vector<std::string> bpm_names;
+    BoxcarStatistics boxcar;
+    OrbitWindow summary;
+    // which window the orbits in 'boxcar' belong to
+    double window;
+};
+
+#endif // PVA_ORBIT_WINDOW_H
@@ -0,0 +1,161 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+// Round up to the next power of two (minimum 2).
+inline size_t queue_capacity(size_t n) {
+    size_t cap = 2u;
+    while (cap < n) {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+// Bounded single-producer/single-consumer ring.  Elements live in the ring
+// and are filled and drained in place, so nothing is allocated once the
+// ring is built.  The producer claims back(), fills it, then push()es; the
+// consumer reads front(), then pop()s.
+template<typename T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t limit) :
+    ring(queue_capacity(limit)),
+    mask(ring.size() - 1u),
+    head(0u),
+    tail(0u)
+    {}
+
+    size_t capacity() const { return ring.size(); }
+
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0u; }
+
+    // Producer: slot for the next element, or NULL if the ring is full.
+    T* back() {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= ring.size()) {
+            return nullptr;
+        }
+        return &ring[t & mask];
+    }
+
+    // Producer: publish the slot returned by back().
+    void push() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1u, std::memory_order_release);
+    }
+
+    // Consumer: oldest element, or NULL if the ring is empty.
+    T* front() {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &ring[h & mask];
+    }
+
+    // Consumer: release the slot returned by front() back to the producer.
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1u, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> ring;
+    const size_t mask;
+    std::atomic<size_t> head;
+    char pad[64];
+    std::atomic<size_t> tail;
+
+    SPSCQueue(const SPSCQueue&);
+    SPSCQueue& operator=(const SPSCQueue&);
+};
+
+// Bounded multi-producer/multi-consumer queue of small copyable values
+// (Dmitry Vyukov's array queue).  push() fails instead of blocking when full.
+template<typename T>
+class MPMCQueue {
+public:
+    explicit MPMCQueue(size_t limit) :
+    cells(queue_capacity(limit)),
+    mask(cells.size() - 1u),
+    enqueue_pos(0u),
+    dequeue_pos(0u)
+    {
+        for (size_t i=0, N=cells.size(); i<N; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const { return cells.size(); }
+
+    bool empty() const {
+        return enqueue_pos.load() == dequeue_pos.load();
+    }
+
+    bool push(const T& v) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            const size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1u)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = v;
+        cell->sequence.store(pos + 1u, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& v) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            const size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos + 1u);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1u)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        v = cell->value;
+        cell->sequence.store(pos + mask + 1u, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+        Cell() : sequence(0u), value() {}
+        Cell(const Cell& o) : sequence(o.sequence.load()), value(o.value) {}
+    };
+    std::vector<Cell> cells;
+    const size_t mask;
+    std::atomic<size_t> enqueue_pos;
+    char pad[64];
+    std::atomic<size_t> dequeue_pos;
+
+    MPMCQueue(const MPMCQueue&);
+    MPMCQueue& operator=(const MPMCQueue&);
+};
+
+#endif //QUEUE_H
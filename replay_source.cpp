@@ -0,0 +1,164 @@
+#include "replay_source.h"
+#include <stdio.h>
+#include <chrono>
+#include <algorithm>
+#include <db_access.h>
+
+ReplaySource::ReplaySource(const std::string& path, const ReplayConfig& config) :
+reader(path),
+config(config),
+running(true),
+done(false),
+num_pulses(0u)
+{
+    const std::vector<std::string>& names = reader.names();
+    for (size_t i=0, N=names.size(); i<N; i++) {
+        bpm_index[names[i]] = i;
+    }
+    sinks.resize(NUM_AXES*names.size());
+}
+
+void ReplaySource::start() {
+    if (!player.joinable()) {
+        player = std::thread(&ReplaySource::run, this);
+    }
+}
+
+ReplaySource::~ReplaySource() {
+    close();
+}
+
+void ReplaySource::close() {
+    running = false;
+    wakeup.signal();
+    if (player.joinable()) {
+        player.join();
+    }
+}
+
+// The axis a channel name ends in: X, Y or TMIT after the last ':'.
+// Returns false for anything else.
+static bool axis_for(const std::string& name, size_t& sep, size_t& axis) {
+    sep = name.rfind(':');
+    if (sep == std::string::npos) {
+        return false;
+    }
+    const std::string suffix(name.substr(sep + 1u));
+    if (suffix == "X") {
+        axis = AXIS_X;
+    } else if (suffix == "Y") {
+        axis = AXIS_Y;
+    } else if (suffix == "TMIT") {
+        axis = AXIS_TMIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// The recorded column for a channel name, from the BPM name before the last
+// ':' and the axis after it.  Returns false if the recording lacks it.
+static bool column_for(const std::string& name, const std::map<std::string, size_t>& bpm_index, size_t& column) {
+    size_t sep, axis;
+    if (!axis_for(name, sep, axis)) {
+        return false;
+    }
+    std::map<std::string, size_t>::const_iterator it(bpm_index.find(name.substr(0, sep)));
+    if (it == bpm_index.end()) {
+        return false;
+    }
+    column = axis*bpm_index.size() + it->second;
+    return true;
+}
+
+void ReplaySource::subscribe(Channel* sink) {
+    Guard G(mutex);
+    size_t column, sep, axis;
+    if (!axis_for(sink->name, sep, axis)) {
+        printf("%s is not an X, Y or TMIT channel\n", sink->name.c_str());
+        return;
+    }
+    if (!column_for(sink->name, bpm_index, column)) {
+        printf("%s is not in the recording\n", sink->name.c_str());
+        return;
+    }
+    sinks[column].push_back(sink);
+    sink->set_connected(true);
+}
+
+void ReplaySource::unsubscribe(Channel* sink) {
+    Guard G(mutex);
+    size_t column;
+    if (column_for(sink->name, bpm_index, column)) {
+        std::vector<Channel*>& s = sinks[column];
+        s.erase(std::remove(s.begin(), s.end(), sink), s.end());
+    }
+}
+
+size_t ReplaySource::size() {
+    Guard G(mutex);
+    size_t n = 0u;
+    for (size_t c=0, N=sinks.size(); c<N; c++) {
+        n += !sinks[c].empty();
+    }
+    return n;
+}
+
+// Whether every channel's queue can take another update.
+bool ReplaySource::has_room() {
+    for (size_t c=0, N=sinks.size(); c<N; c++) {
+        for (size_t s=0, NS=sinks[c].size(); s<NS; s++) {
+            if (!sinks[c][s]->values.back()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void ReplaySource::run() {
+    const size_t first = config.start ? reader.find(config.start) : 0u;
+    const size_t last = config.end ? reader.find(config.end + 1u) : reader.size();
+    if (first >= last) {
+        done = true;
+        return;
+    }
+    const epicsTimeStamp first_ts(reader.timestamp(first));
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    const epicsUInt32 shift = now.secPastEpoch >= first_ts.secPastEpoch ? now.secPastEpoch + 1u - first_ts.secPastEpoch : 0u;
+    const size_t N = sinks.size();
+    const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+    for (size_t i=first; i<last && running; i++) {
+        epicsTimeStamp ts(reader.timestamp(i));
+        if (config.speed > 0.0) {
+            const double due = epicsTimeDiffInSeconds(&ts, &first_ts)/config.speed;
+            while (running) {
+                const double wait = due - std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (wait <= 0.0) {
+                    break;
+                }
+                wakeup.wait(wait);
+            }
+        }
+        ts.secPastEpoch += shift;
+        const double* values = reader.values(i);
+        const epicsUInt16* severities = reader.severities(i);
+        const epicsUInt16* statuses = reader.statuses(i);
+        Guard G(mutex);
+        while (config.speed <= 0.0 && running && !has_room()) {
+            UnGuard U(G);
+            std::this_thread::yield();
+        }
+        for (size_t c=0; c<N; c++) {
+            if (severities[c] == MISSING_SEVERITY) {
+                continue;
+            }
+            for (size_t s=0, NS=sinks[c].size(); s<NS; s++) {
+                sinks[c][s]->post(ts, severities[c], statuses[c], DBR_TIME_DOUBLE, 1u, &values[c]);
+            }
+        }
+        num_pulses++;
+    }
+    done = true;
+}
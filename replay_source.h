@@ -0,0 +1,67 @@
+#ifndef REPLAY_SOURCE_H
+#define REPLAY_SOURCE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include "pv.h"
+#include "orbit_recording.h"
+
+// Knobs for ReplaySource.
+struct ReplayConfig {
+    // 1 for the original pace, 10 for ten times as fast, and 0 for as fast
+    // as the orbits can take it (never overflowing a channel queue)
+    double speed;
+    // range of pulses to replay, as keys (seconds << 32 | nsec); 0 for the
+    // whole recording
+    epicsUInt64 start;
+    epicsUInt64 end;
+    ReplayConfig() : speed(1.0), start(0u), end(0u) {}
+};
+
+// Feeds a recording back to the channels it was made from, from a single
+// thread, so a problem can be reproduced or a change measured against the
+// same input every time.  Each recorded pulse posts one DBR_TIME_DOUBLE
+// update per BPM axis which reported; axes which were missing stay
+// missing.  Channels are matched to the recording by BPM name and axis
+// letter, whatever their EDEF suffix.  Timestamps are moved on by a
+// whole number of seconds, to the present, so that pulse IDs are kept and
+// assembly doesn't expire the pulses as stale.
+class ReplaySource : public ChannelSource {
+public:
+    // Throws std::runtime_error if the recording can't be read.
+    ReplaySource(const std::string& path, const ReplayConfig& config);
+    virtual ~ReplaySource();
+    virtual void subscribe(Channel* sink);
+    virtual void unsubscribe(Channel* sink);
+    virtual size_t size();
+    // Begin replaying, once the orbits have subscribed.
+    void start();
+    void close();
+    const OrbitRecordingReader& recording() const { return reader; }
+    // pulses replayed so far, and whether the replay is over
+    size_t pulses() const { return num_pulses; }
+    bool finished() const { return done; }
+private:
+    void run();
+    bool has_room();
+    const OrbitRecordingReader reader;
+    const ReplayConfig config;
+    epicsMutex mutex;
+    epicsEvent wakeup;
+    std::atomic<bool> running;
+    std::atomic<bool> done;
+    std::atomic<size_t> num_pulses;
+    std::map<std::string, size_t> bpm_index;
+    // subscribers of each recorded column (axis*num_bpms + bpm)
+    std::vector<std::vector<Channel*>> sinks;
+    std::thread player;
+    EPICS_NOT_COPYABLE(ReplaySource)
+};
+
+#endif //REPLAY_SOURCE_H
@@ -0,0 +1,188 @@
+#include "synthetic_source.h"
+#include <cmath>
+#include <functional>
+#include <algorithm>
+#include <alarm.h>
+#include <db_access.h>
+
+SyntheticSource::SyntheticSource(const SyntheticConfig& config) :
+config(config),
+running(true),
+num_pulses(0u),
+rng(config.seed),
+start(std::chrono::steady_clock::now()),
+pid_mask(0x1FFFFu)
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    start_ns = epicsUInt64(now.secPastEpoch)*1000000000u + now.nsec;
+    // Shrink the pulse ID field until it can't make timestamps run
+    // backwards, which only matters above a few kHz.
+    const double period_ns = 1e9/config.rate;
+    while (pid_mask > 0u && 2.0*(pid_mask + 1u) >= period_ns) {
+        pid_mask >>= 1;
+    }
+    generator = std::thread(&SyntheticSource::run, this);
+}
+
+SyntheticSource::~SyntheticSource() {
+    close();
+}
+
+void SyntheticSource::close() {
+    running = false;
+    wakeup.signal();
+    if (generator.joinable()) {
+        generator.join();
+    }
+}
+
+void SyntheticSource::subscribe(Channel* sink) {
+    Guard G(mutex);
+    std::shared_ptr<Signal>& signal = signals[sink->name];
+    if (!signal) {
+        signal = std::make_shared<Signal>();
+        signal->name = sink->name;
+        const size_t sep = sink->name.rfind(':');
+        const char axis = sep == std::string::npos ? '\0' : sink->name[sep + 1u];
+        signal->axis = axis;
+        // Same phase for every axis of a BPM.
+        signal->phase = double(std::hash<std::string>()(sink->name.substr(0, sep)) % 1000u) * (2.0*M_PI/1000.0);
+        signal->connected = true;
+        signal->reconnect_at = 0.0;
+        active.push_back(signal);
+    }
+    signal->sinks.push_back(sink);
+    if (signal->connected) {
+        sink->set_connected(true);
+    }
+}
+
+void SyntheticSource::unsubscribe(Channel* sink) {
+    Guard G(mutex);
+    std::map<std::string, std::shared_ptr<Signal>>::iterator it(signals.find(sink->name));
+    if (it == signals.end()) {
+        return;
+    }
+    std::vector<Channel*>& sinks = it->second->sinks;
+    sinks.erase(std::remove(sinks.begin(), sinks.end(), sink), sinks.end());
+    if (sinks.empty()) {
+        active.erase(std::remove(active.begin(), active.end(), it->second), active.end());
+        signals.erase(it);
+    }
+}
+
+size_t SyntheticSource::size() {
+    Guard G(mutex);
+    return signals.size();
+}
+
+double SyntheticSource::elapsed() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void SyntheticSource::run() {
+    size_t k = 0u;
+    while (running) {
+        double next;
+        {
+            Guard G(mutex);
+            const double now = elapsed();
+            // If we fall behind, catch up in a burst rather than slipping.
+            while (k/config.rate <= now) {
+                pulse(k/config.rate, k);
+                k++;
+                num_pulses++;
+            }
+            while (!pending.empty() && pending.top().at <= now) {
+                deliver(pending.top());
+                pending.pop();
+            }
+            next = k/config.rate;
+            if (!pending.empty()) {
+                next = std::min(next, pending.top().at);
+            }
+        }
+        const double wait = next - elapsed();
+        if (wait > 0.0) {
+            wakeup.wait(wait);
+        }
+    }
+}
+
+// Generate pulse 'k', due 't' seconds after start.
+void SyntheticSource::pulse(double t, size_t k) {
+    const epicsUInt64 ns = start_ns + epicsUInt64(t*1e9);
+    epicsTimeStamp ts;
+    ts.secPastEpoch = epicsUInt32(ns/1000000000u);
+    ts.nsec = epicsUInt32(ns%1000000000u);
+    ts.nsec = (ts.nsec & ~pid_mask) | (epicsUInt32(k) & pid_mask);
+
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    for (size_t i=0, N=active.size(); i<N; i++) {
+        Signal& signal = *active[i];
+        if (!signal.connected && signal.reconnect_at <= t) {
+            signal.connected = true;
+            for (size_t s=0, NS=signal.sinks.size(); s<NS; s++) {
+                signal.sinks[s]->set_connected(true);
+            }
+        }
+    }
+    if (config.disconnects > 0.0 && !active.empty() && uniform(rng) < config.disconnects/config.rate) {
+        Signal& signal = *active[size_t(uniform(rng)*active.size()) % active.size()];
+        if (signal.connected) {
+            signal.connected = false;
+            signal.reconnect_at = t + config.downtime;
+            for (size_t s=0, NS=signal.sinks.size(); s<NS; s++) {
+                signal.sinks[s]->set_connected(false);
+            }
+        }
+    }
+
+    Delivery d;
+    d.ts = ts;
+    for (size_t i=0, N=active.size(); i<N; i++) {
+        d.signal = active[i];
+        if (!d.signal->connected || (config.drop > 0.0 && uniform(rng) < config.drop)) {
+            continue;
+        }
+        // Millimetres for X and Y, electrons for TMIT.
+        const double beat = 2.0*M_PI*0.01*k + d.signal->phase;
+        if (d.signal->axis == 'X') {
+            d.value = 0.1*std::sin(beat) + 0.005*noise(rng);
+        } else if (d.signal->axis == 'Y') {
+            d.value = 0.1*std::cos(beat) + 0.005*noise(rng);
+        } else {
+            d.value = 1e9*(1.0 + 0.01*noise(rng));
+        }
+        const int copies = (config.duplicate > 0.0 && uniform(rng) < config.duplicate) ? 2 : 1;
+        for (int c=0; c<copies; c++) {
+            double delay = config.jitter*uniform(rng);
+            d.injected = c > 0;
+            if (config.reorder > 0.0 && uniform(rng) < config.reorder) {
+                delay += (1 + int(uniform(rng)*4.0)) / config.rate;
+                d.injected = true;
+            }
+            if (delay <= 0.0) {
+                deliver(d);
+            } else {
+                d.at = t + delay;
+                pending.push(d);
+            }
+        }
+    }
+}
+
+void SyntheticSource::deliver(const Delivery& d) {
+    if (!d.signal->connected) {
+        return;
+    }
+    for (size_t s=0, NS=d.signal->sinks.size(); s<NS; s++) {
+        if (d.injected) {
+            d.signal->sinks[s]->enqueue(d.ts, NO_ALARM, NO_ALARM, DBR_TIME_DOUBLE, 1u, &d.value);
+        } else {
+            d.signal->sinks[s]->post(d.ts, NO_ALARM, NO_ALARM, DBR_TIME_DOUBLE, 1u, &d.value);
+        }
+    }
+}
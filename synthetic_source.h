@@ -0,0 +1,110 @@
+#ifndef SYNTHETIC_SOURCE_H
+#define SYNTHETIC_SOURCE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include "pv.h"
+
+// Knobs for SyntheticSource.  Fractions are per update, per channel.
+struct SyntheticConfig {
+    // pulses per second
+    double rate;
+    // each update is delivered after a uniformly random delay of up to this
+    // many seconds, so channels report a pulse in no particular order
+    double jitter;
+    // fraction of updates held back an extra 1-4 pulse periods, so a
+    // channel's updates can also arrive out of order
+    double reorder;
+    // fraction of updates never delivered
+    double drop;
+    // fraction of updates delivered twice with the same timestamp
+    double duplicate;
+    // channel disconnects per second, over all channels
+    double disconnects;
+    // how long a disconnected channel stays down, in seconds
+    double downtime;
+    unsigned int seed;
+    SyntheticConfig() :
+        rate(120.0),
+        jitter(0.0),
+        reorder(0.0),
+        drop(0.0),
+        duplicate(0.0),
+        disconnects(0.0),
+        downtime(1.0),
+        seed(1u)
+    {}
+};
+
+// Simulates BPM channels in process, without any IOC.  Each subscribed name
+// gets one DBR_TIME_DOUBLE update per pulse, from a single generator thread.
+// Timestamps carry the pulse ID in the low bits of nsec, as at LCLS.  Names
+// ending in X or Y get a slow betatron-like oscillation plus noise; anything
+// else is treated as TMIT.
+//
+// The one thread is what keeps a run repeatable for a given seed, and it
+// caps the rate: about 3 million channel updates per CPU second (1.7 million
+// with jitter, which goes through 'pending'), so 100 BPMs up to about
+// 10 kHz, or 1000 BPMs up to about 1 kHz.  Past that, pulses are generated
+// late, in bursts.
+class SyntheticSource : public ChannelSource {
+public:
+    explicit SyntheticSource(const SyntheticConfig& config);
+    virtual ~SyntheticSource();
+    virtual void subscribe(Channel* sink);
+    virtual void unsubscribe(Channel* sink);
+    virtual size_t size();
+    void close();
+    // pulses generated so far
+    size_t pulses() const { return num_pulses; }
+private:
+    struct Signal {
+        std::string name;
+        char axis;
+        double phase;
+        bool connected;
+        double reconnect_at;
+        std::vector<Channel*> sinks;
+    };
+    struct Delivery {
+        double at;
+        std::shared_ptr<Signal> signal;
+        epicsTimeStamp ts;
+        double value;
+        // a repeat or reordered update, which skips the channel's check
+        // that timestamps advance
+        bool injected;
+        bool operator<(const Delivery& o) const { return at > o.at; }
+    };
+    void run();
+    void pulse(double t, size_t k);
+    void deliver(const Delivery& d);
+    double elapsed() const;
+    const SyntheticConfig config;
+    epicsMutex mutex;
+    epicsEvent wakeup;
+    std::atomic<bool> running;
+    std::atomic<size_t> num_pulses;
+    std::map<std::string, std::shared_ptr<Signal>> signals;
+    // 'signals' in a stable order, for picking one at random
+    std::vector<std::shared_ptr<Signal>> active;
+    std::priority_queue<Delivery> pending;
+    std::mt19937 rng;
+    std::chrono::steady_clock::time_point start;
+    epicsUInt64 start_ns;
+    epicsUInt32 pid_mask;
+    std::thread generator;
+    EPICS_NOT_COPYABLE(SyntheticSource)
+};
+
+#endif //SYNTHETIC_SOURCE_H